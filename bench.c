@@ -0,0 +1,438 @@
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <limits.h>
+#include <libgen.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sqlite3.h>
+
+#include "types.h"
+
+/* Fleet throughput benchmark, runs ble against the simulated dongle
+ * (blesim) and reports polling rate, procedure latency and CPU cost */
+
+/* Benchmark defaults */
+#define BENCH_DEFAULT_SENSORS   (16)
+#define BENCH_DEFAULT_DURATION  (120)
+#define BENCH_DEFAULT_INTERVAL  (1)
+
+/* Simulator arguments, fixed plus pass through */
+#define BENCH_MAX_SIM_ARGS  (32)
+
+/* One simulator per adapter */
+#define BENCH_MAX_ADAPTERS  (4)
+
+/* Latency procedures reported by simulator */
+#define BENCH_MAX_LATENCY  (16)
+
+typedef struct
+{
+  pid_t  pid;
+  FILE  *output;
+} bench_process_t;
+
+typedef struct
+{
+  char   name[32];
+  uint32 count;
+  double total;
+  double max;
+} bench_latency_t;
+
+static int32 bench_num_sensors = BENCH_DEFAULT_SENSORS;
+static int32 bench_duration = BENCH_DEFAULT_DURATION;
+static int32 bench_interval = BENCH_DEFAULT_INTERVAL;
+static int32 bench_num_adapters = 1;
+static int32 bench_keep = 0;
+static char *bench_streams = NULL;
+static int32 bench_background_scan = 0;
+static bench_latency_t bench_latency_list[BENCH_MAX_LATENCY];
+static int32 bench_num_latency = 0;
+
+
+static int32 bench_seed (void)
+{
+  sqlite3 *db = NULL;
+  int32 status = -1;
+
+  if ((sqlite3_open ("gateway.db", &db)) == SQLITE_OK)
+  {
+    int32 index;
+    char *statement;
+
+    /* Same layout as 'Device List' in device.c */
+    status = sqlite3_exec (db, "CREATE TABLE IF NOT EXISTS [Device List] ("
+                               " [No.] INTEGER PRIMARY KEY,"
+                               " [Address] TEXT COLLATE NOCASE NOT NULL DEFAULT NA,"
+                               " [Name] TEXT COLLATE NOCASE NOT NULL DEFAULT NA,"
+                               " [Service] TEXT COLLATE NOCASE NOT NULL DEFAULT NA,"
+                               " [Interval] INTEGER NOT NULL DEFAULT NA,"
+                               " [Status] TEXT COLLATE NOCASE NOT NULL DEFAULT NA );"
+                               "BEGIN;", NULL, NULL, NULL);
+
+    /* Simulator sensor addresses are 00:07:80:<index + 1> */
+    for (index = 1; ((status == SQLITE_OK) && (index <= bench_num_sensors)); index++)
+    {
+      statement = sqlite3_mprintf ("INSERT INTO [Device List] (Address, Name, Service, Interval, Status) "
+                                   "VALUES ('000780%06X', 'Sensor %d', '1809', %d, 'Searching');",
+                                   index, index, bench_interval);
+      status = sqlite3_exec (db, statement, NULL, NULL, NULL);
+      sqlite3_free (statement);
+    }
+
+    if (status == SQLITE_OK)
+    {
+      status = sqlite3_exec (db, "COMMIT;", NULL, NULL, NULL);
+    }
+
+    if (status == SQLITE_OK)
+    {
+      status = 1;
+    }
+    else
+    {
+      printf ("Unable to seed device list, %s\n", sqlite3_errmsg (db));
+      status = -1;
+    }
+  }
+  else
+  {
+    printf ("Unable to open gateway.db\n");
+  }
+
+  sqlite3_close (db);
+
+  return status;
+}
+
+static int32 bench_spawn (char *argv[], char *log_file, bench_process_t *process)
+{
+  int pipe_fd[2] = {-1, -1};
+  int32 status = -1;
+
+  if ((log_file != NULL) || ((pipe (pipe_fd)) == 0))
+  {
+    process->pid = fork ();
+
+    if (process->pid == 0)
+    {
+      int file_desc;
+
+      if (log_file != NULL)
+      {
+        file_desc = open (log_file, (O_WRONLY | O_CREAT | O_TRUNC), 0644);
+        dup2 (file_desc, STDERR_FILENO);
+      }
+      else
+      {
+        file_desc = pipe_fd[1];
+        close (pipe_fd[0]);
+      }
+
+      dup2 (file_desc, STDOUT_FILENO);
+      close (file_desc);
+
+      execv (argv[0], argv);
+      printf ("Unable to run %s\n", argv[0]);
+      _exit (127);
+    }
+    else if (process->pid > 0)
+    {
+      process->output = NULL;
+
+      if (log_file == NULL)
+      {
+        close (pipe_fd[1]);
+        process->output = fdopen (pipe_fd[0], "r");
+      }
+
+      status = 1;
+    }
+    else
+    {
+      printf ("Unable to fork %s\n", argv[0]);
+    }
+  }
+
+  return status;
+}
+
+static void bench_cleanup (char *directory)
+{
+  DIR *dir;
+  struct dirent *entry;
+
+  if ((dir = opendir (directory)) != NULL)
+  {
+    while ((entry = readdir (dir)) != NULL)
+    {
+      if (entry->d_name[0] != '.')
+      {
+        (void)unlinkat (dirfd (dir), entry->d_name, 0);
+      }
+    }
+
+    closedir (dir);
+  }
+
+  (void)rmdir (directory);
+}
+
+static void bench_stop (bench_process_t *sim, int32 num_sims)
+{
+  int32 index;
+
+  for (index = 0; index < num_sims; index++)
+  {
+    kill (sim[index].pid, SIGKILL);
+    waitpid (sim[index].pid, NULL, 0);
+  }
+}
+
+static void bench_latency (char *line)
+{
+  char name[32];
+  uint32 count;
+  double mean;
+  double max;
+  int32 index;
+
+  if ((sscanf (line, "latency %31s count %u mean %lf max %lf", name, &count, &mean, &max)) == 4)
+  {
+    for (index = 0; index < bench_num_latency; index++)
+    {
+      if ((strcmp (bench_latency_list[index].name, name)) == 0)
+      {
+        break;
+      }
+    }
+
+    if ((index == bench_num_latency) && (index < BENCH_MAX_LATENCY))
+    {
+      strcpy (bench_latency_list[index].name, name);
+      bench_num_latency++;
+    }
+
+    if (index < bench_num_latency)
+    {
+      bench_latency_list[index].count += count;
+      bench_latency_list[index].total += (mean * count);
+      if (max > bench_latency_list[index].max)
+      {
+        bench_latency_list[index].max = max;
+      }
+    }
+  }
+}
+
+static void bench_usage (char *name)
+{
+  printf ("Usage: %s [-n sensors] [-a adapters] [-t duration (s)] [-i interval (min)] [-s streams] [-p] [-k]\n"
+          "          [-- simulator options]\n", name);
+}
+
+int main (int argc, char *argv[])
+{
+  char directory[] = "/tmp/blebench.XXXXXX";
+  char ble_path[PATH_MAX + 8];
+  char sim_path[PATH_MAX + 8];
+  char *sim_argv[BENCH_MAX_SIM_ARGS];
+  char *ble_argv[(2 * BENCH_MAX_ADAPTERS) + 5];
+  char sensors[16];
+  char line[PATH_MAX];
+  char *bin_directory;
+  char pty[BENCH_MAX_ADAPTERS][128];
+  bench_process_t sim[BENCH_MAX_ADAPTERS];
+  bench_process_t ble;
+  struct rusage usage;
+  struct timespec duration;
+  double elapsed = 0;
+  uint32 samples = 0;
+  double cpu_user;
+  double cpu_system;
+  int32 num_args = 0;
+  int32 num_sims;
+  int32 index;
+  int option;
+
+  while ((option = getopt (argc, argv, "n:a:t:i:s:pkh")) != -1)
+  {
+    switch (option)
+    {
+      case 'n': bench_num_sensors  = atoi (optarg); break;
+      case 'a': bench_num_adapters = atoi (optarg); break;
+      case 't': bench_duration     = atoi (optarg); break;
+      case 'i': bench_interval     = atoi (optarg); break;
+      case 's': bench_streams      = optarg;        break;
+      case 'p': bench_background_scan = 1;          break;
+      case 'k': bench_keep         = 1;             break;
+      default:
+      {
+        bench_usage (argv[0]);
+        return 1;
+      }
+    }
+  }
+
+  if ((bench_num_sensors < 1) || (bench_duration < 1) || (bench_interval < 1) ||
+      (bench_num_adapters < 1) || (bench_num_adapters > BENCH_MAX_ADAPTERS) ||
+      ((argc - optind) > (BENCH_MAX_SIM_ARGS - 4)))
+  {
+    bench_usage (argv[0]);
+    return 1;
+  }
+
+  /* ble & blesim are built next to blebench */
+  if ((realpath (argv[0], line)) == NULL)
+  {
+    printf ("Unable to resolve %s\n", argv[0]);
+    return 1;
+  }
+
+  bin_directory = dirname (line);
+  snprintf (ble_path, sizeof (ble_path), "%s/ble", bin_directory);
+  snprintf (sim_path, sizeof (sim_path), "%s/blesim", bin_directory);
+
+  if (((mkdtemp (directory)) == NULL) || ((chdir (directory)) != 0))
+  {
+    printf ("Unable to create work directory\n");
+    return 1;
+  }
+
+  if ((bench_seed ()) < 0)
+  {
+    bench_cleanup (directory);
+    return 1;
+  }
+
+  /* Every simulated dongle sees the whole fleet, as if sharing the air */
+  snprintf (sensors, sizeof (sensors), "%d", bench_num_sensors);
+  sim_argv[num_args++] = sim_path;
+  sim_argv[num_args++] = "-n";
+  sim_argv[num_args++] = sensors;
+  while (optind < argc)
+  {
+    sim_argv[num_args++] = argv[optind++];
+  }
+  sim_argv[num_args] = NULL;
+
+  num_args = 0;
+  ble_argv[num_args++] = ble_path;
+
+  for (num_sims = 0; num_sims < bench_num_adapters; num_sims++)
+  {
+    if ((bench_spawn (sim_argv, NULL, &(sim[num_sims]))) < 0)
+    {
+      bench_stop (sim, num_sims);
+      bench_cleanup (directory);
+      return 1;
+    }
+
+    /* First line from simulator is its pty */
+    if (((fgets (line, sizeof (line), sim[num_sims].output)) == NULL) ||
+        ((sscanf (line, "pty %127s", pty[num_sims])) != 1))
+    {
+      printf ("Simulator did not start\n");
+      bench_stop (sim, (num_sims + 1));
+      bench_cleanup (directory);
+      return 1;
+    }
+
+    ble_argv[num_args++] = "-d";
+    ble_argv[num_args++] = pty[num_sims];
+  }
+
+  /* Streams per adapter, passed on to ble */
+  if (bench_streams != NULL)
+  {
+    ble_argv[num_args++] = "-s";
+    ble_argv[num_args++] = bench_streams;
+  }
+
+  if (bench_background_scan)
+  {
+    ble_argv[num_args++] = "-p";
+  }
+
+  ble_argv[num_args] = NULL;
+
+  printf ("Benchmark %d sensors, %d adapter(s), %d s, interval %d min, work directory %s\n",
+          bench_num_sensors, bench_num_adapters, bench_duration, bench_interval, directory);
+
+  if ((bench_spawn (ble_argv, "ble.log", &ble)) < 0)
+  {
+    bench_stop (sim, num_sims);
+    bench_cleanup (directory);
+    return 1;
+  }
+
+  duration.tv_sec  = bench_duration;
+  duration.tv_nsec = 0;
+  while (((nanosleep (&duration, &duration)) < 0) && (errno == EINTR));
+
+  kill (ble.pid, SIGTERM);
+  memset (&usage, 0, sizeof (usage));
+  wait4 (ble.pid, NULL, 0, &usage);
+
+  for (index = 0; index < num_sims; index++)
+  {
+    double sim_elapsed = 0;
+    uint32 sim_samples = 0;
+
+    kill (sim[index].pid, SIGINT);
+
+    while ((fgets (line, sizeof (line), sim[index].output)) != NULL)
+    {
+      if ((strncmp (line, "latency", 7)) == 0)
+      {
+        bench_latency (line);
+      }
+      else
+      {
+        (void)sscanf (line, "elapsed %lf", &sim_elapsed);
+        (void)sscanf (line, "samples %u", &sim_samples);
+      }
+    }
+
+    fclose (sim[index].output);
+    waitpid (sim[index].pid, NULL, 0);
+
+    samples += sim_samples;
+    elapsed  = (sim_elapsed > elapsed) ? sim_elapsed : elapsed;
+  }
+
+  for (index = 0; index < bench_num_latency; index++)
+  {
+    printf ("latency %-16s count %6u mean %8.1f max %8.1f (ms)\n", bench_latency_list[index].name,
+            bench_latency_list[index].count,
+            ((bench_latency_list[index].count > 0) ? (bench_latency_list[index].total/bench_latency_list[index].count)
+                                                    : 0.0),
+            bench_latency_list[index].max);
+  }
+
+  cpu_user   = usage.ru_utime.tv_sec + (usage.ru_utime.tv_usec/1000000.0);
+  cpu_system = usage.ru_stime.tv_sec + (usage.ru_stime.tv_usec/1000000.0);
+
+  printf ("samples %u\n", samples);
+  printf ("devices/min %.1f\n", ((elapsed > 0) ? ((samples * 60.0)/elapsed) : 0.0));
+  printf ("cpu user %.3f system %.3f (s)\n", cpu_user, cpu_system);
+  printf ("cpu/sample %.3f (ms)\n",
+          ((samples > 0) ? (((cpu_user + cpu_system) * 1000.0)/samples) : 0.0));
+
+  if (bench_keep == 0)
+  {
+    bench_cleanup (directory);
+  }
+
+  return 0;
+}
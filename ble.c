@@ -14,24 +14,22 @@
 struct timer_list_entry
 {
   struct timer_list_entry *next;
+  struct timer_list_entry *prev;
   timer_info_t             info;
 };
 
 typedef struct timer_list_entry timer_list_entry_t;
 
-LIST_HEAD_INIT (timer_list_entry_t, timer_expiry_list);
-
 struct ble_message_list_entry
 {
   struct ble_message_list_entry *next;
+  struct ble_message_list_entry *prev;
   ble_message_t                  message;
 };
 
 typedef struct ble_message_list_entry ble_message_list_entry_t;
 
-LIST_HEAD_INIT (ble_message_list_entry_t, ble_message_list);
-
-LIST_HEAD_INIT (ble_device_list_entry_t, ble_device_list);
+DLIST_HEAD_INIT (ble_device_list);
 
 typedef struct
 {
@@ -40,85 +38,585 @@ typedef struct
   ble_char_list_entry_t    *characteristics;
   ble_attribute_t          *attribute;
   uint8                     handle;
-  timer_info_t             *timer_info;
+  int32                     timer;
+  int32                     stream;
+  int32                     stream_pending;
+  int32                     pooled;
+  int32                     connect_time;
 } ble_connection_params_t;
 
-static ble_connection_params_t connection_params = 
+/* Receive ring, size must be power of 2. Tail space past the end holds
+   the wrapped part of a frame so every frame is contiguous */
+#define BLE_RX_BUFFER_SIZE  (4096)
+#define BLE_RX_BUFFER_MASK  (BLE_RX_BUFFER_SIZE - 1)
+
+/* Wait for command response, 100 ms */
+#define BLE_RESPONSE_TIMEOUT  (100)
+
+typedef struct
 {
-  .device          = NULL,
-  .service         = NULL,
-  .characteristics = NULL,
-  .attribute       = NULL,
-  .handle          = 0xff,
-  .timer_info      = NULL,
-};
+  uint32 head;
+  uint32 tail;
+  uint32 resync;
+  uint8  data[BLE_RX_BUFFER_SIZE + (sizeof (ble_message_t))];
+} ble_rx_buffer_t;
 
-static int32 ble_init_time = 0;
+/* Last report per address, direct mapped */
+typedef struct
+{
+  ble_device_address_t address;
+  uint32               hash;
+  int32                time;
+} ble_scan_cache_entry_t;
 
+/* Per adapter (dongle) worker, own serial device, queues & connections.
+   Connection contexts are indexed by connection handle */
+typedef struct
+{
+  int32                     index;
+  int32                     init_time;
+  int32                     max_connections;
+  dlist_head_t              timer_expiry_list;
+  dlist_head_t              message_list;
+  ble_device_list_entry_t  *device;
+  ble_connection_params_t  *connect_pending;
+  ble_connection_params_t  *evict_pending;
+  int32                     connect_time;
+  uint32                    pool_hits;
+  uint32                    pool_misses;
+  ble_scan_mode_e           scan_mode;
+  ble_scan_mode_e           scan_config;
+  int32                     scan_retry;
+  int32                     scan_interval;
+  int32                     scan_duty;
+  int32                     scan_start;
+  int32                     scan_expected;
+  int32                     scan_found;
+  ble_connection_params_t  *scan_connection;
+  uint32                    scan_queued;
+  uint32                    scan_reports;
+  uint32                    scan_duplicates;
+  uint32                    scan_drops;
+  ble_device_address_t      whitelist[BLE_WHITELIST_SIZE];
+  uint8                     whitelist_seen[BLE_WHITELIST_SIZE];
+  int32                     whitelist_length;
+  ble_device_address_t      whitelist_next;
+  int32                     whitelist_rotate;
+  ble_scan_cache_entry_t    scan_cache[BLE_SCAN_CACHE_SIZE];
+  ble_connection_params_t   connection_list[BLE_MAX_CONNECTIONS];
+  ble_schedule_t            schedule;
+  ble_rx_buffer_t           rx_buffer;
+} ble_adapter_t;
+
+static ble_adapter_t ble_adapter_list[BLE_MAX_ADAPTERS];
+static int32 ble_num_adapters = 0;
+
+/* Connections per adapter kept up for streaming, 0 to always poll */
+static int32 ble_max_streams = 0;
+
+/* Passive scan in between GAP procedures */
+static int32 ble_background_scan = 0;
+
+/* Adapter being serviced & connection of the current message */
+static ble_adapter_t *ble_adapter = &(ble_adapter_list[0]);
+static ble_connection_params_t *connection_params = &(ble_adapter_list[0].connection_list[0]);
+
+
+static void ble_rx_reset (void)
+{
+  ble_adapter->rx_buffer.head = 0;
+  ble_adapter->rx_buffer.tail = 0;
+}
 
-static void ble_update_sleep (void)
+static int32 ble_rx_fill (void)
 {
-  int32 current_time;
+  int32 bytes_read = 0;
+  uint32 offset;
+  uint32 bytes;
+
+  offset = ble_adapter->rx_buffer.tail & BLE_RX_BUFFER_MASK;
+  bytes  = BLE_RX_BUFFER_SIZE - (ble_adapter->rx_buffer.tail - ble_adapter->rx_buffer.head);
+
+  /* Contiguous free space only, next fill picks up after wrap */
+  if (bytes > (BLE_RX_BUFFER_SIZE - offset))
+  {
+    bytes = BLE_RX_BUFFER_SIZE - offset;
+  }
+
+  if (bytes > 0)
+  {
+    bytes_read = serial_rx (ble_adapter->index, bytes, &(ble_adapter->rx_buffer.data[offset]));
+    if (bytes_read > 0)
+    {
+      ble_adapter->rx_buffer.tail += bytes_read;
+    }
+  }
+
+  return bytes_read;
+}
+
+static ble_message_t * ble_rx_frame (void)
+{
+  ble_message_t *message = NULL;
+
+  while ((ble_adapter->rx_buffer.tail - ble_adapter->rx_buffer.head) >= (sizeof (ble_message_header_t)))
+  {
+    uint32 offset = ble_adapter->rx_buffer.head & BLE_RX_BUFFER_MASK;
+    uint8  type   = ble_adapter->rx_buffer.data[offset];
+    uint8  class  = ble_adapter->rx_buffer.data[(offset + 2) & BLE_RX_BUFFER_MASK];
+    uint32 length;
+
+    /* Drop a byte and retry until header looks sane */
+    if (((type != BLE_RESPONSE) && (type != BLE_EVENT)) || (class > BLE_CLASS_TEST))
+    {
+      if (ble_adapter->rx_buffer.resync == 0)
+      {
+        printf ("BLE Receive out of sync, type 0x%02x, class 0x%02x\n", type, class);
+      }
+
+      ble_adapter->rx_buffer.head++;
+      ble_adapter->rx_buffer.resync++;
+      continue;
+    }
+
+    length = (sizeof (ble_message_header_t)) +
+             ble_adapter->rx_buffer.data[(offset + 1) & BLE_RX_BUFFER_MASK];
+
+    if ((ble_adapter->rx_buffer.tail - ble_adapter->rx_buffer.head) >= length)
+    {
+      if ((offset + length) > BLE_RX_BUFFER_SIZE)
+      {
+        memcpy (&(ble_adapter->rx_buffer.data[BLE_RX_BUFFER_SIZE]), &(ble_adapter->rx_buffer.data[0]),
+                ((offset + length) - BLE_RX_BUFFER_SIZE));
+      }
+
+      message = (ble_message_t *)(&(ble_adapter->rx_buffer.data[offset]));
+      ble_adapter->rx_buffer.resync = 0;
+    }
+
+    break;
+  }
+
+  return message;
+}
+
+static void ble_rx_consume (ble_message_t *message)
+{
+  ble_adapter->rx_buffer.head += (sizeof (message->header)) + message->header.length;
+}
+
+static void ble_clear_connection (ble_connection_params_t *connection)
+{
+  connection->device          = NULL;
+  connection->service         = NULL;
+  connection->characteristics = NULL;
+  connection->attribute       = NULL;
+  connection->handle          = 0xff;
+  connection->timer           = -1;
+  connection->stream          = 0;
+  connection->stream_pending  = 0;
+  connection->pooled          = 0;
+  connection->connect_time    = 0;
+}
+
+/* Context holding the device, NULL if not connected on the adapter */
+static ble_connection_params_t * ble_find_connection (ble_adapter_t *adapter,
+                                                      ble_device_list_entry_t *device_list_entry)
+{
+  int32 index;
+
+  for (index = 0; index < adapter->max_connections; index++)
+  {
+    if (adapter->connection_list[index].device == device_list_entry)
+    {
+      return &(adapter->connection_list[index]);
+    }
+  }
+
+  return NULL;
+}
+
+/* Connections of the data cycle, streams & idle pooled connections
+   stay up across cycles */
+static int32 ble_active_connections (void)
+{
+  int32 active = 0;
+  int32 index;
+
+  for (index = 0; index < ble_adapter->max_connections; index++)
+  {
+    if ((ble_adapter->connection_list[index].device != NULL) &&
+        (!(ble_adapter->connection_list[index].stream))      &&
+        (!(ble_adapter->connection_list[index].pooled)))
+    {
+      active++;
+    }
+  }
+
+  return active;
+}
+
+static int32 ble_stream_connections (void)
+{
+  int32 streams = 0;
+  int32 index;
+
+  for (index = 0; index < ble_adapter->max_connections; index++)
+  {
+    if (ble_adapter->connection_list[index].stream)
+    {
+      streams++;
+    }
+  }
+
+  return streams;
+}
+
+static int32 ble_pooled_connections (void)
+{
+  int32 pooled = 0;
+  int32 index;
+
+  for (index = 0; index < ble_adapter->max_connections; index++)
+  {
+    if (ble_adapter->connection_list[index].pooled)
+    {
+      pooled++;
+    }
+  }
+
+  return pooled;
+}
+
+static ble_connection_params_t * ble_free_connection (void)
+{
+  int32 index;
+
+  /* Released stream waits for its disconnect */
+  for (index = 0; index < ble_adapter->max_connections; index++)
+  {
+    if ((ble_adapter->connection_list[index].device == NULL) &&
+        (!(ble_adapter->connection_list[index].stream)))
+    {
+      return &(ble_adapter->connection_list[index]);
+    }
+  }
+
+  return NULL;
+}
+
+/* Select connection context of an event or timer, keyed by handle */
+static void ble_route_message (ble_message_t *message)
+{
+  int32 connection = -1;
+
+  if (message->header.type == BLE_EVENT)
+  {
+    if ((message->header.class == BLE_CLASS_CONNECTION) ||
+        (message->header.class == BLE_CLASS_ATTR_CLIENT))
+    {
+      /* Connection handle is the first field of these events */
+      connection = message->data[0];
+    }
+    else if ((message->header.class == BLE_CLASS_HW) &&
+             (message->header.command == BLE_EVENT_SOFT_TIMER))
+    {
+      connection = message->data[1];
+    }
+  }
+
+  if ((connection >= 0) && (connection < ble_adapter->max_connections))
+  {
+    connection_params = &(ble_adapter->connection_list[connection]);
+  }
+}
+
+
+/* (Re)schedule services of a device on its adapter after update times
+   or adapter changed */
+static void ble_schedule_device (ble_device_list_entry_t *device_list_entry)
+{
+  int32 current_time = clock_get_count ();
+  ble_service_list_entry_t *service_list_entry = device_list_entry->service_list;
+
+  while (service_list_entry != NULL)
+  {
+    if ((service_list_entry->update.char_list != NULL) &&
+        (device_list_entry->adapter >= 0) && (device_list_entry->adapter < ble_num_adapters))
+    {
+      service_list_entry->update.wait = service_list_entry->update.time - current_time;
+      if (service_list_entry->update.wait < 0)
+      {
+        service_list_entry->update.wait = 0;
+      }
+
+      ble_schedule_service (&(ble_adapter_list[device_list_entry->adapter].schedule),
+                            service_list_entry, device_list_entry);
+    }
+    else
+    {
+      ble_unschedule_service (service_list_entry);
+    }
+
+    service_list_entry = service_list_entry->next;
+  }
+}
+
+/* Adapter load of a device, polls per hour */
+static int32 ble_device_load (ble_device_list_entry_t *device_list_entry)
+{
+  int32 load = 0;
+  ble_service_list_entry_t *service_list_entry = device_list_entry->service_list;
+
+  while (service_list_entry != NULL)
+  {
+    if (service_list_entry->update.interval > 0)
+    {
+      load += (60 * 60 * 1000)/service_list_entry->update.interval;
+    }
+
+    service_list_entry = service_list_entry->next;
+  }
+
+  return (load > 0) ? load : 1;
+}
+
+static void ble_balance_device_list (void)
+{
+  int32 load[BLE_MAX_ADAPTERS];
+  int32 min_adapter;
+  int32 max_adapter;
+  int32 index;
   ble_device_list_entry_t *device_list_entry;
-  
-  current_time      = clock_get_count ();
-  device_list_entry = ble_device_list;
 
-  while (device_list_entry != NULL)
+  if (ble_num_adapters == 0)
   {
-    if ((device_list_entry->status == BLE_DEVICE_DATA)  ||
-        (device_list_entry->status == BLE_DEVICE_DISCOVER))
+    return;
+  }
+
+  memset (load, 0, sizeof (load));
+
+  for (device_list_entry = (ble_device_list_entry_t *)(ble_device_list.head); device_list_entry != NULL;
+       device_list_entry = device_list_entry->next)
+  {
+    if ((device_list_entry->adapter >= 0) && (device_list_entry->adapter < ble_num_adapters))
     {
-      ble_service_list_entry_t *service_list_entry = device_list_entry->service_list;
+      load[device_list_entry->adapter] += ble_device_load (device_list_entry);
+    }
+  }
 
-      while (service_list_entry != NULL)
+  /* New (or orphaned) devices go to the least loaded adapter */
+  for (device_list_entry = (ble_device_list_entry_t *)(ble_device_list.head); device_list_entry != NULL;
+       device_list_entry = device_list_entry->next)
+  {
+    if ((device_list_entry->adapter < 0) || (device_list_entry->adapter >= ble_num_adapters))
+    {
+      min_adapter = 0;
+      for (index = 1; index < ble_num_adapters; index++)
       {
-        if (service_list_entry->update.char_list != NULL)
+        if (load[index] < load[min_adapter])
         {
-          service_list_entry->update.wait = service_list_entry->update.time - current_time;
-          if (service_list_entry->update.wait < 0)
-          {
-            service_list_entry->update.wait = 0;
-          }
+          min_adapter = index;
         }
-          
-        service_list_entry = service_list_entry->next;
+      }
+
+      device_list_entry->adapter = min_adapter;
+      load[min_adapter] += ble_device_load (device_list_entry);
+      ble_schedule_device (device_list_entry);
+    }
+  }
+
+  /* Pull one idle device from the busiest adapter to the current one,
+     if that lowers the peak load */
+  max_adapter = 0;
+  for (index = 1; index < ble_num_adapters; index++)
+  {
+    if (load[index] > load[max_adapter])
+    {
+      max_adapter = index;
+    }
+  }
+
+  if (max_adapter != ble_adapter->index)
+  {
+    for (device_list_entry = (ble_device_list_entry_t *)(ble_device_list.head); device_list_entry != NULL;
+         device_list_entry = device_list_entry->next)
+    {
+      if ((device_list_entry->adapter == max_adapter)                   &&
+          ((device_list_entry->status == BLE_DEVICE_DISCOVER)         ||
+           (device_list_entry->status == BLE_DEVICE_DISCOVER_SERVICE) ||
+           (device_list_entry->status == BLE_DEVICE_DATA))               &&
+          ((ble_find_connection (&(ble_adapter_list[max_adapter]), device_list_entry)) == NULL) &&
+          ((load[ble_adapter->index] + ble_device_load (device_list_entry)) < load[max_adapter]))
+      {
+        printf ("BLE Device moved from adapter %d to %d\n", max_adapter, ble_adapter->index);
+        ble_print_device (device_list_entry);
+
+        device_list_entry->adapter = ble_adapter->index;
+        ble_schedule_device (device_list_entry);
+        break;
       }
     }
-    
-    device_list_entry = device_list_entry->next;
   }
 }
 
-static int32 ble_response (ble_message_t *response)
+/* Mark due services of the subtree, heap order bounds the walk to them */
+static void ble_update_due (ble_schedule_t *schedule, int32 index, int32 current_time)
 {
-  ble_message_t message;
-  int32 status;
+  if ((index < schedule->length) &&
+      ((schedule->entry[index].service->update.time - current_time) <= 0))
+  {
+    ble_schedule_entry_t *schedule_entry = &(schedule->entry[index]);
+
+    if ((schedule_entry->device->status == BLE_DEVICE_DATA) ||
+        (schedule_entry->device->status == BLE_DEVICE_DISCOVER))
+    {
+      schedule_entry->service->update.wait = 0;
+    }
+
+    ble_update_due (schedule, ((2 * index) + 1), current_time);
+    ble_update_due (schedule, ((2 * index) + 2), current_time);
+  }
+}
+
+/* Earliest update of the subtree among devices in data/discover state,
+   subtrees later than the best so far are skipped */
+static void ble_next_update (ble_schedule_t *schedule, int32 index, ble_schedule_entry_t **next_entry)
+{
+  if ((index < schedule->length) &&
+      ((*next_entry == NULL) ||
+       ((schedule->entry[index].service->update.time - (*next_entry)->service->update.time) < 0)))
+  {
+    ble_schedule_entry_t *schedule_entry = &(schedule->entry[index]);
+
+    if ((schedule_entry->device->status == BLE_DEVICE_DATA) ||
+        (schedule_entry->device->status == BLE_DEVICE_DISCOVER))
+    {
+      *next_entry = schedule_entry;
+    }
+    else
+    {
+      ble_next_update (schedule, ((2 * index) + 1), next_entry);
+      ble_next_update (schedule, ((2 * index) + 2), next_entry);
+    }
+  }
+}
+
+static void ble_update_sleep (void)
+{
+  int32 current_time;
+  int32 index;
+  
+  current_time = clock_get_count ();
+
+  for (index = 0; index < ble_num_adapters; index++)
+  {
+    ble_update_due (&(ble_adapter_list[index].schedule), 0, current_time);
+  }
+}
+
+/* First service of the device due for update */
+static ble_service_list_entry_t * ble_find_data (ble_device_list_entry_t *device_list_entry)
+{
+  ble_service_list_entry_t *service_list_entry = device_list_entry->service_list;
 
-  while ((status = serial_rx (sizeof (message.header), (uint8 *)(&(message.header)))) > 0)
+  while (service_list_entry != NULL)
   {
-    if (message.header.length > 0)
+    if ((service_list_entry->update.char_list != NULL) &&
+        (service_list_entry->update.wait <= 0))
     {
-      status = serial_rx (message.header.length, message.data);
+      break;
     }
 
-    if (status > 0)
+    service_list_entry = service_list_entry->next;
+  }
+
+  return service_list_entry;
+}
+
+/* Advance adapter cursor to the next device with given status, skip
+   devices already connected or with nothing due */
+static ble_device_list_entry_t * ble_next_device (int32 status)
+{
+  ble_device_list_entry_t *device_list_entry;
+
+  while ((device_list_entry = ble_adapter->device) != NULL)
+  {
+    ble_adapter->device = device_list_entry->next;
+
+    if ((device_list_entry->adapter == ble_adapter->index) &&
+        (device_list_entry->status == status)               &&
+        ((ble_find_connection (ble_adapter, device_list_entry)) == NULL) &&
+        ((status != BLE_DEVICE_DATA) || ((ble_find_data (device_list_entry)) != NULL)))
+    {
+      break;
+    }
+  }
+
+  return device_list_entry;
+}
+
+/* Advertising devices are read by scanning */
+static int32 ble_check_scan_device (ble_device_list_entry_t *device_list_entry)
+{
+  return ((device_list_entry->adapter == ble_adapter->index) &&
+          ((device_list_entry->status == BLE_DEVICE_DISCOVER) ||
+           (device_list_entry->status == BLE_DEVICE_ADVERTISE)));
+}
+
+static int32 ble_check_scan_message (ble_message_t *message)
+{
+  return ((message->header.type == BLE_EVENT) && (message->header.class == BLE_CLASS_GAP) &&
+          (message->header.command == BLE_EVENT_SCAN_RESPONSE));
+}
+
+static int32 ble_response (ble_message_t *response)
+{
+  ble_message_t *message;
+  int32 status = 1;
+
+  while (status > 0)
+  {
+    message = ble_rx_frame ();
+
+    if (message != NULL)
     {
-      if ((response->header.type != message.header.type)        ||
-          (response->header.class != message.header.class)      ||
-          (response->header.command != message.header.command))
+      if ((response->header.type != message->header.type)        ||
+          (response->header.class != message->header.class)      ||
+          (response->header.command != message->header.command))
       {
-        ble_message_list_entry_t *message_list_entry 
-            = (ble_message_list_entry_t *)malloc (sizeof (*message_list_entry));
-        message_list_entry->message = message;
-        list_add ((list_entry_t **)(&ble_message_list), (list_entry_t *)message_list_entry);
+        /* Advert floods are shed rather than queued */
+        if ((ble_check_scan_message (message)) &&
+            (ble_adapter->scan_queued >= BLE_MAX_QUEUED_SCAN))
+        {
+          ble_adapter->scan_drops++;
+        }
+        else
+        {
+          ble_message_list_entry_t *message_list_entry 
+              = (ble_message_list_entry_t *)malloc (sizeof (*message_list_entry));
+          memcpy (&(message_list_entry->message), message,
+                  ((sizeof (message->header)) + message->header.length));
+          dlist_add (&(ble_adapter->message_list), (dlist_entry_t *)message_list_entry);
+
+          if (ble_check_scan_message (message))
+          {
+            ble_adapter->scan_queued++;
+          }
+        }
+        ble_rx_consume (message);
       }
       else
       {
-        *response = message;
+        memcpy (response, message, ((sizeof (message->header)) + message->header.length));
+        ble_rx_consume (message);
         break;
       }
     }
+    else if ((status = ble_rx_fill ()) == 0)
+    {
+      status = serial_poll (ble_adapter->index, BLE_RESPONSE_TIMEOUT);
+    }
   }
 
   return status;
@@ -128,7 +626,7 @@ static int32 ble_command (ble_message_t *message)
 {
   int32 status;
 
-  status = serial_tx (((sizeof (message->header)) + message->header.length),
+  status = serial_tx (ble_adapter->index, ((sizeof (message->header)) + message->header.length),
                       ((uint8 *)message));
 
   if (status > 0)
@@ -144,7 +642,7 @@ static void ble_init_timer (void)
 {
   int32 wakeup_time;
   int32 sleep_interval;
-  ble_service_list_entry_t *service_list_entry = connection_params.device->service_list;
+  ble_service_list_entry_t *service_list_entry = connection_params->device->service_list;
   
   wakeup_time    = clock_get_count ();
   sleep_interval = ble_get_sleep ();
@@ -178,7 +676,7 @@ static int32 ble_reset (void)
   reset = (ble_command_reset_t *)(&message);
   BLE_CLASS_SYSTEM_HEADER (reset, BLE_COMMAND_RESET);
   reset->mode = BLE_RESET_NORMAL;
-  status = serial_tx (((sizeof (reset->header)) + reset->header.length),
+  status = serial_tx (ble_adapter->index, ((sizeof (reset->header)) + reset->header.length),
                       (uint8 *)reset);
   
   if (status <= 0)
@@ -211,21 +709,58 @@ static int32 ble_hello (void)
   return status;
 }
 
-static int32 ble_end_procedure (void)
+static int32 ble_get_connections (void)
 {
   int32 status;
   ble_message_t message;
-  ble_command_end_procedure_t *end_procedure;
+  ble_command_get_connections_t *get_connections;
 
-  printf ("BLE End procedure request\n");
+  printf ("BLE Get connections request\n");
 
-  end_procedure = (ble_command_end_procedure_t *)(&message);
-  BLE_CLASS_GAP_HEADER (end_procedure, BLE_COMMAND_END_PROCEDURE);
+  get_connections = (ble_command_get_connections_t *)(&message);
+  BLE_CLASS_SYSTEM_HEADER (get_connections, BLE_COMMAND_GET_CONNECTIONS);
   status = ble_command (&message);
 
   if (status > 0)
   {
-    ble_response_end_procedure_t *end_procedure_rsp = (ble_response_end_procedure_t *)(&message);
+    ble_response_get_connections_t *get_connections_rsp = (ble_response_get_connections_t *)(&message);
+
+    ble_adapter->max_connections = get_connections_rsp->max_connections;
+    if (ble_adapter->max_connections > BLE_MAX_CONNECTIONS)
+    {
+      ble_adapter->max_connections = BLE_MAX_CONNECTIONS;
+    }
+    else if (ble_adapter->max_connections < 1)
+    {
+      ble_adapter->max_connections = 1;
+    }
+
+    printf ("BLE Max connections %d\n", ble_adapter->max_connections);
+  }
+  else
+  {
+    printf ("BLE Get connections response failed with %d\n", status);
+    status = -1;
+  }
+
+  return status;
+}
+
+static int32 ble_end_procedure (void)
+{
+  int32 status;
+  ble_message_t message;
+  ble_command_end_procedure_t *end_procedure;
+
+  printf ("BLE End procedure request\n");
+
+  end_procedure = (ble_command_end_procedure_t *)(&message);
+  BLE_CLASS_GAP_HEADER (end_procedure, BLE_COMMAND_END_PROCEDURE);
+  status = ble_command (&message);
+
+  if (status > 0)
+  {
+    ble_response_end_procedure_t *end_procedure_rsp = (ble_response_end_procedure_t *)(&message);
     if (end_procedure_rsp->result != 0)
     {
       printf ("BLE End procedure response received with failure %d\n", end_procedure_rsp->result);
@@ -240,18 +775,272 @@ static int32 ble_end_procedure (void)
   return status;
 }
 
+static int32 ble_append_whitelist (ble_device_address_t *address)
+{
+  int32 status;
+  ble_message_t message;
+  ble_command_whitelist_t *whitelist;
+
+  whitelist = (ble_command_whitelist_t *)(&message);
+  BLE_CLASS_SYSTEM_HEADER (whitelist, BLE_COMMAND_APPEND_WHITELIST);
+  whitelist->device_address = *address;
+  bin_reverse (whitelist->device_address.byte, BLE_DEVICE_ADDRESS_LENGTH);
+  status = ble_command (&message);
+
+  if (status > 0)
+  {
+    ble_response_whitelist_t *whitelist_rsp = (ble_response_whitelist_t *)(&message);
+    if (whitelist_rsp->result != 0)
+    {
+      printf ("BLE Append whitelist response received with failure %d\n", whitelist_rsp->result);
+      status = -1;
+    }
+  }
+  else
+  {
+    printf ("BLE Append whitelist failed with %d\n", status);
+  }
+
+  return status;
+}
+
+static int32 ble_clear_whitelist (void)
+{
+  int32 status;
+  ble_message_t message;
+  ble_command_clear_whitelist_t *whitelist;
+
+  whitelist = (ble_command_clear_whitelist_t *)(&message);
+  BLE_CLASS_SYSTEM_HEADER (whitelist, BLE_COMMAND_CLEAR_WHITELIST);
+  status = ble_command (&message);
+
+  if (status <= 0)
+  {
+    printf ("BLE Clear whitelist failed with %d\n", status);
+    status = -1;
+  }
+
+  return status;
+}
+
+/* Load the next chunk of scanned devices into the stack whitelist,
+   only rewritten when the chunk changes. Without a whitelist the scan
+   takes all advertisers */
+static void ble_load_whitelist (void)
+{
+  int32 status = 1;
+  int32 candidates = 0;
+  int32 index;
+  int32 length = 0;
+  ble_device_address_t whitelist[BLE_WHITELIST_SIZE];
+  ble_device_list_entry_t *start_entry;
+  ble_device_list_entry_t *device_list_entry;
+  ble_device_list_entry_t *next_entry = NULL;
+
+  /* Chunk starts where the last one stopped & wraps around */
+  start_entry = ble_find_device (&(ble_adapter->whitelist_next));
+  if (start_entry == NULL)
+  {
+    start_entry = (ble_device_list_entry_t *)(ble_device_list.head);
+  }
+
+  device_list_entry = start_entry;
+  while (device_list_entry != NULL)
+  {
+    if ((ble_check_scan_device (device_list_entry)) > 0)
+    {
+      if (length < BLE_WHITELIST_SIZE)
+      {
+        whitelist[length++] = device_list_entry->address;
+      }
+      else if (next_entry == NULL)
+      {
+        next_entry = device_list_entry;
+      }
+
+      candidates++;
+    }
+
+    device_list_entry = device_list_entry->next;
+    if (device_list_entry == NULL)
+    {
+      device_list_entry = (ble_device_list_entry_t *)(ble_device_list.head);
+    }
+
+    if (device_list_entry == start_entry)
+    {
+      break;
+    }
+  }
+
+  if (next_entry != NULL)
+  {
+    ble_adapter->whitelist_next = next_entry->address;
+  }
+
+  ble_adapter->whitelist_rotate = (candidates > BLE_WHITELIST_SIZE);
+
+  if ((length != ble_adapter->whitelist_length) ||
+      ((memcmp (whitelist, ble_adapter->whitelist, (length * sizeof (ble_device_address_t)))) != 0))
+  {
+    printf ("BLE Whitelist %d of %d devices\n", length, candidates);
+
+    /* Scan policy follows the whitelist */
+    ble_adapter->scan_config      = BLE_SCAN_MODE_IDLE;
+    ble_adapter->whitelist_length = 0;
+    status = ble_clear_whitelist ();
+
+    for (index = 0; (index < length) && (status > 0); index++)
+    {
+      status = ble_append_whitelist (&(whitelist[index]));
+      if (status > 0)
+      {
+        ble_adapter->whitelist[ble_adapter->whitelist_length++] = whitelist[index];
+      }
+    }
+
+    if (status <= 0)
+    {
+      ble_adapter->whitelist_length = 0;
+    }
+  }
+
+  memset (ble_adapter->whitelist_seen, 0, sizeof (ble_adapter->whitelist_seen));
+}
+
+static int32 ble_discover (ble_scan_mode_e scan_mode)
+{
+  int32 status = 1;
+  ble_message_t message;
+
+  /* Unknown advertisers are filtered in the radio */
+  ble_load_whitelist ();
+
+  /* Each active scan (& whitelist chunk) counts its devices afresh, so
+     reports heard before must not be dropped as repeats */
+  if (scan_mode == BLE_SCAN_MODE_ACTIVE)
+  {
+    memset (ble_adapter->scan_cache, 0, sizeof (ble_adapter->scan_cache));
+  }
+
+  /* Parameters stay with the stack until the other mode is used */
+  if (ble_adapter->scan_config != scan_mode)
+  {
+    ble_command_scan_params_t *scan_params = (ble_command_scan_params_t *)(&message);
+
+    BLE_CLASS_GAP_HEADER (scan_params, BLE_COMMAND_SET_SCAN_PARAMS);
+    if (scan_mode == BLE_SCAN_MODE_BACKGROUND)
+    {
+      scan_params->interval = BLE_BACKGROUND_SCAN_INTERVAL;
+      scan_params->window   = BLE_BACKGROUND_SCAN_WINDOW;
+      scan_params->mode     = BLE_SCAN_PASSIVE;
+    }
+    else
+    {
+      scan_params->interval = MS_TO_625US (ble_adapter->scan_interval);
+      scan_params->window   = MS_TO_625US ((ble_adapter->scan_interval * ble_adapter->scan_duty)/100);
+      scan_params->mode     = BLE_SCAN_ACTIVE;
+    }
+    status = ble_command (&message);
+
+    if (status > 0)
+    {
+      ble_response_scan_params_t *scan_params_rsp = (ble_response_scan_params_t *)(&message);
+      if (scan_params_rsp->result != 0)
+      {
+        printf ("BLE Scan params response received with failure %d\n", scan_params_rsp->result);
+        status = -1;
+      }
+    }
+    else
+    {
+      printf ("BLE Scan params response failed with %d\n", status);
+    }
+
+    if (status > 0)
+    {
+      ble_command_set_filtering_t *set_filtering = (ble_command_set_filtering_t *)(&message);
+      BLE_CLASS_GAP_HEADER (set_filtering, BLE_COMMAND_SET_FILTERING);
+      set_filtering->scan_policy    = (ble_adapter->whitelist_length > 0) ? BLE_SCAN_POLICY_WHITELIST
+                                                                          : BLE_SCAN_POLICY_ALL;
+      set_filtering->scan_duplicate = (scan_mode == BLE_SCAN_MODE_BACKGROUND) ? BLE_SCAN_DUPLICATE_ALL
+                                                                               : BLE_SCAN_DUPLICATE_FILTER;
+      set_filtering->adv_policy     = BLE_ADV_POLICY_ALL;
+      status = ble_command (&message);
+
+      if (status > 0)
+      {
+        ble_response_set_filtering_t *set_filtering_rsp = (ble_response_set_filtering_t *)(&message);
+        if (set_filtering_rsp->result != 0)
+        {
+          printf ("BLE Set filtering response received with failure %d\n", set_filtering_rsp->result);
+          status = -1;
+        }
+      }
+      else
+      {
+        printf ("BLE Set filtering failed with %d\n", status);
+      }
+    }
+
+    ble_adapter->scan_config = (status > 0) ? scan_mode : BLE_SCAN_MODE_IDLE;
+  }
+
+  if (status > 0)
+  {
+    ble_command_discover_t *discover = (ble_command_discover_t *)(&message);
+    BLE_CLASS_GAP_HEADER (discover, BLE_COMMAND_DISCOVER);
+    discover->mode = (scan_mode == BLE_SCAN_MODE_BACKGROUND) ? BLE_DISCOVER_OBSERVATION
+                                                              : BLE_DISCOVER_GENERIC;
+    status = ble_command (&message);
+
+    if (status > 0)
+    {
+      ble_response_discover_t *discover_rsp = (ble_response_discover_t *)(&message);
+      if (discover_rsp->result != 0)
+      {
+        printf ("BLE Scan response received with failure %d\n", discover_rsp->result);
+        status = -1;
+      }
+    }
+    else
+    {
+      printf ("BLE Scan response failed with %d\n", status);
+    }
+  }
+
+  if (status > 0)
+  {
+    ble_adapter->scan_mode = scan_mode;
+  }
+
+  return status;
+}
+
+static void ble_end_scan (void)
+{
+  if (ble_adapter->scan_mode != BLE_SCAN_MODE_IDLE)
+  {
+    (void)ble_end_procedure ();
+    ble_adapter->scan_mode = BLE_SCAN_MODE_IDLE;
+  }
+}
+
 static void ble_connect_direct (void)
 {
   int32 status;
   ble_message_t message;
   ble_command_connect_direct_t *connect_direct;
 
+  /* Connection set up is a GAP procedure, scan waits */
+  ble_end_scan ();
+
   printf ("BLE Connect direct request\n");
-  ble_print_device (connection_params.device);
+  ble_print_device (connection_params->device);
 
   connect_direct = (ble_command_connect_direct_t *)(&message);
   BLE_CLASS_GAP_HEADER (connect_direct, BLE_COMMAND_CONNECT_DIRECT);
-  connect_direct->address      = connection_params.device->address;
+  connect_direct->address      = connection_params->device->address;
   bin_reverse (connect_direct->address.byte, BLE_DEVICE_ADDRESS_LENGTH);
   connect_direct->min_interval = BLE_MIN_CONNECT_INTERVAL;
   connect_direct->max_interval = BLE_MAX_CONNECT_INTERVAL;
@@ -262,13 +1051,25 @@ static void ble_connect_direct (void)
   if (status > 0)
   {
     ble_response_connect_direct_t *connect_direct_rsp = (ble_response_connect_direct_t *)(&message);
-    if (connect_direct_rsp->result == 0)
+    if ((connect_direct_rsp->result == 0) &&
+        (connect_direct_rsp->handle < ble_adapter->max_connections))
     {
-      connection_params.handle = connect_direct_rsp->handle;
+      ble_connection_params_t *connection = &(ble_adapter->connection_list[connect_direct_rsp->handle]);
+
+      /* Move context to the slot of the handle the stack picked */
+      if (connection != connection_params)
+      {
+        *connection = *connection_params;
+        ble_clear_connection (connection_params);
+        connection_params = connection;
+      }
+
+      connection_params->handle = connect_direct_rsp->handle;
     }
     else
     {
-      printf ("BLE Connect direct response received with failure %d\n", connect_direct_rsp->result);
+      printf ("BLE Connect direct response received with failure %d, handle %d\n",
+                 connect_direct_rsp->result, connect_direct_rsp->handle);
     }
   }
   else
@@ -276,8 +1077,11 @@ static void ble_connect_direct (void)
     printf ("BLE Connect direct failed with %d\n", status);
   }
 
-  (void)timer_start (BLE_CONNECT_SETUP_TIMEOUT, BLE_TIMER_CONNECT_SETUP,
-                     ble_callback_timer, &(connection_params.timer_info));
+  /* Stack sets up one connection at a time */
+  ble_adapter->connect_pending     = connection_params;
+  connection_params->connect_time  = clock_get_count ();
+
+  connection_params->timer = ble_start_timer (BLE_CONNECT_SETUP_TIMEOUT, BLE_TIMER_CONNECT_SETUP);
 }
 
 static void ble_connect_disconnect (void)
@@ -290,7 +1094,7 @@ static void ble_connect_disconnect (void)
 
   disconnect = (ble_command_disconnect_t *)(&message);
   BLE_CLASS_CONNECTION_HEADER (disconnect, BLE_COMMAND_DISCONNECT);
-  disconnect->handle = connection_params.handle;
+  disconnect->handle = connection_params->handle;
   status = ble_command (&message);
 
   if (status > 0)
@@ -306,10 +1110,10 @@ static void ble_connect_disconnect (void)
     printf ("BLE Disconnect failed with %d\n", status);
   }
 
-  if (connection_params.timer_info != NULL)
+  if (connection_params->timer >= 0)
   {
-    timer_stop (connection_params.timer_info);
-    connection_params.timer_info = NULL;
+    (void)timer_stop (connection_params->timer);
+    connection_params->timer = -1;
   }
 }
 
@@ -323,7 +1127,7 @@ static int32 ble_read_group (void)
   
   read_group = (ble_command_read_group_t *)(&message);
   BLE_CLASS_ATTR_CLIENT_HEADER (read_group, BLE_COMMAND_READ_BY_GROUP_TYPE);
-  read_group->conn_handle  = connection_params.handle;
+  read_group->conn_handle  = connection_params->handle;
   read_group->start_handle = BLE_MIN_GATT_HANDLE;
   read_group->end_handle   = BLE_MAX_GATT_HANDLE;
   read_group->length       = BLE_GATT_UUID_LENGTH;
@@ -349,21 +1153,58 @@ static int32 ble_read_group (void)
   return status;
 }
 
-static int32 ble_find_information (void)
+static int32 ble_read_type (void)
+{
+  int32 status;
+  ble_message_t message;
+  ble_command_read_type_t *read_type;
+
+  printf ("BLE Read type request, handle range 0x%04x to 0x%04x\n",
+               connection_params->service->start_handle + 1,
+               connection_params->service->end_handle);
+
+  read_type = (ble_command_read_type_t *)(&message);
+  BLE_CLASS_ATTR_CLIENT_HEADER (read_type, BLE_COMMAND_READ_BY_TYPE);
+  read_type->conn_handle  = connection_params->handle;
+  read_type->start_handle = connection_params->service->start_handle + 1;
+  read_type->end_handle   = connection_params->service->end_handle;
+  read_type->length       = BLE_GATT_UUID_LENGTH;
+  BLE_UNPACK_GATT_UUID (BLE_GATT_CHAR_DECL, read_type->data);
+  bin_reverse (read_type->data, BLE_GATT_UUID_LENGTH);
+
+  status = ble_command (&message);
+
+  if (status > 0)
+  {
+    ble_response_read_type_t *read_type_rsp = (ble_response_read_type_t *)(&message);
+    if (read_type_rsp->result != 0)
+    {
+      printf ("BLE Read type response received with failure %d\n", read_type_rsp->result);
+      status = -1;
+    }
+  }
+  else
+  {
+    printf ("BLE Read type failed with %d\n", status);
+  }
+  
+  return status;
+}
+
+static int32 ble_find_information (uint16 start_handle, uint16 end_handle)
 {
   int32 status;
   ble_message_t message;
   ble_command_find_information_t *find_information;
 
   printf ("BLE Find information request, handle range 0x%04x to 0x%04x\n",
-               connection_params.service->start_handle + 1,
-               connection_params.service->end_handle);
+               start_handle, end_handle);
 
   find_information = (ble_command_find_information_t *)(&message);
   BLE_CLASS_ATTR_CLIENT_HEADER (find_information, BLE_COMMAND_FIND_INFORMATION);
-  find_information->conn_handle  = connection_params.handle;
-  find_information->start_handle = connection_params.service->start_handle + 1;
-  find_information->end_handle   = connection_params.service->end_handle;
+  find_information->conn_handle  = connection_params->handle;
+  find_information->start_handle = start_handle;
+  find_information->end_handle   = end_handle;
   status = ble_command (&message);
 
   if (status > 0)
@@ -389,12 +1230,12 @@ static int32 ble_read_long_handle (void)
   ble_message_t message;
   ble_command_read_handle_t *read_handle;
 
-  printf ("BLE Read long request, handle 0x%04x\n", connection_params.attribute->handle);
+  printf ("BLE Read long request, handle 0x%04x\n", connection_params->attribute->handle);
   
   read_handle = (ble_command_read_handle_t *)(&message);
   BLE_CLASS_ATTR_CLIENT_HEADER (read_handle, BLE_COMMAND_READ_LONG);
-  read_handle->conn_handle = connection_params.handle;
-  read_handle->attr_handle = connection_params.attribute->handle;
+  read_handle->conn_handle = connection_params->handle;
+  read_handle->attr_handle = connection_params->attribute->handle;
   status = ble_command (&message);
 
   if (status > 0)
@@ -420,12 +1261,12 @@ static int32 ble_read_handle (void)
   ble_message_t message;
   ble_command_read_handle_t *read_handle;
 
-  printf ("BLE Read request, handle 0x%04x\n", connection_params.attribute->handle);
+  printf ("BLE Read request, handle 0x%04x\n", connection_params->attribute->handle);
   
   read_handle = (ble_command_read_handle_t *)(&message);
   BLE_CLASS_ATTR_CLIENT_HEADER (read_handle, BLE_COMMAND_READ_BY_HANDLE);
-  read_handle->conn_handle = connection_params.handle;
-  read_handle->attr_handle = connection_params.attribute->handle;
+  read_handle->conn_handle = connection_params->handle;
+  read_handle->attr_handle = connection_params->attribute->handle;
   status = ble_command (&message);
 
   if (status > 0)
@@ -451,16 +1292,16 @@ static int32 ble_write_handle (void)
   ble_message_t message;
   ble_command_write_handle_t *write_handle;
 
-  printf ("BLE Write request, handle 0x%04x\n", connection_params.attribute->handle);
+  printf ("BLE Write request, handle 0x%04x\n", connection_params->attribute->handle);
   
   write_handle = (ble_command_write_handle_t *)(&message);
   BLE_CLASS_ATTR_CLIENT_HEADER (write_handle, BLE_COMMAND_WRITE_ATTR_CLIENT);
-  write_handle->header.length += connection_params.attribute->data_length;
+  write_handle->header.length += connection_params->attribute->data_length;
 
-  write_handle->conn_handle = connection_params.handle;
-  write_handle->attr_handle = connection_params.attribute->handle;
-  write_handle->length      = connection_params.attribute->data_length;
-  memcpy (write_handle->data, connection_params.attribute->data, write_handle->length);
+  write_handle->conn_handle = connection_params->handle;
+  write_handle->attr_handle = connection_params->attribute->handle;
+  write_handle->length      = connection_params->attribute->data_length;
+  memcpy (write_handle->data, connection_params->attribute->data, write_handle->length);
   status = ble_command (&message);
 
   if (status > 0)
@@ -483,71 +1324,281 @@ static int32 ble_write_handle (void)
 void ble_callback_timer (void *timer_info)
 {
   timer_list_entry_t *timer_list_entry;
+  ble_adapter_t *adapter;
+
+  /* Queue on the adapter that started the timer */
+  adapter = &(ble_adapter_list[BLE_TIMER_ADAPTER (((timer_info_t *)timer_info)->event)]);
 
   timer_list_entry = (timer_list_entry_t *)malloc (sizeof (*timer_list_entry));
   timer_list_entry->info = *((timer_info_t *)timer_info);
-  list_add ((list_entry_t **)(&timer_expiry_list), (list_entry_t *)timer_list_entry);
+  /* Called from event_wait () on the master loop, queue is picked up next pass */
+  dlist_add (&(adapter->timer_expiry_list), (dlist_entry_t *)timer_list_entry);
 }
 
-void ble_event_scan_response (ble_event_scan_response_t *scan_response)
+/* Walk AD structures & hand service or manufacturer data to profile
+   decoders, returns number of structures taken */
+static int32 ble_parse_advertisement (ble_device_list_entry_t *device_list_entry,
+                                      uint8 *data, uint8 length)
 {
-  ble_device_list_entry_t *device_list_entry;
-
-  printf ("BLE Scan response event\n");
+  int32 found = 0;
+  uint32 offset = 0;
 
-  bin_reverse (scan_response->device_address.byte, BLE_DEVICE_ADDRESS_LENGTH);
-  device_list_entry = ble_find_device (ble_device_list, &(scan_response->device_address));
-  if (device_list_entry != NULL)
+  while ((offset + 2) <= length)
   {
-    if (device_list_entry->status == BLE_DEVICE_DISCOVER)
+    ble_adv_data_t *adv_data = (ble_adv_data_t *)(data + offset);
+    uint8 value_length;
+
+    /* Zero length ends significant part */
+    if ((adv_data->length == 0) || ((offset + 1 + adv_data->length) > length))
     {
-      device_list_entry->status = BLE_DEVICE_DISCOVER_SERVICE;
-      printf ("New device --\n");
+      break;
     }
-    else
+
+    value_length = adv_data->length - 1;
+
+    if (((adv_data->type == BLE_ADV_SERVICE_DATA) && (value_length >= BLE_GATT_UUID_LENGTH)) ||
+        ((adv_data->type == BLE_ADV_128BIT_SERVICE_DATA) && (value_length >= BLE_MAX_UUID_LENGTH)))
     {
-      printf ("Listed device --\n");
+      uint8 uuid[BLE_MAX_UUID_LENGTH];
+      uint8 uuid_length = (adv_data->type == BLE_ADV_SERVICE_DATA) ? BLE_GATT_UUID_LENGTH
+                                                                   : BLE_MAX_UUID_LENGTH;
+
+      memcpy (uuid, adv_data->value, uuid_length);
+      bin_reverse (uuid, uuid_length);
+
+      if ((ble_advertise_service (device_list_entry, uuid, uuid_length,
+                                  (adv_data->value + uuid_length), (value_length - uuid_length))) > 0)
+      {
+        found++;
+      }
     }
-  
-    ble_print_device (device_list_entry);
-  }
-  else
-  {
-    printf ("Ignored device --\n");
+    else if ((adv_data->type == BLE_ADV_MANUFACTURER_DATA) && (value_length >= 2))
+    {
+      uint16 company = adv_data->value[0] | (adv_data->value[1] << 8);
+
+      if ((ble_advertise_company (device_list_entry, company,
+                                  (adv_data->value + 2), (value_length - 2))) > 0)
+      {
+        found++;
+      }
+    }
+
+    offset += adv_data->length + 1;
   }
+
+  return found;
 }
 
-int32 ble_event_connection_status (ble_event_connection_status_t *connection_status)
+/* Whether the same report came from the address recently on this
+   adapter. Reports that evict another address from the cache are always
+   new */
+static int32 ble_check_scan_cache (ble_event_scan_response_t *scan_response)
 {
-  int32 status;
+  int32 found;
+  int32 current_time = clock_get_count ();
+  uint32 hash = 2166136261U;
+  uint32 slot = 2166136261U;
+  ble_scan_cache_entry_t *cache_entry;
+  uint8 index;
 
-  printf ("BLE Connect event, status flags 0x%02x, interval %d, timeout %d, latency %d, bonding 0x%02x\n",
-             connection_status->flags, connection_status->interval, connection_status->timeout,
-             connection_status->latency, connection_status->bonding);
+  for (index = 0; index < BLE_DEVICE_ADDRESS_LENGTH; index++)
+  {
+    slot ^= scan_response->device_address.byte[index];
+    slot *= 16777619U;
+  }
 
-  if (connection_status->flags & BLE_CONNECT_ESTABLISHED)
+  hash ^= scan_response->packet_type;
+  hash *= 16777619U;
+  for (index = 0; index < scan_response->length; index++)
   {
-    timer_stop (connection_params.timer_info);
-    connection_params.timer_info = NULL;
+    hash ^= scan_response->data[index];
+    hash *= 16777619U;
+  }
 
-    timer_start (BLE_CONNECT_DATA_TIMEOUT, BLE_TIMER_CONNECT_DATA,
-                 ble_callback_timer, &(connection_params.timer_info));
-    status = 1; 
+  cache_entry = &(ble_adapter->scan_cache[slot & (BLE_SCAN_CACHE_SIZE - 1)]);
+  found = (((memcmp (&(cache_entry->address), &(scan_response->device_address),
+                     sizeof (ble_device_address_t))) == 0) &&
+           (cache_entry->hash == hash) &&
+           ((current_time - cache_entry->time) < BLE_SCAN_CACHE_TIMEOUT));
+
+  if (!found)
+  {
+    cache_entry->address = scan_response->device_address;
+    cache_entry->hash    = hash;
+    cache_entry->time    = current_time;
+  }
+
+  return found;
+}
+
+/* All expected devices reported, stop timer is brought forward so the
+   rest of the scan time goes to the data state */
+static void ble_end_scan_early (void)
+{
+  ble_connection_params_t *current_connection = connection_params;
+
+  connection_params = ble_adapter->scan_connection;
+  if ((timer_stop (connection_params->timer)) > 0)
+  {
+    connection_params->timer = ble_start_timer (BLE_MIN_TIMER_DURATION, BLE_TIMER_SCAN_STOP);
+  }
+  connection_params = current_connection;
+
+  /* Once per scan */
+  ble_adapter->scan_expected = 0;
+}
+
+/* Move on to the next whitelist chunk once every device of this one
+   reported */
+static void ble_check_whitelist (ble_device_address_t *address)
+{
+  int32 index;
+  int32 seen = 0;
+
+  for (index = 0; index < ble_adapter->whitelist_length; index++)
+  {
+    if ((memcmp (address, &(ble_adapter->whitelist[index]), sizeof (ble_device_address_t))) == 0)
+    {
+      ble_adapter->whitelist_seen[index] = 1;
+    }
+
+    seen += ble_adapter->whitelist_seen[index];
+  }
+
+  if ((ble_adapter->whitelist_rotate) && (seen == ble_adapter->whitelist_length) &&
+      (ble_adapter->scan_mode != BLE_SCAN_MODE_IDLE))
+  {
+    ble_scan_mode_e scan_mode = ble_adapter->scan_mode;
+
+    printf ("BLE Whitelist chunk complete\n");
+
+    ble_end_scan ();
+    (void)ble_discover (scan_mode);
+  }
+}
+
+void ble_event_scan_response (ble_event_scan_response_t *scan_response)
+{
+  ble_device_list_entry_t *device_list_entry;
+
+  ble_adapter->scan_reports++;
+
+  /* Cheap drop of repeats, before any decoding */
+  if ((ble_check_scan_cache (scan_response)) > 0)
+  {
+    ble_adapter->scan_duplicates++;
+    return;
+  }
+
+  printf ("BLE Scan response event\n");
+
+  bin_reverse (scan_response->device_address.byte, BLE_DEVICE_ADDRESS_LENGTH);
+  device_list_entry = ble_find_device (&(scan_response->device_address));
+  if (device_list_entry != NULL)
+  {
+    if ((ble_adapter->scan_mode == BLE_SCAN_MODE_ACTIVE) &&
+        (device_list_entry->adapter == ble_adapter->index) &&
+        (device_list_entry->status == BLE_DEVICE_DISCOVER))
+    {
+      ble_adapter->scan_found++;
+    }
+
+    /* Devices advertising their readings are never connected */
+    if (((device_list_entry->status == BLE_DEVICE_DISCOVER) ||
+         (device_list_entry->status == BLE_DEVICE_ADVERTISE)) &&
+        ((ble_parse_advertisement (device_list_entry, scan_response->data, scan_response->length)) > 0))
+    {
+      if (device_list_entry->status == BLE_DEVICE_DISCOVER)
+      {
+        device_list_entry->status = BLE_DEVICE_ADVERTISE;
+        printf ("New advertising device --\n");
+      }
+      else
+      {
+        printf ("Advertising device --\n");
+      }
+    }
+    else if (device_list_entry->status == BLE_DEVICE_DISCOVER)
+    {
+      device_list_entry->status = BLE_DEVICE_DISCOVER_SERVICE;
+      printf ("New device --\n");
+    }
+    else
+    {
+      printf ("Listed device --\n");
+    }
+  
+    ble_print_device (device_list_entry);
+
+    if ((ble_adapter->scan_mode == BLE_SCAN_MODE_ACTIVE) && (ble_adapter->scan_expected > 0) &&
+        (ble_adapter->scan_found >= ble_adapter->scan_expected))
+    {
+      ble_end_scan_early ();
+    }
+    else
+    {
+      ble_check_whitelist (&(scan_response->device_address));
+    }
+  }
+  else
+  {
+    printf ("Ignored device --\n");
+  }
+}
+
+int32 ble_event_connection_status (ble_event_connection_status_t *connection_status)
+{
+  int32 status;
+
+  printf ("BLE Connect event, status flags 0x%02x, interval %d, timeout %d, latency %d, bonding 0x%02x\n",
+             connection_status->flags, connection_status->interval, connection_status->timeout,
+             connection_status->latency, connection_status->bonding);
+
+  if ((connection_status->flags & BLE_CONNECT_ESTABLISHED) &&
+      (connection_params->device == NULL))
+  {
+    /* Set up completed after the attempt was given up */
+    connection_params->handle = connection_status->handle;
+
+    ble_connect_disconnect ();
+    status = -1;
+  }
+  else if (connection_status->flags & BLE_CONNECT_ESTABLISHED)
+  {
+    if (ble_adapter->connect_pending == connection_params)
+    {
+      ble_adapter->connect_pending = NULL;
+    }
+
+    /* Running average of set up time, for the connection pool */
+    if (connection_params->connect_time != 0)
+    {
+      int32 connect_time = (clock_get_count ()) - connection_params->connect_time;
+
+      ble_adapter->connect_time = (ble_adapter->connect_time > 0) ? (((7 * ble_adapter->connect_time) + connect_time)/8)
+                                                                  : connect_time;
+      connection_params->connect_time = 0;
+    }
+
+    (void)timer_stop (connection_params->timer);
+    connection_params->timer = ble_start_timer (BLE_CONNECT_DATA_TIMEOUT, BLE_TIMER_CONNECT_DATA);
+    status = 1; 
   }
   else if (connection_status->flags & BLE_CONNECT_SETUP_FAILED)
   {
-    connection_params.timer_info = NULL;
+    connection_params->timer     = -1;
+    ble_adapter->connect_pending = NULL;
     
     (void)ble_end_procedure ();
     status = -1;
   }
   else if (connection_status->flags & BLE_CONNECT_DATA_FAILED)
   {
-    connection_params.timer_info = NULL;
+    connection_params->timer = -1;
     
-    if (connection_params.device->status != BLE_DEVICE_DATA)
+    if (connection_params->device->status != BLE_DEVICE_DATA)
     {
-      connection_params.device->status = BLE_DEVICE_DISCOVER_SERVICE;
+      connection_params->device->status = BLE_DEVICE_DISCOVER_SERVICE;
     }
       
     ble_connect_disconnect ();
@@ -565,15 +1616,15 @@ void ble_event_disconnect (ble_event_disconnect_t *disconnect)
 {
   printf ("BLE Disconnect event, reason 0x%04x\n", disconnect->cause);
 
-  connection_params.service         = NULL;
-  connection_params.characteristics = NULL;
-  connection_params.attribute       = NULL;
-  connection_params.handle          = 0xff;
+  connection_params->service         = NULL;
+  connection_params->characteristics = NULL;
+  connection_params->attribute       = NULL;
+  connection_params->handle          = 0xff;
     
-  if (connection_params.timer_info != NULL)
+  if (connection_params->timer >= 0)
   {
-    timer_stop (connection_params.timer_info);
-    connection_params.timer_info = NULL;
+    (void)timer_stop (connection_params->timer);
+    connection_params->timer = -1;
   }
 }
 
@@ -584,17 +1635,21 @@ void ble_event_read_group (ble_event_read_group_t *read_group)
   printf ("BLE Read group event\n");
 
   bin_reverse (read_group->data, read_group->length);
-  service_list_entry = ble_find_service (connection_params.device->service_list, read_group->data, read_group->length);
+  service_list_entry = ble_find_service (connection_params->device->service_list, read_group->data, read_group->length);
 
   if (service_list_entry != NULL)
   {
+    uint8 uuid[BLE_GATT_UUID_LENGTH];
+
+    BLE_UNPACK_GATT_UUID (BLE_GATT_PRI_SERVICE, uuid);
+
     service_list_entry->start_handle = read_group->start_handle;
     service_list_entry->end_handle   = read_group->end_handle;
 
     service_list_entry->declaration->type        = BLE_ATTR_TYPE_READ;
     service_list_entry->declaration->handle      = read_group->start_handle;
     service_list_entry->declaration->uuid_length = BLE_GATT_UUID_LENGTH;
-    BLE_UNPACK_GATT_UUID (BLE_GATT_PRI_SERVICE, service_list_entry->declaration->uuid);
+    service_list_entry->declaration->uuid        = ble_intern_uuid (uuid, BLE_GATT_UUID_LENGTH);
   }
   else
   {
@@ -611,7 +1666,7 @@ void ble_event_read_group (ble_event_read_group_t *read_group)
 
 void ble_event_find_information (ble_event_find_information_t *find_information)
 {
-  ble_service_list_entry_t *service = connection_params.service;
+  ble_service_list_entry_t *service = connection_params->service;
   
   printf ("BLE Find information event\n");
 
@@ -629,66 +1684,41 @@ void ble_event_find_information (ble_event_find_information_t *find_information)
       
       include_list_entry->declaration->handle      = find_information->attr_handle;
       include_list_entry->declaration->uuid_length = BLE_GATT_UUID_LENGTH;
-      BLE_UNPACK_GATT_UUID (BLE_GATT_INCLUDE, include_list_entry->declaration->uuid);
+      include_list_entry->declaration->uuid        = ble_intern_uuid (find_information->data, BLE_GATT_UUID_LENGTH);
   
       list_add ((list_entry_t **)(&(service->include_list)), (list_entry_t *)include_list_entry);  
     }
-    else if ((uuid == BLE_GATT_CHAR_DECL)           ||
-             (uuid == BLE_GATT_CHAR_USER_DESC)      ||
-             (uuid == BLE_GATT_CHAR_FORMAT)         ||
-             (uuid == BLE_GATT_CHAR_CLIENT_CONFIG))
+    else if (((uuid == BLE_GATT_CHAR_USER_DESC)     ||
+              (uuid == BLE_GATT_CHAR_FORMAT)        ||
+              (uuid == BLE_GATT_CHAR_CLIENT_CONFIG)) &&
+             (connection_params->characteristics != NULL))
     {
-      ble_char_list_entry_t *char_list_entry;
+      /* Descriptors of the characteristics being discovered */
+      ble_char_list_entry_t *char_list_entry = connection_params->characteristics;
       ble_attribute_t *attribute;
 
-      if (uuid == BLE_GATT_CHAR_DECL)
-      {
-        char_list_entry = (ble_char_list_entry_t *)malloc (sizeof (*char_list_entry));
-        
-        char_list_entry->declaration   = NULL;
-        char_list_entry->value         = NULL;
-        char_list_entry->description   = NULL;
-        char_list_entry->client_config = NULL;
-        char_list_entry->format        = NULL;
-        
-        list_add ((list_entry_t **)(&(service->char_list)), (list_entry_t *)char_list_entry);
-      }
-      else
-      {
-        char_list_entry = (ble_char_list_entry_t *)list_tail ((list_entry_t **)(&(service->char_list)));
-      }
+      attribute = ble_new_attribute (&(connection_params->device->arena), BLE_ATTR_TYPE_READ,
+                                     find_information->attr_handle,
+                                     find_information->data, find_information->length);
 
-      if (uuid == BLE_GATT_CHAR_DECL)
-      {
-        char_list_entry->declaration = (ble_attribute_t *)malloc (sizeof (ble_attribute_t));
-        attribute                    = char_list_entry->declaration;
-      }
-      else if (uuid == BLE_GATT_CHAR_USER_DESC)
+      if (uuid == BLE_GATT_CHAR_USER_DESC)
       {
-        char_list_entry->description = (ble_attribute_t *)malloc (sizeof (ble_attribute_t));
-        attribute                    = char_list_entry->description;
+        char_list_entry->description = attribute;
       }
       else if (uuid == BLE_GATT_CHAR_CLIENT_CONFIG)
       {
-        char_list_entry->client_config = (ble_attribute_t *)malloc (sizeof (ble_attribute_t));
-        attribute                      = char_list_entry->client_config;
-      }
-      else
-      {
-        char_list_entry->format = (ble_attribute_t *)malloc (sizeof (ble_attribute_t));
-        attribute               = char_list_entry->format;
-      }
+        /* Written before use, no need to read */
+        ble_char_client_config_t client_config = {0};
 
-      attribute->type         = BLE_ATTR_TYPE_READ;
-      attribute->handle       = find_information->attr_handle;
-      attribute->uuid_length  = find_information->length;
-      memcpy (attribute->uuid, find_information->data, find_information->length);
-      attribute->data_length  = 0;
-      attribute->data         = NULL;
+        attribute->type |= BLE_ATTR_TYPE_WRITE;
+        ble_set_attribute_data (&(connection_params->device->arena), attribute,
+                                (uint8 *)(&client_config), sizeof (client_config));
 
-      if (uuid == BLE_GATT_CHAR_CLIENT_CONFIG)
+        char_list_entry->client_config = attribute;
+      }
+      else
       {
-        attribute->type |= BLE_ATTR_TYPE_WRITE;
+        char_list_entry->format = attribute;
       }
     }
     else if ((uuid == BLE_GATT_CHAR_EXT)           ||
@@ -715,25 +1745,48 @@ void ble_event_attr_value (ble_event_attr_value_t *attr_value)
 
   printf ("BLE Attribute value event, type %d, handle 0x%04x\n", attr_value->type, attr_value->attr_handle);
 
-  attribute = ble_find_attribute (connection_params.device->service_list, attr_value->attr_handle);
+  if ((attr_value->type == BLE_ATTR_VALUE_READ_TYPE) &&
+      (connection_params->device->status != BLE_DEVICE_DATA))
+  {
+    /* Characteristics declaration found by read type, only used
+       in discovery */
+    ble_char_list_entry_t *char_list_entry = ble_new_characteristics (&(connection_params->device->arena));
+    uint8 uuid[BLE_GATT_UUID_LENGTH];
+
+    BLE_UNPACK_GATT_UUID (BLE_GATT_CHAR_DECL, uuid);
+    attribute = ble_new_attribute (&(connection_params->device->arena), BLE_ATTR_TYPE_READ,
+                                   attr_value->attr_handle, uuid, BLE_GATT_UUID_LENGTH);
+    char_list_entry->declaration = attribute;
+
+    list_add ((list_entry_t **)(&(connection_params->service->char_list)), (list_entry_t *)char_list_entry);
+  }
+  /* Discovery still walks the profile, data & notifications use the index */
+  else if (connection_params->device->status == BLE_DEVICE_DATA)
+  {
+    attribute = ble_lookup_attribute (&(connection_params->device->attribute_index), attr_value->attr_handle);
+  }
+  else
+  {
+    attribute = ble_find_attribute (connection_params->device->service_list, attr_value->attr_handle);
+  }
 
   if (attribute != NULL)
   {
+    connection_params->stream_pending = connection_params->stream;
+
     if ((attr_value->type == BLE_ATTR_VALUE_READ)      ||
         (attr_value->type == BLE_ATTR_VALUE_NOTIFY)    ||
         (attr_value->type == BLE_ATTR_VALUE_INDICATE)  ||
         (attr_value->type == BLE_ATTR_VALUE_READ_TYPE) ||
         ((attr_value->type == BLE_ATTR_VALUE_READ_BLOB) && (attribute->data == NULL)))
     {
-      attribute->data = malloc (attr_value->length);
-      memcpy (attribute->data, attr_value->data, attr_value->length);
-      attribute->data_length = attr_value->length;
+      ble_set_attribute_data (&(connection_params->device->arena), attribute,
+                              attr_value->data, attr_value->length);
     }
     else
     {
-      attribute->data = realloc (attribute->data, (attribute->data_length + attr_value->length));
-      memcpy ((attribute->data + attribute->data_length), attr_value->data, attr_value->length);
-      attribute->data_length += attr_value->length;
+      ble_append_attribute_data (&(connection_params->device->arena), attribute,
+                                 attr_value->data, attr_value->length);
     }  
   }
   else
@@ -741,8 +1794,11 @@ void ble_event_attr_value (ble_event_attr_value_t *attr_value)
     printf ("Attribute value handle %04x not expected\n", attr_value->attr_handle);
   }
 
-  if ((attr_value->type == BLE_ATTR_VALUE_NOTIFY) ||
-      (attr_value->type == BLE_ATTR_VALUE_INDICATE))
+  /* Streamed values are stored by ble_update_stream (), no procedure
+     to complete */
+  if (((attr_value->type == BLE_ATTR_VALUE_NOTIFY) ||
+       (attr_value->type == BLE_ATTR_VALUE_INDICATE)) &&
+      (!(connection_params->stream)))
   {
     ble_message_list_entry_t *message_list_entry
         = (ble_message_list_entry_t *)malloc (sizeof (*message_list_entry));
@@ -751,26 +1807,40 @@ void ble_event_attr_value (ble_event_attr_value_t *attr_value)
     message_list_entry->message.header.length  = 5;
     message_list_entry->message.header.class   = BLE_CLASS_ATTR_CLIENT;
     message_list_entry->message.header.command = BLE_EVENT_PROCEDURE_COMPLETED;
+    message_list_entry->message.data[0]        = connection_params->handle;
 
-    list_add ((list_entry_t **)(&ble_message_list), (list_entry_t *)message_list_entry);
+    dlist_add (&(ble_adapter->message_list), (dlist_entry_t *)message_list_entry);
   }
 }
 
-int32 ble_init (void)
+int32 ble_start_timer (int32 millisec, int32 event)
+{
+  return timer_start (millisec, BLE_TIMER_EVENT (ble_adapter->index,
+                                                 (connection_params - ble_adapter->connection_list), event),
+                      ble_callback_timer);
+}
+
+static int32 ble_init_adapter (int32 max_attempts)
 {
   int32 status = -1;
   int32 ble_init_attempt = 0;
 
-  ble_init_time = clock_get_count ();
+  ble_adapter->init_time = clock_get_count ();
+
+  /* Nothing of the scan state survives a reset */
+  ble_adapter->scan_mode        = BLE_SCAN_MODE_IDLE;
+  ble_adapter->scan_config      = BLE_SCAN_MODE_IDLE;
+  ble_adapter->scan_retry       = 0;
+  ble_adapter->whitelist_length = 0;
 
   do
   {
     ble_init_attempt++;
 
-    printf ("BLE init attempt %d\n", ble_init_attempt);
+    printf ("BLE adapter %d init attempt %d\n", ble_adapter->index, ble_init_attempt);
     
     /* Find BLE device and initialize */
-    status = serial_init ();
+    status = serial_init (ble_adapter->index);
     sleep (1);
   
     if (status > 0)
@@ -784,18 +1854,20 @@ int32 ble_init (void)
       sleep (1);
   
       /* Close & re-open UART after reset */
-      serial_deinit ();
+      serial_deinit (ble_adapter->index);
   
       do
       {
         serial_init_attempt++;
         sleep (1);
         
-        status = serial_init ();
+        status = serial_init (ble_adapter->index);
       } while ((status < 0) && (serial_init_attempt < 2));
   
       if (status > 0)
       {
+        ble_rx_reset ();
+
         /* Ping BLE */
         status = ble_hello ();
       }
@@ -803,28 +1875,130 @@ int32 ble_init (void)
       {
         printf ("BLE Reset request failed\n");
       }
+
+      if (status > 0)
+      {
+        status = ble_get_connections ();
+      }
   
       if (status > 0)
       {
-        ble_init_device_list (&ble_device_list);
+        status = event_add (serial_get_handle (ble_adapter->index), NULL, NULL);
       }
-      else
+
+      if (status < 0)
       {
-        serial_deinit ();
+        serial_deinit (ble_adapter->index);
       }
     }
     else
     {
       printf ("Can't find BLE device\n");
     }
-  } while ((status < 0) && (ble_init_attempt < 2));
+  } while ((status < 0) && (ble_init_attempt < max_attempts));
+
+  return status;
+}
+
+static void ble_deinit_adapter (void)
+{
+  (void)event_remove (serial_get_handle (ble_adapter->index));
+  serial_deinit (ble_adapter->index);
+}
+
+int32 ble_init (void)
+{
+  int32 status = -1;
+  int32 index;
+  int32 connection;
+
+  ble_init_profile ();
+
+  /* Open every adapter found, stop at the first missing one */
+  for (index = 0; index < BLE_MAX_ADAPTERS; index++)
+  {
+    ble_adapter_t *adapter = &(ble_adapter_list[index]);
+
+    adapter->index             = index;
+    adapter->max_connections   = 1;
+    dlist_init (&(adapter->timer_expiry_list));
+    dlist_init (&(adapter->message_list));
+    adapter->device            = NULL;
+    adapter->connect_pending   = NULL;
+    adapter->evict_pending     = NULL;
+    adapter->connect_time      = 0;
+    adapter->pool_hits         = 0;
+    adapter->pool_misses       = 0;
+    adapter->scan_queued       = 0;
+    adapter->scan_reports      = 0;
+    adapter->scan_duplicates   = 0;
+    adapter->scan_drops        = 0;
+    adapter->scan_interval     = BLE_MAX_SCAN_INTERVAL;
+    adapter->scan_duty         = BLE_SCAN_DUTY;
+    adapter->scan_expected     = 0;
+    adapter->scan_connection   = &(adapter->connection_list[0]);
+    memset (&(adapter->whitelist_next), 0, sizeof (adapter->whitelist_next));
+    adapter->schedule.entry    = NULL;
+    adapter->schedule.length   = 0;
+    adapter->schedule.size     = 0;
+
+    for (connection = 0; connection < BLE_MAX_CONNECTIONS; connection++)
+    {
+      ble_clear_connection (&(adapter->connection_list[connection]));
+    }
+
+    ble_set_adapter (index);
+
+    if ((ble_init_adapter ((index == 0) ? 2 : 1)) > 0)
+    {
+      ble_num_adapters++;
+    }
+    else
+    {
+      break;
+    }
+  }
+
+  ble_set_adapter (0);
+
+  if (ble_num_adapters > 0)
+  {
+    printf ("BLE %d adapter(s) ready\n", ble_num_adapters);
+
+    ble_init_device_list (&ble_device_list);
+    ble_init_storage ((ble_device_list_entry_t *)(ble_device_list.head));
+    ble_balance_device_list ();
+    status = 1;
+  }
 
   return status;
 }
 
 void ble_deinit (void)
 {
-  serial_deinit ();
+  int32 index;
+
+  for (index = 0; index < ble_num_adapters; index++)
+  {
+    ble_set_adapter (index);
+    ble_deinit_adapter ();
+  }
+
+  ble_num_adapters = 0;
+  ble_set_adapter (0);
+
+  ble_deinit_profile ();
+}
+
+int32 ble_get_adapters (void)
+{
+  return ble_num_adapters;
+}
+
+void ble_set_adapter (int32 adapter)
+{
+  ble_adapter       = &(ble_adapter_list[adapter]);
+  connection_params = &(ble_adapter->connection_list[0]);
 }
 
 void ble_print_message (ble_message_t *message)
@@ -839,11 +2013,11 @@ void ble_print_message (ble_message_t *message)
 int32 ble_check_scan_list (void)
 {
   int32 found = 0;
-  ble_device_list_entry_t *device_list_entry = ble_device_list;
+  ble_device_list_entry_t *device_list_entry = (ble_device_list_entry_t *)(ble_device_list.head);
 
   while (device_list_entry != NULL)
   {
-    if (device_list_entry->status == BLE_DEVICE_DISCOVER)
+    if ((ble_check_scan_device (device_list_entry)) > 0)
     {
       found++;
     }
@@ -857,11 +2031,12 @@ int32 ble_check_scan_list (void)
 int32 ble_check_profile_list (void)
 {
   int32 found = 0;
-  ble_device_list_entry_t *device_list_entry = ble_device_list;
+  ble_device_list_entry_t *device_list_entry = (ble_device_list_entry_t *)(ble_device_list.head);
 
   while (device_list_entry != NULL)
   {
-    if (device_list_entry->status == BLE_DEVICE_DISCOVER_SERVICE)
+    if ((device_list_entry->adapter == ble_adapter->index) &&
+        (device_list_entry->status == BLE_DEVICE_DISCOVER_SERVICE))
     {
       found++;
     }
@@ -875,13 +2050,20 @@ int32 ble_check_profile_list (void)
 int32 ble_check_data_list (void)
 {
   int32 found = 0;
-  ble_device_list_entry_t *device_list_entry = ble_device_list;
+  ble_device_list_entry_t *device_list_entry = (ble_device_list_entry_t *)(ble_device_list.head);
 
   while (device_list_entry != NULL)
   {
-    if (device_list_entry->status == BLE_DEVICE_DATA)
+    if ((device_list_entry->adapter == ble_adapter->index) &&
+        (device_list_entry->status == BLE_DEVICE_DATA))
     {
-      found++;
+      ble_connection_params_t *connection = ble_find_connection (ble_adapter, device_list_entry);
+
+      /* Streaming devices need no data cycle */
+      if ((connection == NULL) || (!(connection->stream)))
+      {
+        found++;
+      }
     }
     
     device_list_entry = device_list_entry->next;
@@ -892,30 +2074,19 @@ int32 ble_check_data_list (void)
 
 int32 ble_check_message_list (void)
 {
-  int32 status;
   int32 pending;
-  ble_message_t message;
 
-  pending = list_length ((list_entry_t **)(&timer_expiry_list));
+  /* Pull everything available in as few reads as possible */
+  while ((ble_rx_fill ()) > 0);
 
-  while ((status = serial_rx (sizeof (message.header), (uint8 *)(&(message.header)))) > 0)
-  {
-    if (message.header.length > 0)
-    {
-      status = serial_rx (message.header.length, message.data);
-    }
+  pending  = dlist_length (&(ble_adapter->timer_expiry_list));
+  pending += dlist_length (&(ble_adapter->message_list));
 
-    if (status > 0)
-    {
-      ble_message_list_entry_t *message_list_entry
-          = (ble_message_list_entry_t *)malloc (sizeof (*message_list_entry));
-      message_list_entry->message = message;
-      list_add ((list_entry_t **)(&ble_message_list), (list_entry_t *)message_list_entry);
-    }
+  if ((ble_rx_frame ()) != NULL)
+  {
+    pending++;
   }
 
-  pending += (list_length ((list_entry_t **)(&ble_message_list)));
-
   return pending;
 }
 
@@ -923,423 +2094,762 @@ int32 ble_receive_message (ble_message_t *message)
 {
   int32 pending;
 
-  if (timer_expiry_list != NULL)
+  if (ble_adapter->timer_expiry_list.head != NULL)
   {
-    timer_list_entry_t *timer_list_entry = timer_expiry_list;
+    timer_list_entry_t *timer_list_entry = (timer_list_entry_t *)(dlist_pop (&(ble_adapter->timer_expiry_list)));
 
     message->header.type    = BLE_EVENT;
-    message->header.length  = 1;
+    message->header.length  = 2;
     message->header.class   = BLE_CLASS_HW;
     message->header.command = BLE_EVENT_SOFT_TIMER;
     message->data[0]        = (uint8)(timer_list_entry->info.event);
+    message->data[1]        = (uint8)(BLE_TIMER_CONNECTION (timer_list_entry->info.event));
     
-    list_remove ((list_entry_t **)(&timer_expiry_list), (list_entry_t *)timer_list_entry);
     free (timer_list_entry);
   }
-  else if (ble_message_list != NULL)
+  else if (ble_adapter->message_list.head != NULL)
   {
     ble_message_list_entry_t *message_list_entry;
 
-    message_list_entry = ble_message_list;
+    message_list_entry = (ble_message_list_entry_t *)(dlist_pop (&(ble_adapter->message_list)));
     *message = message_list_entry->message;
-    list_remove ((list_entry_t **)(&ble_message_list), (list_entry_t *)message_list_entry);
     free (message_list_entry);
+
+    if (ble_check_scan_message (message))
+    {
+      ble_adapter->scan_queued--;
+    }
+  }
+  else
+  {
+    ble_message_t *rx_message = ble_rx_frame ();
+
+    if (rx_message != NULL)
+    {
+      memcpy (message, rx_message, ((sizeof (rx_message->header)) + rx_message->header.length));
+      ble_rx_consume (rx_message);
+    }
   }
 
-  pending  = list_length ((list_entry_t **)(&timer_expiry_list));
-  pending += (list_length ((list_entry_t **)(&ble_message_list)));
+  ble_route_message (message);
+
+  pending  = dlist_length (&(ble_adapter->timer_expiry_list));
+  pending += dlist_length (&(ble_adapter->message_list));
+
+  if ((ble_rx_frame ()) != NULL)
+  {
+    pending++;
+  }
 
   return pending;
 }
 
+/* Devices not seen yet, the scan waits for these */
+static int32 ble_check_discover_list (void)
+{
+  int32 found = 0;
+  ble_device_list_entry_t *device_list_entry = (ble_device_list_entry_t *)(ble_device_list.head);
+
+  while (device_list_entry != NULL)
+  {
+    if ((device_list_entry->adapter == ble_adapter->index) &&
+        (device_list_entry->status == BLE_DEVICE_DISCOVER))
+    {
+      found++;
+    }
+
+    device_list_entry = device_list_entry->next;
+  }
+
+  return found;
+}
+
 void ble_start_scan (void)
 {
-  int32 status;
-  ble_message_t message;
-  ble_command_scan_params_t *scan_params;
+  int32 scan_interval;
 
   ble_update_sleep ();
 
-  printf ("BLE Start scan request\n");
+  ble_adapter->scan_start      = clock_get_count ();
+  ble_adapter->scan_expected   = ble_check_discover_list ();
+  ble_adapter->scan_found      = 0;
+  ble_adapter->scan_connection = connection_params;
 
-  scan_params = (ble_command_scan_params_t *)(&message);
-  BLE_CLASS_GAP_HEADER (scan_params, BLE_COMMAND_SET_SCAN_PARAMS);
-  scan_params->interval = BLE_SCAN_INTERVAL;
-  scan_params->window   = BLE_SCAN_WINDOW;
-  scan_params->mode     = BLE_SCAN_ACTIVE;
-  status = ble_command (&message);
+  /* Few outstanding devices are all in the whitelist, listen more often */
+  scan_interval = (ble_adapter->scan_expected <= BLE_WHITELIST_SIZE) ? BLE_MIN_SCAN_INTERVAL
+                                                                     : BLE_MAX_SCAN_INTERVAL;
+  if (scan_interval != ble_adapter->scan_interval)
+  {
+    ble_adapter->scan_interval = scan_interval;
+    ble_adapter->scan_config   = BLE_SCAN_MODE_IDLE;
+  }
 
-  if (status > 0)
+  printf ("BLE Start scan request, %d devices expected, interval %d (ms), duty %d%%\n",
+          ble_adapter->scan_expected, ble_adapter->scan_interval, ble_adapter->scan_duty);
+
+  /* Active scan takes over from the background scan */
+  ble_end_scan ();
+  (void)ble_discover (BLE_SCAN_MODE_ACTIVE);
+
+  connection_params->timer = ble_start_timer (BLE_SCAN_DURATION, BLE_TIMER_SCAN_STOP);
+}
+
+void ble_stop_scan (void)
+{
+  int32 scan_time;
+  int32 scan_duty = ble_adapter->scan_duty;
+
+  ble_update_sleep ();
+  connection_params->timer = -1;
+  ble_end_scan ();
+
+  scan_time = (clock_get_count ()) - ble_adapter->scan_start;
+  printf ("BLE Scan found %d devices in %d (ms), %d (ms) saved\n", ble_adapter->scan_found, scan_time,
+          ((scan_time < BLE_SCAN_DURATION) ? (BLE_SCAN_DURATION - scan_time) : 0));
+
+  /* Nothing found, devices are away so listen less. Some found but not
+     all, devices are coming in so listen more */
+  if (ble_adapter->scan_expected > 0)
   {
-    ble_response_scan_params_t *scan_params_rsp = (ble_response_scan_params_t *)(&message);
-    if (scan_params_rsp->result != 0)
+    if (ble_adapter->scan_found == 0)
     {
-      printf ("BLE Scan params response received with failure %d\n", scan_params_rsp->result);
-      status = -1;
+      scan_duty = ble_adapter->scan_duty/2;
     }
+    else if (ble_adapter->scan_found < ble_adapter->scan_expected)
+    {
+      scan_duty = ble_adapter->scan_duty * 2;
+    }
+  }
+
+  scan_duty = (scan_duty < BLE_MIN_SCAN_DUTY) ? BLE_MIN_SCAN_DUTY
+                                              : ((scan_duty > BLE_MAX_SCAN_DUTY) ? BLE_MAX_SCAN_DUTY : scan_duty);
+  if (scan_duty != ble_adapter->scan_duty)
+  {
+    ble_adapter->scan_duty   = scan_duty;
+    ble_adapter->scan_config = BLE_SCAN_MODE_IDLE;
+  }
+
+  ble_update_device_list (&ble_device_list);
+  ble_balance_device_list ();
+}
+
+void ble_start_profile (void)
+{
+  ble_device_list_entry_t *device_list_entry;
+  ble_connection_params_t *connection;
+
+  ble_update_sleep ();
+
+  ble_adapter->device = (ble_device_list_entry_t *)(ble_device_list.head);
+  connection          = ble_free_connection ();
+  device_list_entry   = ble_next_device (BLE_DEVICE_DISCOVER_SERVICE);
+
+  if ((connection != NULL) && (device_list_entry != NULL))
+  {
+    connection_params         = connection;
+    connection_params->device = device_list_entry;
+
+    ble_clear_service (connection_params->device);
+    ble_connect_direct ();
   }
   else
   {
-    printf ("BLE Scan params response failed with %d\n", status);
+    /* Nothing to discover or every context is held by streams & pooled
+       devices, move on to the next state */
+    if (device_list_entry != NULL)
+    {
+      printf ("BLE No free connection for profile\n");
+    }
+
+    (void)ble_start_timer (BLE_MIN_TIMER_DURATION, BLE_TIMER_PROFILE_STOP);
+
+    ble_update_device_list (&ble_device_list);
+    ble_balance_device_list ();
   }
+}
 
-  if (status > 0)
+void ble_next_profile (void)
+{
+  ble_update_sleep ();
+  
+  /* Profile reads go one device at a time, reuse the context */
+  ble_clear_connection (connection_params);
+  connection_params->device = ble_next_device (BLE_DEVICE_DISCOVER_SERVICE);
+
+  if (connection_params->device != NULL)
   {
-    ble_command_set_filtering_t *set_filtering = (ble_command_set_filtering_t *)(&message);
-    BLE_CLASS_GAP_HEADER (set_filtering, BLE_COMMAND_SET_FILTERING);
-    set_filtering->scan_policy    = BLE_SCAN_POLICY_ALL;
-    set_filtering->scan_duplicate = BLE_SCAN_DUPLICATE_FILTER;
-    set_filtering->adv_policy     = BLE_ADV_POLICY_ALL;
-    status = ble_command (&message);
+    ble_clear_service (connection_params->device);
+    ble_connect_direct ();
+  }
+  else
+  {
+    (void)ble_start_timer (BLE_MIN_TIMER_DURATION, BLE_TIMER_PROFILE_STOP);
+
+    ble_update_device_list (&ble_device_list);
+    ble_balance_device_list ();
+  }
+}
+
+/* Next characteristics, after the current one, that the service
+   handler uses. Those without a complete declaration are skipped */
+static ble_char_list_entry_t * ble_next_char_desc (void)
+{
+  ble_char_list_entry_t *char_list_entry;
+
+  if (connection_params->characteristics == NULL)
+  {
+    connection_params->service = connection_params->device->service_list;
+    char_list_entry            = (connection_params->service != NULL) ? connection_params->service->char_list : NULL;
+  }
+  else
+  {
+    char_list_entry = connection_params->characteristics->next;
+  }
+
+  while (connection_params->service != NULL)
+  {
+    while (char_list_entry != NULL)
+    {
+      uint8 uuid[BLE_MAX_UUID_LENGTH];
+      uint8 uuid_length = char_list_entry->declaration->data_length - 3;
+
+      if ((char_list_entry->declaration->data_length > 3) &&
+          (uuid_length <= BLE_MAX_UUID_LENGTH))
+      {
+        ble_char_decl_t *char_decl = (ble_char_decl_t *)(char_list_entry->declaration->data);
+
+        /* Declaration value is still in over the air order */
+        memcpy (uuid, char_decl->uuid, uuid_length);
+        bin_reverse (uuid, uuid_length);
+
+        if ((ble_check_characteristics (connection_params->service, uuid, uuid_length)) > 0)
+        {
+          return char_list_entry;
+        }
+      }
+
+      char_list_entry = char_list_entry->next;
+    }
+
+    connection_params->service = connection_params->service->next;
+    if (connection_params->service != NULL)
+    {
+      char_list_entry = connection_params->service->char_list;
+    }
+  }
+
+  return NULL;
+}
 
+void ble_read_profile (void)
+{
+  int32 status;
+
+  /* Services found, skip characteristics discovery if cached profile
+     still matches */
+  if ((connection_params->device->status == BLE_DEVICE_DISCOVER_CHAR_DESC) &&
+      (connection_params->service == NULL) &&
+      ((ble_load_profile (connection_params->device)) > 0))
+  {
+    connection_params->device->status = BLE_DEVICE_CONFIGURE_CHAR;
+  }
+
+  if (connection_params->device->status == BLE_DEVICE_DISCOVER_SERVICE)
+  {
+    status = ble_read_group ();
+    if (status > 0)
+    {
+      connection_params->device->status = BLE_DEVICE_DISCOVER_CHAR_DESC;
+    }
+    else
+    {
+      ble_connect_disconnect ();
+    }
+  }
+  else if (connection_params->device->status == BLE_DEVICE_DISCOVER_CHAR_DESC)
+  {
+    if (connection_params->service == NULL)
+    {
+      connection_params->service = connection_params->device->service_list;
+    }
+    else
+    {
+      connection_params->service = connection_params->service->next;
+    }
+
+    /* All characteristics declarations of the service at once */
+    status = ble_read_type ();
     if (status > 0)
     {
-      ble_response_set_filtering_t *set_filtering_rsp = (ble_response_set_filtering_t *)(&message);
-      if (set_filtering_rsp->result != 0)
+      if (connection_params->service->next == NULL)
       {
-        printf ("BLE Set filtering response received with failure %d\n", set_filtering_rsp->result);
-        status = -1;
+        connection_params->device->status = BLE_DEVICE_DISCOVER_CHAR;
       }
     }
     else
     {
-      printf ("BLE Set filtering failed with %d\n", status);
+      connection_params->device->status = BLE_DEVICE_DISCOVER_SERVICE;
+      ble_connect_disconnect ();
     }
   }
+  else if (connection_params->device->status == BLE_DEVICE_DISCOVER_CHAR)
+  {
+    ble_char_list_entry_t *char_list_entry = connection_params->characteristics;
 
-  if (status > 0)
+    status = 0;
+
+    /* Descriptors found, read the ones not read yet */
+    if (char_list_entry != NULL)
+    {
+      if ((char_list_entry->description != NULL) &&
+          (char_list_entry->description->data == NULL))
+      {
+        connection_params->attribute = char_list_entry->description;
+        status = ble_read_long_handle ();
+      }
+      else if ((char_list_entry->format != NULL) &&
+               (char_list_entry->format->data == NULL))
+      {
+        connection_params->attribute = char_list_entry->format;
+        status = ble_read_long_handle ();
+      }
+    }
+
+    /* Find descriptors of the next characteristics in use */
+    while (status == 0)
+    {
+      char_list_entry = ble_next_char_desc ();
+      connection_params->characteristics = char_list_entry;
+
+      if (char_list_entry != NULL)
+      {
+        ble_char_decl_t *char_decl = (ble_char_decl_t *)(char_list_entry->declaration->data);
+        uint16 start_handle = char_decl->handle + 1;
+        uint16 end_handle   = (char_list_entry->next != NULL) ? (char_list_entry->next->declaration->handle - 1)
+                                                              : connection_params->service->end_handle;
+
+        if (start_handle <= end_handle)
+        {
+          connection_params->attribute = char_list_entry->declaration;
+          status = ble_find_information (start_handle, end_handle);
+        }
+      }
+      else
+      {
+        connection_params->device->status = BLE_DEVICE_CONFIGURE_CHAR;
+        break;
+      }
+    }
+
+    if (status < 0)
+    {
+      connection_params->device->status = BLE_DEVICE_DISCOVER_SERVICE;
+      ble_connect_disconnect ();
+    }
+  }
+
+  if (connection_params->device->status == BLE_DEVICE_CONFIGURE_CHAR)
   {
-    ble_command_discover_t *discover = (ble_command_discover_t *)(&message);
-    BLE_CLASS_GAP_HEADER (discover, BLE_COMMAND_DISCOVER);
-    discover->mode = BLE_DISCOVER_GENERIC;
-    status = ble_command (&message);
+    ble_service_list_entry_t *service_list_entry = connection_params->device->service_list;
 
-    if (status > 0)
+    ble_save_profile (connection_params->device);
+    
+    while (service_list_entry != NULL)
     {
-      ble_response_discover_t *discover_rsp = (ble_response_discover_t *)(&message);
-      if (discover_rsp->result != 0)
+      ble_char_list_entry_t *char_list_entry = service_list_entry->char_list;
+
+      while (char_list_entry != NULL)
       {
-        printf ("BLE Scan response received with failure %d\n", discover_rsp->result);
-        status = -1;
+        ble_char_decl_t *char_decl = (ble_char_decl_t *)(char_list_entry->declaration->data);
+        
+        bin_reverse (char_decl->uuid, (char_list_entry->declaration->data_length - 3));
+        char_list_entry = char_list_entry->next;
+      }
+
+      service_list_entry = service_list_entry->next;
+    }
+
+    ble_print_service (connection_params->device->service_list);
+
+    if ((ble_init_service (connection_params->device->service_list, connection_params->device)) > 0)
+    {
+      int32 current_time = clock_get_count ();
+      service_list_entry = connection_params->device->service_list;
+  
+      while (service_list_entry != NULL)
+      {
+        service_list_entry->update.time = current_time;
+        service_list_entry = service_list_entry->next;
       }
+
+      ble_index_attributes (&(connection_params->device->attribute_index),
+                            connection_params->device->service_list);
+      connection_params->device->status = BLE_DEVICE_DATA;
     }
     else
     {
-      printf ("BLE Scan response failed with %d\n", status);
+      connection_params->device->status = BLE_DEVICE_DISCOVER_SERVICE;
     }
+
+    ble_schedule_device (connection_params->device);
+
+    ble_update_device (connection_params->device);
+    ble_connect_disconnect ();
+  }
+}
+
+/* Stream or idle pooled connection is gone, device is connected on
+   demand again */
+static void ble_drop_connection (ble_connection_params_t *connection)
+{
+  /* Scan borrows the timer of whichever context is current */
+  int32 timer = connection->timer;
+
+  printf ((connection->stream) ? "BLE Stream stopped\n" : "BLE Pooled connection dropped\n");
+
+  if (connection->device != NULL)
+  {
+    ble_print_device (connection->device);
+    ble_schedule_device (connection->device);
   }
 
-  (void)timer_start (BLE_SCAN_DURATION, BLE_TIMER_SCAN_STOP,
-                     ble_callback_timer, &(connection_params.timer_info));
+  ble_clear_connection (connection);
+  connection->timer = timer;
 }
 
-void ble_stop_scan (void)
+/* Whether the device on the current connection can stay connected, i.e.
+   a stream is free & all its updates come as notifications/indications */
+static int32 ble_check_stream (void)
 {
-  ble_update_sleep ();
-  connection_params.timer_info = NULL;
-  (void)ble_end_procedure ();
+  int32 found = 0;
+  ble_service_list_entry_t *service_list_entry = connection_params->device->service_list;
+
+  /* One connection is always left free, like ble_check_pool () */
+  if (((ble_stream_connections ()) >= ble_max_streams) ||
+      (((ble_stream_connections ()) + (ble_pooled_connections ())) >= (ble_adapter->max_connections - 1)))
+  {
+    return 0;
+  }
+
+  while (service_list_entry != NULL)
+  {
+    ble_char_list_entry_t *update_list_entry = service_list_entry->update.char_list;
+
+    while (update_list_entry != NULL)
+    {
+      if (!(update_list_entry->value->type & (BLE_ATTR_TYPE_NOTIFY | BLE_ATTR_TYPE_INDICATE)))
+      {
+        return 0;
+      }
+
+      found = 1;
+      update_list_entry = update_list_entry->next;
+    }
+
+    service_list_entry = service_list_entry->next;
+  }
+
+  return found;
+}
+
+/* Earliest update time of the device */
+static int32 ble_next_due (ble_device_list_entry_t *device_list_entry)
+{
+  int32 found = 0;
+  int32 due_time = 0;
+  ble_service_list_entry_t *service_list_entry = device_list_entry->service_list;
+
+  while (service_list_entry != NULL)
+  {
+    if ((service_list_entry->update.char_list != NULL) &&
+        ((!found) || ((service_list_entry->update.time - due_time) < 0)))
+    {
+      due_time = service_list_entry->update.time;
+      found    = 1;
+    }
+
+    service_list_entry = service_list_entry->next;
+  }
+
+  return due_time;
+}
+
+/* Whether to keep the device on the current connection for its next
+   update. Idle connection is cheaper than a reconnect if the device is
+   due again within BLE_POOL_IDLE_RATIO set up times. One connection is
+   always left for devices connected on demand & none is kept while a
+   due device waits for it */
+static int32 ble_check_pool (void)
+{
+  int32 interval = 0;
+  ble_service_list_entry_t *service_list_entry = connection_params->device->service_list;
+  ble_device_list_entry_t *cursor = ble_adapter->device;
+  ble_device_list_entry_t *waiting;
+
+  if ((ble_adapter->connect_time <= 0) ||
+      (((ble_stream_connections ()) + (ble_pooled_connections ())) >= (ble_adapter->max_connections - 1)))
+  {
+    return 0;
+  }
+
+  waiting = ble_next_device (BLE_DEVICE_DATA);
+  ble_adapter->device = cursor;
+
+  if ((waiting != NULL) && ((ble_free_connection ()) == NULL))
+  {
+    return 0;
+  }
+
+  while (service_list_entry != NULL)
+  {
+    if ((service_list_entry->update.char_list != NULL) &&
+        ((interval == 0) || (service_list_entry->update.interval < interval)))
+    {
+      interval = service_list_entry->update.interval;
+    }
+
+    service_list_entry = service_list_entry->next;
+  }
+
+  return ((interval > 0) && (interval <= (BLE_POOL_IDLE_RATIO * ble_adapter->connect_time)));
+}
+
+/* Free a slot for devices connected on demand, the pooled device due
+   last goes unless it is due before it could be connected again */
+static void ble_evict_pool (void)
+{
+  int32 current_time = clock_get_count ();
+  ble_connection_params_t *evict = NULL;
+  int32 index;
+
+  for (index = 0; index < ble_adapter->max_connections; index++)
+  {
+    ble_connection_params_t *connection = &(ble_adapter->connection_list[index]);
+
+    if ((connection->pooled) && (connection->device != NULL) &&
+        (((ble_next_due (connection->device)) - current_time) > ble_adapter->connect_time) &&
+        ((evict == NULL) || (((ble_next_due (connection->device)) - (ble_next_due (evict->device))) > 0)))
+    {
+      evict = connection;
+    }
+  }
+
+  if (evict != NULL)
+  {
+    printf ("BLE Pool evict\n");
+    ble_print_device (evict->device);
+
+    /* Disconnect ends its cycle like any other, see ble_next_data () */
+    connection_params            = evict;
+    connection_params->pooled    = 0;
+    ble_adapter->evict_pending   = evict;
+    ble_connect_disconnect ();
+  }
+}
+
+static void ble_stop_data (void)
+{
+  if (((clock_get_count ())- ble_adapter->init_time) > (24*60*60*1000))
+  {
+    int32 index;
+
+    /* Adapter reset drops streams & pooled connections */
+    for (index = 0; index < ble_adapter->max_connections; index++)
+    {
+      if ((ble_adapter->connection_list[index].stream) ||
+          (ble_adapter->connection_list[index].pooled))
+      {
+        ble_drop_connection (&(ble_adapter->connection_list[index]));
+      }
+    }
+
+    ble_deinit_adapter ();
+    (void)ble_init_adapter (2);
+  }
+    
+  (void)ble_start_timer (BLE_MIN_TIMER_DURATION, BLE_TIMER_DATA_STOP);
+
+  if ((ble_adapter->pool_hits + ble_adapter->pool_misses) > 0)
+  {
+    printf ("BLE Pool hits %u, misses %u, hit rate %u%%\n", ble_adapter->pool_hits, ble_adapter->pool_misses,
+            ((100 * ble_adapter->pool_hits)/(ble_adapter->pool_hits + ble_adapter->pool_misses)));
+  }
+
+  if (ble_adapter->scan_reports > 0)
+  {
+    printf ("BLE Scan reports %u, duplicates %u, dropped %u\n", ble_adapter->scan_reports,
+            ble_adapter->scan_duplicates, ble_adapter->scan_drops);
+  }
 
   ble_update_device_list (&ble_device_list);
+  ble_balance_device_list ();
 }
 
-void ble_start_profile (void)
+void ble_start_data (void)
 {
   ble_update_sleep ();
   
-  connection_params.device = ble_device_list;
-  while ((connection_params.device != NULL) &&
-         (connection_params.device->status != BLE_DEVICE_DISCOVER_SERVICE))
+  ble_adapter->device = (ble_device_list_entry_t *)(ble_device_list.head);
+  ble_connect_data ();
+
+  if ((ble_active_connections ()) == 0)
   {
-    connection_params.device = connection_params.device->next;
+    ble_stop_data ();
   }
-
-  ble_clear_service (connection_params.device->service_list);
-  ble_connect_direct ();
 }
 
-void ble_next_profile (void)
+void ble_next_data (void)
 {
-  ble_update_sleep ();
-  
-  connection_params.device = connection_params.device->next;
-  while ((connection_params.device != NULL) &&
-         (connection_params.device->status != BLE_DEVICE_DISCOVER_SERVICE))
+  if (connection_params->device == NULL)
   {
-    connection_params.device = connection_params.device->next;
+    /* Late connection of a given up attempt, nothing was read */
+    ble_clear_connection (connection_params);
+    return;
   }
 
-  if (connection_params.device != NULL)
+  if (ble_adapter->evict_pending == connection_params)
   {
-    ble_clear_service (connection_params.device->service_list);
-    ble_connect_direct ();
+    ble_adapter->evict_pending = NULL;
   }
-  else
-  {
-    timer_info_t *timer_info = NULL;
 
-    (void)timer_start (BLE_MIN_TIMER_DURATION, BLE_TIMER_PROFILE_STOP,
-                       ble_callback_timer, &timer_info);
+  ble_update_service (connection_params->device->service_list,
+                      connection_params->device);
+  ble_schedule_device (connection_params->device);
+  
+  ble_update_sleep ();
 
-    ble_update_device_list (&ble_device_list);
+  ble_clear_connection (connection_params);
+  ble_connect_data ();
+
+  /* Data cycle ends when the last connection closes */
+  if ((ble_active_connections ()) == 0)
+  {
+    ble_stop_data ();
   }
 }
 
-void ble_read_profile (void)
+void ble_connect_data (void)
 {
-  int32 status;
+  ble_connection_params_t *connection;
+  int32 index;
 
-  if (connection_params.device->status == BLE_DEVICE_DISCOVER_SERVICE)
-  {
-    status = ble_read_group ();
-    if (status > 0)
-    {
-      connection_params.device->status = BLE_DEVICE_DISCOVER_CHAR_DESC;
-    }
-    else
-    {
-      ble_connect_disconnect ();
-    }
-  }
-  else if (connection_params.device->status == BLE_DEVICE_DISCOVER_CHAR_DESC)
+  /* Pooled devices that are due need no set up */
+  for (index = 0; index < ble_adapter->max_connections; index++)
   {
-    if (connection_params.service == NULL)
-    {
-      connection_params.service = connection_params.device->service_list;
-    }
-    else
-    {
-      connection_params.service = connection_params.service->next;
-    }
+    connection = &(ble_adapter->connection_list[index]);
 
-    status = ble_find_information ();
-    if (status > 0)
-    {
-      if (connection_params.service->next == NULL)
-      {
-        connection_params.device->status = BLE_DEVICE_DISCOVER_CHAR;
-      }
-    }
-    else
+    if ((connection->pooled) && (connection->device != NULL) &&
+        ((ble_find_data (connection->device)) != NULL))
     {
-      connection_params.device->status = BLE_DEVICE_DISCOVER_SERVICE;
-      ble_connect_disconnect ();
+      ble_adapter->pool_hits++;
+
+      connection_params          = connection;
+      connection_params->pooled  = 0;
+      connection_params->service = ble_find_data (connection_params->device);
+      connection_params->timer   = ble_start_timer (BLE_CONNECT_DATA_TIMEOUT, BLE_TIMER_CONNECT_DATA);
+
+      ble_update_data ();
     }
   }
-  else if (connection_params.device->status == BLE_DEVICE_DISCOVER_CHAR)
+
+  connection = ble_free_connection ();
+
+  /* Keep free contexts busy, stack sets up one connection at a time */
+  if (ble_adapter->connect_pending == NULL)
   {
-    int32 char_read_pending = 0;
-    
-    if (connection_params.attribute == NULL)
-    {
-      connection_params.service         = connection_params.device->service_list;
-      connection_params.characteristics = connection_params.service->char_list;
-      connection_params.attribute       = connection_params.characteristics->declaration;
+    ble_device_list_entry_t *device_list_entry = ble_next_device (BLE_DEVICE_DATA);
 
-      if ((connection_params.characteristics->description != NULL) ||
-          (connection_params.characteristics->client_config != NULL) ||
-          (connection_params.characteristics->format != NULL))
-      {
-        char_read_pending = 1;
-      }
-    }
-    else
+    if ((device_list_entry != NULL) && (connection != NULL))
     {
-      if ((connection_params.characteristics->description != NULL) &&
-          (connection_params.characteristics->description->data == NULL))
-      {
-        connection_params.attribute = connection_params.characteristics->description;
+      ble_adapter->pool_misses++;
 
-        if ((connection_params.characteristics->client_config != NULL) ||
-            (connection_params.characteristics->format != NULL))
-        {
-          char_read_pending = 1;
-        }
-      }
-      else if ((connection_params.characteristics->client_config != NULL) &&
-               (connection_params.characteristics->client_config->data == NULL))
-      {
-        connection_params.attribute = connection_params.characteristics->client_config;
+      connection_params          = connection;
+      connection_params->device  = device_list_entry;
+      connection_params->service = ble_find_data (device_list_entry);
 
-        if (connection_params.characteristics->format != NULL)
-        {
-          char_read_pending = 1;
-        }        
-      }      
-      else if ((connection_params.characteristics->format != NULL) &&
-               (connection_params.characteristics->format->data == NULL))
-      {
-        connection_params.attribute = connection_params.characteristics->format;
-      }
-      else
-      {
-        if (connection_params.characteristics->next == NULL)
-        {
-          connection_params.service         = connection_params.service->next;
-          connection_params.characteristics = connection_params.service->char_list;
-          connection_params.attribute       = connection_params.characteristics->declaration;        
-        }
-        else
-        {
-          connection_params.characteristics = connection_params.characteristics->next;
-          connection_params.attribute       = connection_params.characteristics->declaration;
-        }
-      
-        if ((connection_params.characteristics->description != NULL) ||
-            (connection_params.characteristics->client_config != NULL) ||
-            (connection_params.characteristics->format != NULL))
-        {
-          char_read_pending = 1;
-        }
-      }
+      ble_connect_direct ();
     }
-
-    status = ble_read_long_handle ();
-    if (status > 0)
+    else if (device_list_entry != NULL)
     {
-      if ((!char_read_pending)                              &&
-          (connection_params.characteristics->next == NULL) &&
-          (connection_params.service->next == NULL))
+      /* Device is picked up again once a slot is free. Waiting is cheaper
+         than a reconnect of a pooled device, unless it is overdue by more
+         than a set up time */
+      ble_adapter->device = device_list_entry;
+
+      if ((ble_adapter->evict_pending == NULL) &&
+          (((clock_get_count ()) - (ble_next_due (device_list_entry))) > ble_adapter->connect_time))
       {
-        connection_params.device->status = BLE_DEVICE_CONFIGURE_CHAR;
+        ble_evict_pool ();
       }
     }
-    else
-    {
-      connection_params.device->status = BLE_DEVICE_DISCOVER_SERVICE;
-      ble_connect_disconnect ();
-    }
   }
-  else
-  {
-    ble_service_list_entry_t *service_list_entry = connection_params.device->service_list;
-    
-    while (service_list_entry != NULL)
-    {
-      ble_char_list_entry_t *char_list_entry = service_list_entry->char_list;
-
-      while (char_list_entry != NULL)
-      {
-        ble_char_decl_t *char_decl = (ble_char_decl_t *)(char_list_entry->declaration->data);
-        
-        bin_reverse (char_decl->uuid, (char_list_entry->declaration->data_length - 3));
-        char_list_entry = char_list_entry->next;
-      }
+}
 
-      service_list_entry = service_list_entry->next;
-    }
+/* Keep the device connected, its services leave the schedule as
+   values now come in on their own */
+static void ble_start_stream (void)
+{
+  ble_service_list_entry_t *service_list_entry;
 
-    ble_print_service (connection_params.device->service_list);
+  printf ("BLE Stream started\n");
+  ble_print_device (connection_params->device);
 
-    if ((ble_init_service (connection_params.device->service_list, connection_params.device)) > 0)
-    {
-      int32 current_time = clock_get_count ();
-      service_list_entry = connection_params.device->service_list;
-  
-      while (service_list_entry != NULL)
-      {
-        service_list_entry->update.time = current_time;
-        service_list_entry = service_list_entry->next;
-      }
+  if (connection_params->timer >= 0)
+  {
+    (void)timer_stop (connection_params->timer);
+    connection_params->timer = -1;
+  }
 
-      connection_params.device->status = BLE_DEVICE_DATA;
-    }
-    else
-    {
-      connection_params.device->status = BLE_DEVICE_DISCOVER_SERVICE;
-    }
+  connection_params->stream          = 1;
+  connection_params->service         = NULL;
+  connection_params->characteristics = NULL;
+  connection_params->attribute       = NULL;
 
-    ble_update_device (connection_params.device);
-    ble_connect_disconnect ();
-  }
-}
+  ble_update_service (connection_params->device->service_list,
+                      connection_params->device);
 
-void ble_start_data (void)
-{
-  ble_update_sleep ();
-  
-  connection_params.device  = ble_device_list;
-  while (connection_params.device != NULL)
+  for (service_list_entry = connection_params->device->service_list; service_list_entry != NULL;
+       service_list_entry = service_list_entry->next)
   {
-    if (connection_params.device->status == BLE_DEVICE_DATA)
-    {
-      connection_params.service = connection_params.device->service_list;
-      while (connection_params.service != NULL)
-      {
-        if ((connection_params.service->update.char_list != NULL) &&
-            (connection_params.service->update.wait <= 0))
-        {
-          break;
-        }
-          
-        connection_params.service = connection_params.service->next;
-      }
-    }
-
-    if (connection_params.service != NULL)
-    {
-      break;
-    }
-    
-    connection_params.device = connection_params.device->next;
+    ble_unschedule_service (service_list_entry);
   }
+  
+  ble_update_sleep ();
+  ble_connect_data ();
 
-  if (connection_params.device != NULL)
+  if ((ble_active_connections ()) == 0)
   {
-    ble_connect_direct ();
+    ble_stop_data ();
   }
 }
 
-void ble_next_data (void)
+/* Keep the device connected for its next update, it stays scheduled */
+static void ble_start_pool (void)
 {
-  ble_update_service (connection_params.device->service_list,
-                      connection_params.device);
-  
-  ble_update_sleep ();
+  printf ("BLE Pooled connection kept\n");
+  ble_print_device (connection_params->device);
 
-  connection_params.device = connection_params.device->next;
-  while (connection_params.device != NULL)
+  if (connection_params->timer >= 0)
   {
-    if (connection_params.device->status == BLE_DEVICE_DATA)
-    {
-      connection_params.service = connection_params.device->service_list;
-      while (connection_params.service != NULL)
-      {
-        if ((connection_params.service->update.char_list != NULL) &&
-            (connection_params.service->update.wait <= 0))
-        {
-          break;
-        }
-          
-        connection_params.service = connection_params.service->next;
-      }
-    }
-
-    if (connection_params.service != NULL)
-    {
-      break;
-    }
-    
-    connection_params.device = connection_params.device->next;
+    (void)timer_stop (connection_params->timer);
+    connection_params->timer = -1;
   }
 
-  if (connection_params.device != NULL)
-  {
-    ble_connect_direct ();
-  }
-  else
-  {
-    timer_info_t *timer_info = NULL;
-    
-    if (((clock_get_count ())- ble_init_time) > (24*60*60*1000))
-    {
-      ble_deinit ();
-      (void)ble_init ();
-    }
-    
-    (void)timer_start (BLE_MIN_TIMER_DURATION, BLE_TIMER_DATA_STOP,
-                       ble_callback_timer, &timer_info);
+  connection_params->pooled          = 1;
+  connection_params->service         = NULL;
+  connection_params->characteristics = NULL;
+  connection_params->attribute       = NULL;
 
-    ble_update_device_list (&ble_device_list);
+  ble_update_service (connection_params->device->service_list,
+                      connection_params->device);
+  ble_schedule_device (connection_params->device);
+  
+  ble_update_sleep ();
+  ble_connect_data ();
+
+  if ((ble_active_connections ()) == 0)
+  {
+    ble_stop_data ();
   }
 }
 
@@ -1347,78 +2857,75 @@ void ble_update_data (void)
 {
   int32 status = 1;
 
-  if (connection_params.handle != 0xff)
+  if (connection_params->handle != 0xff)
   {
     int32 notify_pending = 0;
     
-    if (connection_params.characteristics == NULL)
+    if (connection_params->characteristics == NULL)
     {
-      if (connection_params.service != NULL)
+      if (connection_params->service != NULL)
       {
-        connection_params.characteristics = connection_params.service->update.char_list;
+        connection_params->characteristics = connection_params->service->update.char_list;
       }
     }
     else 
     {
-      if ((connection_params.characteristics->value->type & (BLE_ATTR_TYPE_NOTIFY | BLE_ATTR_TYPE_INDICATE)) &&
-          (connection_params.characteristics->value->data == NULL))
+      if ((connection_params->characteristics->value->type & (BLE_ATTR_TYPE_NOTIFY | BLE_ATTR_TYPE_INDICATE)) &&
+          (connection_params->characteristics->value->data == NULL))
       {
         notify_pending = 1;
       }
-      else if (connection_params.characteristics->value->type & BLE_ATTR_TYPE_WRITE)
+      else if (connection_params->characteristics->value->type & BLE_ATTR_TYPE_WRITE)
       {
-        free (connection_params.characteristics->value->data);
-        
-        connection_params.characteristics->value->data        = NULL;
-        connection_params.characteristics->value->data_length = 0;
+        ble_clear_attribute_data (connection_params->characteristics->value);
       }
 
       if (!notify_pending)
       {
-        if (connection_params.characteristics->next == NULL)
+        if (connection_params->characteristics->next == NULL)
         {
-          connection_params.service         = connection_params.service->next;
-          connection_params.characteristics = NULL;
+          connection_params->service         = connection_params->service->next;
+          connection_params->characteristics = NULL;
   
-          while (connection_params.service != NULL)
+          while (connection_params->service != NULL)
           {
-            if ((connection_params.service->update.char_list != NULL) &&
-                (connection_params.service->update.wait <= 0))
+            if ((connection_params->service->update.char_list != NULL) &&
+                (connection_params->service->update.wait <= 0))
             {
-              connection_params.characteristics = connection_params.service->update.char_list;
+              connection_params->characteristics = connection_params->service->update.char_list;
               break;
             }
   
-            connection_params.service = connection_params.service->next;
+            connection_params->service = connection_params->service->next;
           }
         }
         else
         {
-          connection_params.characteristics = connection_params.characteristics->next;
+          connection_params->characteristics = connection_params->characteristics->next;
         }
       }
     }
 
-    if (connection_params.characteristics != NULL)
+    if (connection_params->characteristics != NULL)
     {
       if (!notify_pending)
       {
-        if (connection_params.characteristics->value->type & BLE_ATTR_TYPE_READ)
+        if (connection_params->characteristics->value->type & BLE_ATTR_TYPE_READ)
         {
-          connection_params.attribute = connection_params.characteristics->value;
+          connection_params->attribute = connection_params->characteristics->value;
           
           status = ble_read_long_handle ();
         }
         else
         {
-          if ((connection_params.characteristics->value->type & (BLE_ATTR_TYPE_NOTIFY |
+          if ((connection_params->characteristics->value->type & (BLE_ATTR_TYPE_NOTIFY |
                                                                  BLE_ATTR_TYPE_INDICATE)))
           {
-            connection_params.attribute = connection_params.characteristics->client_config;
+            connection_params->attribute = connection_params->characteristics->client_config;
           }
           else
           {
-            connection_params.attribute = connection_params.characteristics->value;
+            connection_params->attribute = connection_params->characteristics->value;
           }
           
           status = ble_write_handle ();
@@ -1428,7 +2935,7 @@ void ble_update_data (void)
     else
     {
       int32 update_pending = 0;
-      ble_service_list_entry_t *service_list_entry = connection_params.device->service_list;
+      ble_service_list_entry_t *service_list_entry = connection_params->device->service_list;
       
       while ((service_list_entry != NULL) && (!update_pending))
       {
@@ -1452,7 +2959,18 @@ void ble_update_data (void)
 
       if (!update_pending)
       {
-        ble_connect_disconnect ();
+        if ((ble_check_stream ()) > 0)
+        {
+          ble_start_stream ();
+        }
+        else if ((ble_check_pool ()) > 0)
+        {
+          ble_start_pool ();
+        }
+        else
+        {
+          ble_connect_disconnect ();
+        }
       }
     }
   }
@@ -1462,44 +2980,180 @@ void ble_update_data (void)
   }
 }
 
-int32 ble_get_sleep (void)
+/* Events on streaming & idle pooled connections, whatever the adapter
+   state. Returns 1 if the message was taken */
+int32 ble_event_stream (ble_message_t *message)
 {
-  int32 min_sleep_interval;
-  ble_device_list_entry_t *device_list_entry;
+  int32 status = 0;
 
-  min_sleep_interval = 0x7fffffff;
-  device_list_entry  = ble_device_list;
-  
-  ble_update_sleep ();
+  if ((message->header.type == BLE_EVENT)                       &&
+      ((message->header.class == BLE_CLASS_CONNECTION) ||
+       (message->header.class == BLE_CLASS_ATTR_CLIENT))        &&
+      ((connection_params->stream) || (connection_params->pooled)) &&
+      (connection_params->handle == message->data[0]))
+  {
+    if ((message->header.class == BLE_CLASS_CONNECTION) &&
+        (message->header.command == BLE_EVENT_DISCONNECTED))
+    {
+      printf ("BLE Disconnect event, reason 0x%04x\n", ((ble_event_disconnect_t *)message)->cause);
+      ble_drop_connection (connection_params);
+    }
+    else if ((message->header.class == BLE_CLASS_ATTR_CLIENT) &&
+             (message->header.command == BLE_EVENT_ATTR_CLIENT_VALUE) &&
+             (connection_params->stream) && (connection_params->device != NULL))
+    {
+      ble_event_attr_value ((ble_event_attr_value_t *)message);
+    }
+    else
+    {
+      ble_print_message (message);
+    }
 
-  /* Loop through update list to find the minimum sleep interval */
-  while (device_list_entry != NULL)
+    status = 1;
+  }
+
+  return status;
+}
+
+/* Store values streamed since the last call on all adapters, a burst
+   goes in one transaction */
+void ble_update_stream (void)
+{
+  int32 found = 0;
+  int32 index;
+  int32 connection;
+
+  for (index = 0; index < ble_num_adapters; index++)
   {
-    if ((device_list_entry->status == BLE_DEVICE_DATA)  ||
-        (device_list_entry->status == BLE_DEVICE_DISCOVER))
+    for (connection = 0; connection < ble_adapter_list[index].max_connections; connection++)
     {
-      ble_service_list_entry_t *service_list_entry = device_list_entry->service_list;
+      ble_connection_params_t *stream = &(ble_adapter_list[index].connection_list[connection]);
 
-      while (service_list_entry != NULL)
+      if ((stream->stream_pending) && (stream->device != NULL))
       {
-        if (service_list_entry->update.char_list != NULL)
+        ble_service_list_entry_t *service_list_entry = stream->device->service_list;
+
+        if (!found)
         {
-          min_sleep_interval = (min_sleep_interval > service_list_entry->update.wait)
-                                ? service_list_entry->update.wait : min_sleep_interval;
+          ble_begin_update ();
+          found = 1;
         }
 
-        service_list_entry = service_list_entry->next;
+        for (; service_list_entry != NULL; service_list_entry = service_list_entry->next)
+        {
+          service_list_entry->update.wait = 0;
+        }
+
+        ble_update_service (stream->device->service_list, stream->device);
+        stream->stream_pending = 0;
       }
     }
-    
-    device_list_entry = device_list_entry->next;
   }
 
-  if ((min_sleep_interval == 0x7fffffff) || (min_sleep_interval == 0))
+  if (found)
+  {
+    ble_end_update ();
+  }
+}
+
+/* Device is about to be deleted, drop its stream or pooled connection.
+   The context is kept till the disconnect event */
+/* Whether a connection of any adapter, other than a stream or pooled
+   one, is using the device i.e. it is being connected, read or discovered */
+int32 ble_check_device_busy (ble_device_list_entry_t *device_list_entry)
+{
+  int32 index;
+
+  for (index = 0; index < ble_num_adapters; index++)
+  {
+    ble_connection_params_t *connection = ble_find_connection (&(ble_adapter_list[index]), device_list_entry);
+
+    if ((connection != NULL) && (!(connection->stream)) && (!(connection->pooled)))
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Device is about to be freed, see ble_check_device_busy (). Adapter
+   cursors move past it & stream or pooled connections are dropped */
+void ble_release_device (ble_device_list_entry_t *device_list_entry)
+{
+  ble_adapter_t *adapter                = ble_adapter;
+  ble_connection_params_t *connection   = connection_params;
+  int32 index;
+
+  for (index = 0; index < ble_num_adapters; index++)
+  {
+    ble_adapter       = &(ble_adapter_list[index]);
+    connection_params = ble_find_connection (ble_adapter, device_list_entry);
+
+    if (ble_adapter->device == device_list_entry)
+    {
+      ble_adapter->device = device_list_entry->next;
+    }
+
+    if ((connection_params != NULL) && ((connection_params->stream) || (connection_params->pooled)))
+    {
+      ble_connect_disconnect ();
+      connection_params->device         = NULL;
+      connection_params->stream_pending = 0;
+    }
+  }
+
+  ble_adapter       = adapter;
+  connection_params = connection;
+}
+
+void ble_set_streams (int32 streams)
+{
+  ble_max_streams = ((streams >= 0) && (streams < BLE_MAX_CONNECTIONS)) ? streams : 0;
+}
+
+/* Background scan resumes once the adapter is free of GAP procedures */
+void ble_update_scan (void)
+{
+  if ((ble_background_scan) && (ble_adapter->scan_mode == BLE_SCAN_MODE_IDLE) &&
+      (ble_adapter->connect_pending == NULL) &&
+      (((int32)((clock_get_count ()) - ble_adapter->scan_retry)) >= 0))
+  {
+    if ((ble_discover (BLE_SCAN_MODE_BACKGROUND)) <= 0)
+    {
+      ble_adapter->scan_retry = (clock_get_count ()) + BLE_MIN_TIMER_DURATION;
+    }
+  }
+}
+
+void ble_set_background_scan (int32 enable)
+{
+  ble_background_scan = enable;
+}
+
+int32 ble_get_sleep (void)
+{
+  int32 min_sleep_interval;
+  ble_schedule_entry_t *next_entry = NULL;
+
+  ble_update_sleep ();
+
+  /* Head of the adapter schedule gives the minimum sleep interval */
+  ble_next_update (&(ble_adapter->schedule), 0, &next_entry);
+
+  if (next_entry != NULL)
+  {
+    min_sleep_interval = next_entry->service->update.time - (clock_get_count ());
+  }
+  else
+  {
+    min_sleep_interval = 0;
+  }
+
+  if (min_sleep_interval <= 0)
   {
     min_sleep_interval = 10;
   }
   
   return min_sleep_interval;
 }
-
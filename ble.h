@@ -3,6 +3,7 @@
 
 /* GATT definitions */
 #include "types.h"
+#include "util.h"
 #include "profile.h"
 
 /* Maximum message data size */
@@ -26,6 +27,12 @@
 /* Sync thread timeout in ms */
 #define BLE_SYNC_TIMEOUT  (5000)
 
+/* Maximum number of BLE adapters (dongles) */
+#define BLE_MAX_ADAPTERS  (SERIAL_MAX_DEVICES)
+
+/* Maximum simultaneous connections per adapter, stack supports up to 8 */
+#define BLE_MAX_CONNECTIONS  (8)
+
 /* Message header definitions */
 /* Message types */
 enum
@@ -258,6 +265,11 @@ enum
   BLE_TIMER_INVALID       = 8
 };
 
+/* Timer event with adapter index & connection in upper bits */
+#define BLE_TIMER_EVENT(adapter, connection, event)  (((adapter) << 16) | ((connection) << 8) | (event))
+#define BLE_TIMER_ADAPTER(timer_event)               ((timer_event) >> 16)
+#define BLE_TIMER_CONNECTION(timer_event)            (((timer_event) >> 8) & 0xff)
+
 /* Message header */
 typedef struct PACKED
 {
@@ -330,13 +342,75 @@ typedef struct PACKED
   ble_message_header_t header;
 } ble_command_hello_t;
 
+/* System get connections command definitions */
+/* Get connections message */
+typedef struct PACKED
+{
+  ble_message_header_t header;
+} ble_command_get_connections_t;
+
+typedef struct PACKED
+{
+  ble_message_header_t header;
+  uint8                max_connections;
+} ble_response_get_connections_t;
+
+/* System whitelist command definitions */
+/* Whitelist capacity of the stack */
+#define BLE_WHITELIST_SIZE  (8)
+
+/* Append/remove whitelist message */
+typedef struct PACKED
+{
+  ble_message_header_t header;
+  ble_device_address_t device_address;
+} ble_command_whitelist_t;
+
+typedef struct PACKED
+{
+  ble_message_header_t header;
+  uint16               result;
+} ble_response_whitelist_t;
+
+/* Clear whitelist message */
+typedef struct PACKED
+{
+  ble_message_header_t header;
+} ble_command_clear_whitelist_t;
+
 /* GAP discover/scan start command definitions */
-/* Scan window/interval */
-#define BLE_SCAN_WINDOW    MS_TO_625US(200)
-#define BLE_SCAN_INTERVAL  MS_TO_625US(1000)
+/* Scan interval in ms, short when outstanding devices fit the whitelist */
+#define BLE_MIN_SCAN_INTERVAL  (250)
+#define BLE_MAX_SCAN_INTERVAL  (1000)
+
+/* Scan window as percent of the interval, adapted to the discovery rate */
+#define BLE_SCAN_DUTY      (20)
+#define BLE_MIN_SCAN_DUTY  (10)
+#define BLE_MAX_SCAN_DUTY  (100)
 
+/* Longest scan, ends early once expected devices reported */
 #define BLE_SCAN_DURATION  (5000)
 
+/* Low duty passive scan in between, 30 ms every 300 ms */
+#define BLE_BACKGROUND_SCAN_WINDOW    MS_TO_625US(30)
+#define BLE_BACKGROUND_SCAN_INTERVAL  MS_TO_625US(300)
+
+typedef enum
+{
+  BLE_SCAN_MODE_IDLE = 0,
+  BLE_SCAN_MODE_ACTIVE,
+  BLE_SCAN_MODE_BACKGROUND
+} ble_scan_mode_e;
+
+/* Scan report dedupe cache (power of 2), a report repeated within the
+   timeout is dropped */
+#define BLE_SCAN_CACHE_SIZE     (256)
+#define BLE_SCAN_CACHE_TIMEOUT  (10000)
+
+/* Scan reports queued while waiting for a command response, more
+   are dropped */
+#define BLE_MAX_QUEUED_SCAN  (32)
+
 /* Scan modes */
 enum
 {
@@ -413,6 +487,7 @@ enum
   BLE_ADV_RANDOM_TARGET_ADDR  = 0x18,
   BLE_ADV_APPEARANCE          = 0x19,
   BLE_ADV_INTERVAL            = 0x1A,
+  BLE_ADV_128BIT_SERVICE_DATA = 0x21,
   BLE_ADV_MANUFACTURER_DATA   = 0xFF
 };
 
@@ -495,6 +570,10 @@ typedef struct PACKED
 #define BLE_CONNECT_DATA_TIMEOUT   (10000)
 #define BLE_CONNECT_TIMEOUT        MS_TO_10MS(3000)
 
+/* Keep a device connected across data cycles if its update interval is
+   within this many times the connection set up time */
+#define BLE_POOL_IDLE_RATIO  (200)
+
 #define BLE_CONNECT_LATENCY  (0)
 
 /* Connection status flags */
@@ -593,6 +672,24 @@ typedef struct PACKED
   uint8                data[];
 } ble_event_read_group_t;
 
+/* Read by type definitions */
+typedef struct PACKED
+{
+  ble_message_header_t header;
+  uint8                conn_handle;
+  uint16               start_handle;
+  uint16               end_handle;
+  uint8                length;
+  uint8                data[BLE_GATT_UUID_LENGTH];
+} ble_command_read_type_t;
+
+typedef struct PACKED
+{
+  ble_message_header_t header;
+  uint8                conn_handle;
+  uint16               result;
+} ble_response_read_type_t;
+
 /* Find information definitions */
 typedef struct PACKED
 {
@@ -682,10 +779,16 @@ typedef struct PACKED
 
 extern void ble_callback_timer (void *timer_info);
 
+extern int32 ble_start_timer (int32 millisec, int32 event);
+
 extern int32 ble_init (void);
 
 extern void ble_deinit (void);
 
+extern int32 ble_get_adapters (void);
+
+extern void ble_set_adapter (int32 adapter);
+
 extern int32 ble_check_scan_list (void);
 
 extern int32 ble_check_profile_list (void);
@@ -712,10 +815,26 @@ extern void ble_start_data (void);
 
 extern void ble_next_data (void);
 
+extern void ble_connect_data (void);
+
 extern void ble_update_data (void);
 
 extern int32 ble_get_sleep (void);
 
+extern int32 ble_event_stream (ble_message_t *message);
+
+extern void ble_update_stream (void);
+
+extern int32 ble_check_device_busy (ble_device_list_entry_t *device_list_entry);
+
+extern void ble_release_device (ble_device_list_entry_t *device_list_entry);
+
+extern void ble_set_streams (int32 streams);
+
+extern void ble_update_scan (void);
+
+extern void ble_set_background_scan (int32 enable);
+
 extern void ble_event_scan_response (ble_event_scan_response_t *scan_response);
 
 extern int32 ble_event_connection_status (ble_event_connection_status_t *connection_status);
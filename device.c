@@ -9,11 +9,14 @@
 #include "profile.h"
 #include "sync.h"
 #include "device.h"
+#include "ble.h"
 
 /* Database declaration/definition */
 enum
 {
   DB_DEVICE_LIST_TABLE = 0,
+  DB_PROFILE_CACHE_TABLE,
+  DB_DEVICE_ID_TABLE,
   DB_NUM_STATIC_TABLES
 };
 
@@ -44,13 +47,94 @@ static db_column_entry_t db_device_table_columns[DB_DEVICE_TABLE_NUM_COLUMNS] =
     (DB_COLUMN_FLAG_NOT_NULL | DB_COLUMN_FLAG_DEFAULT_NA | DB_COLUMN_FLAG_UPDATE_VALUE), NULL}
 };
 
+enum
+{
+  DB_PROFILE_TABLE_COLUMN_NO = 0,
+  DB_PROFILE_TABLE_COLUMN_ADDRESS,
+  DB_PROFILE_TABLE_COLUMN_PROFILE,
+  DB_PROFILE_TABLE_NUM_COLUMNS
+};
+
+static db_column_entry_t db_profile_table_columns[DB_PROFILE_TABLE_NUM_COLUMNS] =
+{
+  {"No.",      DB_PROFILE_TABLE_COLUMN_NO,      DB_COLUMN_TYPE_INT,
+    DB_COLUMN_FLAG_PRIMARY_KEY,                                NULL},
+  {"Address",  DB_PROFILE_TABLE_COLUMN_ADDRESS, DB_COLUMN_TYPE_TEXT,
+    (DB_COLUMN_FLAG_NOT_NULL | DB_COLUMN_FLAG_UPDATE_KEY),     NULL},
+  {"Profile",  DB_PROFILE_TABLE_COLUMN_PROFILE, DB_COLUMN_TYPE_BLOB,
+    (DB_COLUMN_FLAG_NOT_NULL | DB_COLUMN_FLAG_UPDATE_VALUE),   NULL}
+};
+
+/* Device dimension of the profile readings tables, one row per device
+   address. Ids are given out here so that rows can be queued before
+   they're stored */
+enum
+{
+  DB_ID_TABLE_COLUMN_ID = 0,
+  DB_ID_TABLE_COLUMN_ADDRESS,
+  DB_ID_TABLE_COLUMN_NAME,
+  DB_ID_TABLE_NUM_COLUMNS
+};
+
+static db_column_entry_t db_id_table_columns[DB_ID_TABLE_NUM_COLUMNS] =
+{
+  {"Id",       DB_ID_TABLE_COLUMN_ID,           DB_COLUMN_TYPE_INT,
+    (DB_COLUMN_FLAG_NOT_NULL | DB_COLUMN_FLAG_UNIQUE | DB_COLUMN_FLAG_INDEX_KEY), NULL},
+  {"Address",  DB_ID_TABLE_COLUMN_ADDRESS,      DB_COLUMN_TYPE_TEXT,
+    (DB_COLUMN_FLAG_NOT_NULL | DB_COLUMN_FLAG_UNIQUE),                            NULL},
+  {"Name",     DB_ID_TABLE_COLUMN_NAME,         DB_COLUMN_TYPE_TEXT,
+    (DB_COLUMN_FLAG_NOT_NULL | DB_COLUMN_FLAG_DEFAULT_NA),     NULL}
+};
+
 static db_table_list_entry_t db_static_tables[DB_NUM_STATIC_TABLES] =
 {
-  {NULL, "Device List", DB_DEVICE_TABLE_NUM_COLUMNS, db_device_table_columns, NULL, NULL, NULL, NULL}
+  {NULL, "Device List", DB_DEVICE_TABLE_NUM_COLUMNS, db_device_table_columns, NULL, NULL, NULL, NULL, NULL},
+  {NULL, "Profile Cache", DB_PROFILE_TABLE_NUM_COLUMNS, db_profile_table_columns, NULL, NULL, NULL, NULL, NULL},
+  {NULL, "Device Id", DB_ID_TABLE_NUM_COLUMNS, db_id_table_columns, NULL, NULL, NULL, NULL, NULL}
 };
 
+/* Packed profile, as discovered i.e. before ble_init_service ()
+ *   services (1)
+ *   per service: uuid length (1), uuid, start handle (2), end handle (2), characteristics (1)
+ *   per characteristic: attribute mask (1), then per attribute present
+ *     type (1), handle (2), uuid length (1), uuid, data length (1), data */
+#define BLE_PROFILE_CACHE_MAX_COUNT  (0xff)
+
+typedef struct
+{
+  uint8  *data;
+  uint32  length;
+  uint32  size;
+  uint32  offset;
+} ble_profile_buffer_t;
+
 static db_info_t *db_info = NULL;
 
+static int32 db_next_device_id = 1;
+
+/* Device list updates held back till the device is free */
+DLIST_HEAD_INIT (ble_deferred_sync_list);
+
+/* Ids given out so far, kept for addresses whose device is deleted &
+   added again */
+typedef struct
+{
+  uint8 address[BLE_DEVICE_ADDRESS_LENGTH];
+  int32 id;
+} ble_device_id_entry_t;
+
+static ble_device_id_entry_t *ble_device_id_list = NULL;
+static int32 ble_device_id_length = 0;
+static int32 ble_device_id_size = 0;
+
+/* Device index by address (including type), open addressing with linear
+   probing. Size is a power of 2 and kept at most half full */
+#define BLE_DEVICE_HASH_MIN_SIZE  (64)
+
+static ble_device_list_entry_t **device_hash_table = NULL;
+static uint32 device_hash_size = 0;
+static uint32 device_hash_count = 0;
+
 
 static void ble_print_device_list (ble_device_list_entry_t *device_list_entry)
 {
@@ -110,7 +194,7 @@ void ble_update_device (ble_device_list_entry_t *device_list_entry)
   {
     ble_sync_list_entry_t *sync_list_entry;
     ble_sync_device_data_t *sync_device_data;
-    db_column_value_t column_value;
+    db_column_value_t value[DB_DEVICE_TABLE_NUM_COLUMNS];
 
     sync_list_entry            = (ble_sync_list_entry_t *)malloc (sizeof (*sync_list_entry));
     sync_list_entry->type      = BLE_SYNC_PUSH;
@@ -120,64 +204,524 @@ void ble_update_device (ble_device_list_entry_t *device_list_entry)
     sync_device_data       = (ble_sync_device_data_t *)(sync_list_entry->data);
     sync_device_data->name = strdup (device_list_entry->name);
 
-    column_value.text = malloc ((2 * BLE_DEVICE_ADDRESS_LENGTH) + 1);
-    bin_to_string (column_value.text, device_list_entry->address.byte, BLE_DEVICE_ADDRESS_LENGTH);
-    db_write_column (&(db_static_tables[DB_DEVICE_LIST_TABLE]), DB_WRITE_UPDATE, DB_DEVICE_TABLE_COLUMN_ADDRESS, &column_value);
-    sync_device_data->address = strdup (column_value.text);
-    free (column_value.text);
-    column_value.text = malloc ((2 * service_list_entry->declaration->data_length) + 1);
-    bin_to_string (column_value.text, service_list_entry->declaration->data,
+    sync_device_data->address = malloc ((2 * BLE_DEVICE_ADDRESS_LENGTH) + 1);
+    bin_to_string (sync_device_data->address, device_list_entry->address.byte, BLE_DEVICE_ADDRESS_LENGTH);
+    sync_device_data->service = malloc ((2 * service_list_entry->declaration->data_length) + 1);
+    bin_to_string (sync_device_data->service, service_list_entry->declaration->data,
                    service_list_entry->declaration->data_length);
-    db_write_column (&(db_static_tables[DB_DEVICE_LIST_TABLE]), DB_WRITE_UPDATE, DB_DEVICE_TABLE_COLUMN_SERVICE, &column_value);
-    sync_device_data->service = strdup (column_value.text);
-    free (column_value.text);
     
-    if (device_list_entry->status == BLE_DEVICE_DATA)
+    if (device_list_entry->status == BLE_DEVICE_ADVERTISE)
+    {
+      sync_device_data->status = strdup ("Active");
+    }
+    else if (device_list_entry->status == BLE_DEVICE_DATA)
     {
       if (service_list_entry->update.char_list != NULL)
       {
-        column_value.text = "Active";
+        sync_device_data->status = strdup ("Active");
       }
       else
       {
-        column_value.text = "Ignored";
+        sync_device_data->status = strdup ("Ignored");
       }
     }
     else
     {
-      column_value.text = "Inactive";
+      sync_device_data->status = strdup ("Inactive");
     }
-    db_write_column (&(db_static_tables[DB_DEVICE_LIST_TABLE]), DB_WRITE_UPDATE, DB_DEVICE_TABLE_COLUMN_STATUS, &column_value);
-    sync_device_data->status = strdup (column_value.text);
 
-    column_value.integer = (service_list_entry->update.interval)/(60 * 1000);
-    db_write_column (&(db_static_tables[DB_DEVICE_LIST_TABLE]), DB_WRITE_UPDATE, DB_DEVICE_TABLE_COLUMN_INTERVAL, &column_value);    
     sync_device_data->interval = (service_list_entry->update.interval)/(60 * 1000);
-    
-    db_write_table (&(db_static_tables[DB_DEVICE_LIST_TABLE]), DB_WRITE_UPDATE);
+
+    value[DB_DEVICE_TABLE_COLUMN_ADDRESS].text     = sync_device_data->address;
+    value[DB_DEVICE_TABLE_COLUMN_SERVICE].text     = sync_device_data->service;
+    value[DB_DEVICE_TABLE_COLUMN_STATUS].text      = sync_device_data->status;
+    value[DB_DEVICE_TABLE_COLUMN_INTERVAL].integer = sync_device_data->interval;
+    db_write_row (&(db_static_tables[DB_DEVICE_LIST_TABLE]), DB_WRITE_UPDATE, value, 0);
     ble_sync_push (sync_list_entry);
 
     service_list_entry = service_list_entry->next;
   }
 }
 
-ble_device_list_entry_t * ble_find_device (ble_device_list_entry_t *device_list_entry,
-                                           ble_device_address_t *address)
+/* FNV-1a over address bytes & type */
+static uint32 ble_hash_address (ble_device_address_t *address)
+{
+  uint8 *byte = (uint8 *)address;
+  uint32 hash = 2166136261U;
+  uint32 index;
+
+  for (index = 0; index < (sizeof (*address)); index++)
+  {
+    hash ^= byte[index];
+    hash *= 16777619U;
+  }
+
+  return hash;
+}
+
+static void ble_hash_insert (ble_device_list_entry_t *device_list_entry)
 {
-  while (device_list_entry != NULL)
+  uint32 mask = device_hash_size - 1;
+  uint32 slot = ble_hash_address (&(device_list_entry->address)) & mask;
+
+  while (device_hash_table[slot] != NULL)
   {
-    if ((memcmp (address, &(device_list_entry->address), sizeof (*address))) == 0)
+    slot = (slot + 1) & mask;
+  }
+
+  device_hash_table[slot] = device_list_entry;
+  device_hash_count++;
+}
+
+static void ble_hash_add (ble_device_list_entry_t *device_list_entry)
+{
+  if ((2 * (device_hash_count + 1)) > device_hash_size)
+  {
+    ble_device_list_entry_t **hash_table = device_hash_table;
+    uint32 hash_size = device_hash_size;
+    uint32 slot;
+
+    device_hash_size  = (hash_size > 0) ? (2 * hash_size) : BLE_DEVICE_HASH_MIN_SIZE;
+    device_hash_table = (ble_device_list_entry_t **)calloc (device_hash_size, sizeof (*device_hash_table));
+    device_hash_count = 0;
+
+    for (slot = 0; slot < hash_size; slot++)
     {
-      break;
+      if (hash_table[slot] != NULL)
+      {
+        ble_hash_insert (hash_table[slot]);
+      }
+    }
+
+    free (hash_table);
+  }
+
+  ble_hash_insert (device_list_entry);
+}
+
+static void ble_hash_remove (ble_device_list_entry_t *device_list_entry)
+{
+  uint32 mask = device_hash_size - 1;
+  uint32 slot;
+  uint32 next_slot;
+
+  if (device_hash_size == 0)
+  {
+    return;
+  }
+
+  slot = ble_hash_address (&(device_list_entry->address)) & mask;
+  while ((device_hash_table[slot] != NULL) && (device_hash_table[slot] != device_list_entry))
+  {
+    slot = (slot + 1) & mask;
+  }
+
+  if (device_hash_table[slot] == NULL)
+  {
+    return;
+  }
+
+  device_hash_table[slot] = NULL;
+  device_hash_count--;
+
+  /* Shift back later entries of the probe run, no tombstones */
+  for (next_slot = ((slot + 1) & mask); device_hash_table[next_slot] != NULL;
+       next_slot = ((next_slot + 1) & mask))
+  {
+    uint32 home = ble_hash_address (&(device_hash_table[next_slot]->address)) & mask;
+
+    if (((next_slot - home) & mask) >= ((next_slot - slot) & mask))
+    {
+      device_hash_table[slot]      = device_hash_table[next_slot];
+      device_hash_table[next_slot] = NULL;
+      slot = next_slot;
+    }
+  }
+}
+
+ble_device_list_entry_t * ble_find_device (ble_device_address_t *address)
+{
+  ble_device_list_entry_t *device_list_entry = NULL;
+
+  if (device_hash_size > 0)
+  {
+    uint32 mask = device_hash_size - 1;
+    uint32 slot = ble_hash_address (address) & mask;
+
+    while ((device_list_entry = device_hash_table[slot]) != NULL)
+    {
+      if ((memcmp (address, &(device_list_entry->address), sizeof (*address))) == 0)
+      {
+        break;
+      }
+
+      slot = (slot + 1) & mask;
     }
-    
-    device_list_entry = device_list_entry->next;
   }
 
   return device_list_entry;
 }
 
-void ble_init_device_list (ble_device_list_entry_t **device_list)
+static void ble_pack_profile (ble_profile_buffer_t *buffer, const void *data, uint32 length)
+{
+  if ((buffer->length + length) > buffer->size)
+  {
+    while ((buffer->length + length) > buffer->size)
+    {
+      buffer->size = (buffer->size > 0) ? (2 * buffer->size) : 256;
+    }
+    buffer->data = realloc (buffer->data, buffer->size);
+  }
+
+  memcpy ((buffer->data + buffer->length), data, length);
+  buffer->length += length;
+}
+
+static void ble_pack_attribute (ble_profile_buffer_t *buffer, ble_attribute_t *attribute)
+{
+  uint8 byte[2];
+
+  byte[0] = attribute->handle & 0xff;
+  byte[1] = (attribute->handle >> 8) & 0xff;
+
+  ble_pack_profile (buffer, &(attribute->type), 1);
+  ble_pack_profile (buffer, byte, 2);
+  ble_pack_profile (buffer, &(attribute->uuid_length), 1);
+  ble_pack_profile (buffer, attribute->uuid, attribute->uuid_length);
+  ble_pack_profile (buffer, &(attribute->data_length), 1);
+  ble_pack_profile (buffer, attribute->data, attribute->data_length);
+}
+
+static int32 ble_unpack_profile (ble_profile_buffer_t *buffer, void *data, uint32 length)
+{
+  if ((buffer->offset + length) > buffer->length)
+  {
+    return -1;
+  }
+
+  memcpy (data, (buffer->data + buffer->offset), length);
+  buffer->offset += length;
+
+  return 1;
+}
+
+/* Attributes are taken from the device arena, which is cleared as a
+   whole if the cache turns out to be bad */
+static ble_attribute_t * ble_unpack_attribute (ble_profile_buffer_t *buffer, ble_arena_t *arena)
+{
+  uint8 type;
+  uint8 byte[2];
+  uint8 uuid_length;
+  uint8 uuid[BLE_MAX_UUID_LENGTH];
+  uint8 data_length;
+  uint8 data[255];
+  ble_attribute_t *attribute = NULL;
+
+  if (((ble_unpack_profile (buffer, &type, 1)) > 0)               &&
+      ((ble_unpack_profile (buffer, byte, 2)) > 0)                &&
+      ((ble_unpack_profile (buffer, &uuid_length, 1)) > 0)        &&
+      (uuid_length <= BLE_MAX_UUID_LENGTH)                        &&
+      ((ble_unpack_profile (buffer, uuid, uuid_length)) > 0)      &&
+      ((ble_unpack_profile (buffer, &data_length, 1)) > 0)        &&
+      ((ble_unpack_profile (buffer, data, data_length)) > 0))
+  {
+    attribute = ble_new_attribute (arena, type, (byte[0] | (byte[1] << 8)), uuid, uuid_length);
+
+    if (data_length > 0)
+    {
+      ble_set_attribute_data (arena, attribute, data, data_length);
+    }
+  }
+
+  return attribute;
+}
+
+static void ble_delete_profile (ble_device_list_entry_t *device_list_entry)
+{
+  if (device_list_entry->profile_cache != NULL)
+  {
+    db_column_value_t column_value;
+
+    column_value.text = malloc ((2 * BLE_DEVICE_ADDRESS_LENGTH) + 1);
+    bin_to_string (column_value.text, device_list_entry->address.byte, BLE_DEVICE_ADDRESS_LENGTH);
+    db_write_column (&(db_static_tables[DB_PROFILE_CACHE_TABLE]), DB_WRITE_DELETE, DB_PROFILE_TABLE_COLUMN_ADDRESS, &column_value);
+    free (column_value.text);
+    db_write_table (&(db_static_tables[DB_PROFILE_CACHE_TABLE]), DB_WRITE_DELETE);
+
+    free (device_list_entry->profile_cache);
+    device_list_entry->profile_cache        = NULL;
+    device_list_entry->profile_cache_length = 0;
+  }
+}
+
+void ble_save_profile (ble_device_list_entry_t *device_list_entry)
+{
+  ble_profile_buffer_t buffer = {NULL, 0, 0, 0};
+  ble_service_list_entry_t *service_list_entry = device_list_entry->service_list;
+  uint8 count;
+
+  if ((db_static_tables[DB_PROFILE_CACHE_TABLE].insert == NULL) ||
+      ((list_length ((list_entry_t **)(&service_list_entry))) > BLE_PROFILE_CACHE_MAX_COUNT))
+  {
+    return;
+  }
+
+  count = list_length ((list_entry_t **)(&service_list_entry));
+  ble_pack_profile (&buffer, &count, 1);
+
+  while (service_list_entry != NULL)
+  {
+    ble_char_list_entry_t *char_list_entry = service_list_entry->char_list;
+    uint8 byte[4];
+
+    if ((list_length ((list_entry_t **)(&char_list_entry))) > BLE_PROFILE_CACHE_MAX_COUNT)
+    {
+      free (buffer.data);
+      return;
+    }
+
+    byte[0] = service_list_entry->start_handle & 0xff;
+    byte[1] = (service_list_entry->start_handle >> 8) & 0xff;
+    byte[2] = service_list_entry->end_handle & 0xff;
+    byte[3] = (service_list_entry->end_handle >> 8) & 0xff;
+    count   = list_length ((list_entry_t **)(&char_list_entry));
+
+    ble_pack_profile (&buffer, &(service_list_entry->declaration->data_length), 1);
+    ble_pack_profile (&buffer, service_list_entry->declaration->data,
+                      service_list_entry->declaration->data_length);
+    ble_pack_profile (&buffer, byte, 4);
+    ble_pack_profile (&buffer, &count, 1);
+
+    while (char_list_entry != NULL)
+    {
+      ble_attribute_t *attribute[5];
+      uint8 mask = 0;
+      uint8 i;
+
+      attribute[0] = char_list_entry->declaration;
+      attribute[1] = char_list_entry->value;
+      attribute[2] = char_list_entry->description;
+      attribute[3] = char_list_entry->client_config;
+      attribute[4] = char_list_entry->format;
+
+      for (i = 0; i < 5; i++)
+      {
+        if (attribute[i] != NULL)
+        {
+          mask |= (1 << i);
+        }
+      }
+      ble_pack_profile (&buffer, &mask, 1);
+
+      for (i = 0; i < 5; i++)
+      {
+        if (attribute[i] != NULL)
+        {
+          ble_pack_attribute (&buffer, attribute[i]);
+        }
+      }
+
+      char_list_entry = char_list_entry->next;
+    }
+
+    service_list_entry = service_list_entry->next;
+  }
+
+  /* Skip the write when nothing changed, e.g. profile came from cache */
+  if ((device_list_entry->profile_cache != NULL) &&
+      (device_list_entry->profile_cache_length == buffer.length) &&
+      ((memcmp (device_list_entry->profile_cache, buffer.data, buffer.length)) == 0))
+  {
+    free (buffer.data);
+  }
+  else
+  {
+    uint8 write_type = (device_list_entry->profile_cache == NULL) ? DB_WRITE_INSERT : DB_WRITE_UPDATE;
+    db_column_value_t column_value;
+
+    column_value.text = malloc ((2 * BLE_DEVICE_ADDRESS_LENGTH) + 1);
+    bin_to_string (column_value.text, device_list_entry->address.byte, BLE_DEVICE_ADDRESS_LENGTH);
+    db_write_column (&(db_static_tables[DB_PROFILE_CACHE_TABLE]), write_type, DB_PROFILE_TABLE_COLUMN_ADDRESS, &column_value);
+    free (column_value.text);
+    column_value.blob.data   = buffer.data;
+    column_value.blob.length = buffer.length;
+    db_write_column (&(db_static_tables[DB_PROFILE_CACHE_TABLE]), write_type, DB_PROFILE_TABLE_COLUMN_PROFILE, &column_value);
+    db_write_table (&(db_static_tables[DB_PROFILE_CACHE_TABLE]), write_type);
+
+    free (device_list_entry->profile_cache);
+    device_list_entry->profile_cache        = buffer.data;
+    device_list_entry->profile_cache_length = buffer.length;
+  }
+}
+
+/* Restore characteristics from cache, valid only if every service kept
+   its uuid & handle range as just found by read group */
+int32 ble_load_profile (ble_device_list_entry_t *device_list_entry)
+{
+  ble_profile_buffer_t buffer;
+  ble_service_list_entry_t *service_list_entry = device_list_entry->service_list;
+  uint8 count;
+  int32 status = 1;
+
+  if (device_list_entry->profile_cache == NULL)
+  {
+    return -1;
+  }
+
+  buffer.data   = device_list_entry->profile_cache;
+  buffer.length = device_list_entry->profile_cache_length;
+  buffer.size   = device_list_entry->profile_cache_length;
+  buffer.offset = 0;
+
+  if (((ble_unpack_profile (&buffer, &count, 1)) < 0) ||
+      (count != (list_length ((list_entry_t **)(&service_list_entry)))))
+  {
+    status = -1;
+  }
+
+  while ((service_list_entry != NULL) && (status > 0))
+  {
+    uint8 uuid_length;
+    uint8 uuid[BLE_MAX_UUID_LENGTH];
+    uint8 byte[4];
+
+    if (((ble_unpack_profile (&buffer, &uuid_length, 1)) < 0)                         ||
+        (uuid_length != service_list_entry->declaration->data_length)                 ||
+        (uuid_length > BLE_MAX_UUID_LENGTH)                                           ||
+        ((ble_unpack_profile (&buffer, uuid, uuid_length)) < 0)                       ||
+        ((memcmp (uuid, service_list_entry->declaration->data, uuid_length)) != 0)    ||
+        ((ble_unpack_profile (&buffer, byte, 4)) < 0)                                 ||
+        ((byte[0] | (byte[1] << 8)) != service_list_entry->start_handle)              ||
+        ((byte[2] | (byte[3] << 8)) != service_list_entry->end_handle)                ||
+        ((ble_unpack_profile (&buffer, &count, 1)) < 0))
+    {
+      status = -1;
+    }
+
+    while ((status > 0) && (count > 0))
+    {
+      ble_char_list_entry_t *char_list_entry = ble_new_characteristics (&(device_list_entry->arena));
+      ble_attribute_t **attribute[5];
+      uint8 mask;
+      uint8 i;
+
+      list_add ((list_entry_t **)(&(service_list_entry->char_list)), (list_entry_t *)char_list_entry);
+
+      attribute[0] = &(char_list_entry->declaration);
+      attribute[1] = &(char_list_entry->value);
+      attribute[2] = &(char_list_entry->description);
+      attribute[3] = &(char_list_entry->client_config);
+      attribute[4] = &(char_list_entry->format);
+
+      /* Declaration is always there */
+      if (((ble_unpack_profile (&buffer, &mask, 1)) < 0) || (!(mask & 0x01)))
+      {
+        status = -1;
+      }
+
+      for (i = 0; (i < 5) && (status > 0); i++)
+      {
+        if (mask & (1 << i))
+        {
+          *(attribute[i]) = ble_unpack_attribute (&buffer, &(device_list_entry->arena));
+
+          if (*(attribute[i]) == NULL)
+          {
+            status = -1;
+          }
+        }
+      }
+
+      count--;
+    }
+
+    service_list_entry = service_list_entry->next;
+  }
+
+  if (status > 0)
+  {
+    printf ("BLE Profile cache hit\n");
+  }
+  else
+  {
+    printf ("BLE Profile cache miss\n");
+    ble_clear_service (device_list_entry);
+  }
+
+  return status;
+}
+
+/* Id of an address, -1 if none given out yet */
+static int32 ble_find_device_id (ble_device_address_t *address)
+{
+  int32 index;
+
+  for (index = 0; index < ble_device_id_length; index++)
+  {
+    if ((memcmp (ble_device_id_list[index].address, address->byte, BLE_DEVICE_ADDRESS_LENGTH)) == 0)
+    {
+      return ble_device_id_list[index].id;
+    }
+  }
+
+  return -1;
+}
+
+/* First id of an address is kept */
+static void ble_add_device_id (ble_device_address_t *address, int32 id)
+{
+  if ((ble_find_device_id (address)) >= 0)
+  {
+    return;
+  }
+
+  if (ble_device_id_length == ble_device_id_size)
+  {
+    ble_device_id_size = (ble_device_id_size > 0) ? (2 * ble_device_id_size) : 16;
+    ble_device_id_list = realloc (ble_device_id_list,
+                                  (ble_device_id_size * sizeof (ble_device_id_entry_t)));
+  }
+
+  memcpy (ble_device_id_list[ble_device_id_length].address, address->byte, BLE_DEVICE_ADDRESS_LENGTH);
+  ble_device_id_list[ble_device_id_length].id = id;
+  ble_device_id_length++;
+
+  if (id >= db_next_device_id)
+  {
+    db_next_device_id = id + 1;
+  }
+}
+
+/* Device dimension id, given out & stored on first use of the address */
+int32 ble_device_id (ble_device_list_entry_t *device_list_entry)
+{
+  if (device_list_entry->id < 0)
+  {
+    device_list_entry->id = ble_find_device_id (&(device_list_entry->address));
+  }
+
+  if ((device_list_entry->id < 0) && (db_static_tables[DB_DEVICE_ID_TABLE].insert != NULL))
+  {
+    db_column_value_t column_value;
+
+    device_list_entry->id = db_next_device_id;
+    ble_add_device_id (&(device_list_entry->address), device_list_entry->id);
+
+    column_value.integer = device_list_entry->id;
+    db_write_column (&(db_static_tables[DB_DEVICE_ID_TABLE]), DB_WRITE_INSERT, DB_ID_TABLE_COLUMN_ID, &column_value);
+    column_value.text = malloc ((2 * BLE_DEVICE_ADDRESS_LENGTH) + 1);
+    bin_to_string (column_value.text, device_list_entry->address.byte, BLE_DEVICE_ADDRESS_LENGTH);
+    db_write_column (&(db_static_tables[DB_DEVICE_ID_TABLE]), DB_WRITE_INSERT, DB_ID_TABLE_COLUMN_ADDRESS, &column_value);
+    free (column_value.text);
+    column_value.text = device_list_entry->name;
+    db_write_column (&(db_static_tables[DB_DEVICE_ID_TABLE]), DB_WRITE_INSERT, DB_ID_TABLE_COLUMN_NAME, &column_value);
+    db_write_table (&(db_static_tables[DB_DEVICE_ID_TABLE]), DB_WRITE_INSERT);
+  }
+
+  return device_list_entry->id;
+}
+
+void ble_init_device_list (dlist_head_t *device_list)
 {  
   if (db_info == NULL)
   {
@@ -202,7 +746,7 @@ void ble_init_device_list (ble_device_list_entry_t **device_list)
         string_to_bin (address.byte, column_value.text, (2 * BLE_DEVICE_ADDRESS_LENGTH));
         address.type = BLE_ADDR_PUBLIC;
 
-        device_list_entry = ble_find_device (*device_list, &address);
+        device_list_entry = ble_find_device (&address);
 
         if (device_list_entry == NULL)
         {
@@ -211,12 +755,21 @@ void ble_init_device_list (ble_device_list_entry_t **device_list)
           device_list_entry->address      = address;
           device_list_entry->service_list = NULL;
           device_list_entry->status       = BLE_DEVICE_DISCOVER;
+          device_list_entry->attribute_index.entry  = NULL;
+          device_list_entry->attribute_index.length = 0;
+          device_list_entry->attribute_index.size   = 0;
+          device_list_entry->profile_cache            = NULL;
+          device_list_entry->profile_cache_length     = 0;
+          device_list_entry->arena.block              = NULL;
+          device_list_entry->adapter      = -1;
+          device_list_entry->id           = -1;
           device_list_entry->data         = NULL;
   
           db_read_column (&(db_static_tables[DB_DEVICE_LIST_TABLE]), DB_DEVICE_TABLE_COLUMN_NAME, &column_value);
           device_list_entry->name = strdup (column_value.text);
           
-          list_add ((list_entry_t **)(device_list), (list_entry_t *)device_list_entry);
+          dlist_add (device_list, (dlist_entry_t *)device_list_entry);
+          ble_hash_add (device_list_entry);
         }
   
         db_read_column (&(db_static_tables[DB_DEVICE_LIST_TABLE]), DB_DEVICE_TABLE_COLUMN_SERVICE, &column_value);
@@ -224,9 +777,11 @@ void ble_init_device_list (ble_device_list_entry_t **device_list)
         service_list_entry = (ble_service_list_entry_t *)malloc (sizeof (*service_list_entry));
   
         service_list_entry->declaration = (ble_attribute_t *)malloc (sizeof (ble_attribute_t));
+        service_list_entry->profile = NULL;
         service_list_entry->declaration->type = 0;
         service_list_entry->declaration->handle = BLE_INVALID_GATT_HANDLE;
         service_list_entry->declaration->uuid_length = 0;
+        service_list_entry->declaration->uuid = NULL;
         service_list_entry->declaration->data_length = (strlen (column_value.text) + 1)/2;
         service_list_entry->declaration->data = malloc (service_list_entry->declaration->data_length);
         string_to_bin (service_list_entry->declaration->data, column_value.text,
@@ -244,6 +799,9 @@ void ble_init_device_list (ble_device_list_entry_t **device_list)
         service_list_entry->update.time_offset = 0;
         service_list_entry->update.wait = 0;
         service_list_entry->update.interval = (column_value.integer * 60 * 1000);
+        service_list_entry->update.schedule = NULL;
+        service_list_entry->update.index = -1;
+        service_list_entry->update.sequence = -1;
   
         list_add ((list_entry_t **)(&(device_list_entry->service_list)), (list_entry_t *)service_list_entry);
 
@@ -264,20 +822,85 @@ void ble_init_device_list (ble_device_list_entry_t **device_list)
         db_write_table (&(db_static_tables[DB_DEVICE_LIST_TABLE]), DB_WRITE_UPDATE);        
       }        
     }
+
+    if (status == 0)
+    {
+      status = db_create_table (db_info, &(db_static_tables[DB_PROFILE_CACHE_TABLE]));
+    }
+
+    if (status > 0)
+    {
+      while ((status = db_read_table (&(db_static_tables[DB_PROFILE_CACHE_TABLE]))) > 0)
+      {
+        ble_device_address_t address;
+        ble_device_list_entry_t *device_list_entry;
+        db_column_value_t column_value;
+
+        db_read_column (&(db_static_tables[DB_PROFILE_CACHE_TABLE]), DB_PROFILE_TABLE_COLUMN_ADDRESS, &column_value);
+        string_to_bin (address.byte, column_value.text, (2 * BLE_DEVICE_ADDRESS_LENGTH));
+        address.type = BLE_ADDR_PUBLIC;
+
+        device_list_entry = ble_find_device (&address);
+
+        if ((device_list_entry != NULL) && (device_list_entry->profile_cache == NULL))
+        {
+          db_read_column (&(db_static_tables[DB_PROFILE_CACHE_TABLE]), DB_PROFILE_TABLE_COLUMN_PROFILE, &column_value);
+
+          device_list_entry->profile_cache        = malloc (column_value.blob.length);
+          device_list_entry->profile_cache_length = column_value.blob.length;
+          memcpy (device_list_entry->profile_cache, column_value.blob.data, column_value.blob.length);
+        }
+      }
+    }
+
+    if (status == 0)
+    {
+      status = db_create_table (db_info, &(db_static_tables[DB_DEVICE_ID_TABLE]));
+    }
+
+    if (status > 0)
+    {
+      while ((status = db_read_table (&(db_static_tables[DB_DEVICE_ID_TABLE]))) > 0)
+      {
+        ble_device_address_t address;
+        ble_device_list_entry_t *device_list_entry;
+        db_column_value_t column_value;
+        int32 id;
+
+        db_read_column (&(db_static_tables[DB_DEVICE_ID_TABLE]), DB_ID_TABLE_COLUMN_ID, &column_value);
+        id = column_value.integer;
+
+        db_read_column (&(db_static_tables[DB_DEVICE_ID_TABLE]), DB_ID_TABLE_COLUMN_ADDRESS, &column_value);
+        string_to_bin (address.byte, column_value.text, (2 * BLE_DEVICE_ADDRESS_LENGTH));
+        address.type = BLE_ADDR_PUBLIC;
+
+        ble_add_device_id (&address, id);
+
+        device_list_entry = ble_find_device (&address);
+
+        if ((device_list_entry != NULL) && (device_list_entry->id < 0))
+        {
+          device_list_entry->id = ble_find_device_id (&address);
+        }
+      }
+    }
   }
 
-  ble_print_device_list (*device_list);
+  ble_print_device_list ((ble_device_list_entry_t *)(device_list->head));
 }
 
-void ble_update_device_list (ble_device_list_entry_t **device_list)
+void ble_update_device_list (dlist_head_t *device_list)
 {
-  ble_sync_list_entry_t *sync_list_entry = NULL;
+  dlist_head_t sync_list;
+  ble_sync_list_entry_t *sync_list_entry;
 
-  ble_sync_pull (&sync_list_entry, BLE_SYNC_DEVICE);
+  /* Updates held back last time go first, in order */
+  dlist_init (&sync_list);
+  dlist_concat (&sync_list, &ble_deferred_sync_list);
+  ble_sync_pull (&sync_list, BLE_SYNC_DEVICE);
   
-  while (sync_list_entry != NULL)
+  while ((sync_list_entry = (ble_sync_list_entry_t *)(dlist_pop (&sync_list))) != NULL)
   {
-    ble_sync_list_entry_t *sync_list_entry_del = sync_list_entry;
     ble_sync_device_data_t *sync_device_data = (ble_sync_device_data_t *)(sync_list_entry->data);
     ble_device_address_t address;
     ble_device_list_entry_t *device_list_entry;
@@ -289,7 +912,20 @@ void ble_update_device_list (ble_device_list_entry_t **device_list)
     string_to_bin (address.byte, sync_device_data->address, (2 * BLE_DEVICE_ADDRESS_LENGTH));
     address.type = BLE_ADDR_PUBLIC;
     
-    device_list_entry = ble_find_device (*device_list, &address);
+    device_list_entry = ble_find_device (&address);
+
+    /* Adapters run their cycles independently, another one may be using
+       the device right now. Nothing it uses is freed, this & the later
+       updates wait for the next round */
+    if ((device_list_entry != NULL) && ((strcmp (sync_device_data->status, "Delete")) == 0) &&
+        ((ble_check_device_busy (device_list_entry)) > 0))
+    {
+      printf ("BLE Device busy, delete deferred\n");
+      dlist_add (&ble_deferred_sync_list, (dlist_entry_t *)sync_list_entry);
+      dlist_concat (&ble_deferred_sync_list, &sync_list);
+      break;
+    }
+
     if (device_list_entry == NULL)
     {
       device_list_entry = (ble_device_list_entry_t *)malloc (sizeof (*device_list_entry));
@@ -297,10 +933,19 @@ void ble_update_device_list (ble_device_list_entry_t **device_list)
       device_list_entry->address      = address;
       device_list_entry->service_list = NULL;
       device_list_entry->status       = BLE_DEVICE_DISCOVER;
+      device_list_entry->attribute_index.entry  = NULL;
+      device_list_entry->attribute_index.length = 0;
+      device_list_entry->attribute_index.size   = 0;
+      device_list_entry->profile_cache            = NULL;
+      device_list_entry->profile_cache_length     = 0;
+      device_list_entry->arena.block              = NULL;
+      device_list_entry->adapter      = -1;
+      device_list_entry->id           = -1;
       device_list_entry->data         = NULL;
       device_list_entry->name         = strdup (sync_device_data->name);
       
-      list_add ((list_entry_t **)(device_list), (list_entry_t *)device_list_entry);
+      dlist_add (device_list, (dlist_entry_t *)device_list_entry);
+      ble_hash_add (device_list_entry);
     }
 
     string_to_bin (uuid, sync_device_data->service, (strlen (sync_device_data->service)));
@@ -311,9 +956,11 @@ void ble_update_device_list (ble_device_list_entry_t **device_list)
       service_list_entry = (ble_service_list_entry_t *)malloc (sizeof (*service_list_entry));
     
       service_list_entry->declaration               = (ble_attribute_t *)malloc (sizeof (ble_attribute_t));
+      service_list_entry->profile                   = NULL;
       service_list_entry->declaration->type         = 0;
       service_list_entry->declaration->handle       = BLE_INVALID_GATT_HANDLE;
       service_list_entry->declaration->uuid_length  = 0;
+      service_list_entry->declaration->uuid         = NULL;
       service_list_entry->declaration->data_length = (strlen (sync_device_data->service) + 1)/2;
       service_list_entry->declaration->data = malloc (service_list_entry->declaration->data_length);
       string_to_bin (service_list_entry->declaration->data, sync_device_data->service,
@@ -330,23 +977,35 @@ void ble_update_device_list (ble_device_list_entry_t **device_list)
       service_list_entry->update.time_offset = 0;
       service_list_entry->update.wait        = 0;
       service_list_entry->update.interval    = (sync_device_data->interval * 60 * 1000);
+      service_list_entry->update.schedule    = NULL;
+      service_list_entry->update.index       = -1;
+      service_list_entry->update.sequence    = -1;
 
       list_add ((list_entry_t **)(&(device_list_entry->service_list)), (list_entry_t *)service_list_entry);  
       write_type = DB_WRITE_INSERT;
     }
     else if (strcmp (sync_device_data->status, "Delete") == 0)
     {
-      ble_clear_characteristics (service_list_entry->char_list);
-      ble_clear_characteristics (service_list_entry->update.char_list);
-      free (service_list_entry->declaration);
+      /* Characteristics stay in the device arena till it is cleared */
+      service_list_entry->char_list        = NULL;
+      service_list_entry->update.char_list = NULL;
+      ble_unschedule_service (service_list_entry);
 
       list_remove ((list_entry_t **)(&(device_list_entry->service_list)), (list_entry_t *)service_list_entry);
       write_type = DB_WRITE_DELETE;
 
+      /* Remaining services keep receiving values */
+      ble_index_attributes (&(device_list_entry->attribute_index), device_list_entry->service_list);
+
       if (device_list_entry->service_list == NULL)
       {
+        ble_clear_attribute_index (&(device_list_entry->attribute_index));
+        ble_release_device (device_list_entry);
         free (device_list_entry->name);
-        list_remove (((list_entry_t **)device_list), (list_entry_t *)device_list_entry);
+        ble_arena_clear (&(device_list_entry->arena));
+        dlist_remove (device_list, (dlist_entry_t *)device_list_entry);
+        ble_hash_remove (device_list_entry);
+        ble_delete_profile (device_list_entry);
       }
     }
 
@@ -378,6 +1037,7 @@ void ble_update_device_list (ble_device_list_entry_t **device_list)
     }
     else
     {
+      free (service_list_entry->declaration);
       free (service_list_entry);
       if (device_list_entry->service_list == NULL)
       {
@@ -392,10 +1052,9 @@ void ble_update_device_list (ble_device_list_entry_t **device_list)
     free (sync_device_data->service);
     free (sync_device_data->status);
     free (sync_list_entry->data);
-    list_remove ((list_entry_t **)(&sync_list_entry), (list_entry_t *)sync_list_entry_del);
-    free (sync_list_entry_del);
+    free (sync_list_entry);
   }
 
-  ble_print_device_list (*device_list);
+  ble_print_device_list ((ble_device_list_entry_t *)(device_list->head));
 }
 
@@ -2,6 +2,7 @@
 #define __DEVICE_H__
 
 #include "types.h"
+#include "list.h"
 #include "profile.h"
 #include "sync.h"
 
@@ -18,12 +19,17 @@ extern void ble_print_device (ble_device_list_entry_t *device_list_entry);
 
 extern void ble_update_device (ble_device_list_entry_t *device_list_entry);
 
-extern ble_device_list_entry_t * ble_find_device (ble_device_list_entry_t *device_list_entry,
-                                                  ble_device_address_t *address);
+extern ble_device_list_entry_t * ble_find_device (ble_device_address_t *address);
 
-extern void ble_init_device_list (ble_device_list_entry_t **device_list);
+extern void ble_save_profile (ble_device_list_entry_t *device_list_entry);
 
-extern void ble_update_device_list (ble_device_list_entry_t **device_list);
+extern int32 ble_load_profile (ble_device_list_entry_t *device_list_entry);
+
+extern int32 ble_device_id (ble_device_list_entry_t *device_list_entry);
+
+extern void ble_init_device_list (dlist_head_t *device_list);
+
+extern void ble_update_device_list (dlist_head_t *device_list);
 
 #endif
 
@@ -1,5 +1,8 @@
 
+#include <unistd.h>
+#include <stdlib.h>
 #include <stdio.h>
+#include <signal.h>
 
 #include "types.h"
 #include "util.h"
@@ -20,7 +23,8 @@ static ble_state_e ble_scan (ble_message_t *message);
 static ble_state_e ble_profile (ble_message_t *message);
 static ble_state_e ble_data (ble_message_t *message);
 
-static ble_state_e ble_state = BLE_STATE_SCAN;
+/* State machine per adapter */
+static ble_state_e ble_state[BLE_MAX_ADAPTERS];
 
 static ble_state_handler_t ble_state_handler[BLE_STATE_MAX] =
 {
@@ -30,7 +34,16 @@ static ble_state_handler_t ble_state_handler[BLE_STATE_MAX] =
 };
 
 static void *ble_sync_thread = NULL;
+static int32 ble_sync_adapter = -1;
+static int32 ble_current_adapter = 0;
 
+static volatile sig_atomic_t ble_terminate = 0;
+
+
+static void ble_signal (int signal_id)
+{
+  ble_terminate = 1;
+}
 
 static ble_state_e ble_next_state (ble_state_e current_state)
 {
@@ -41,14 +54,14 @@ static ble_state_e ble_next_state (ble_state_e current_state)
   int32 event;
   ble_state_e new_state;
   int32 power_save;
-  timer_info_t *timer_info;
+
+  ble_flush_update ();
 
   sleep_interval = ble_get_sleep ();
   num_scan       = ble_check_scan_list ();
   num_profile    = ble_check_profile_list ();
   num_data       = ble_check_data_list ();
   power_save     = 1;
-  timer_info     = NULL;
 
   if ((num_data > 0) &&
       ((sleep_interval < BLE_MIN_SLEEP_INTERVAL) || ((num_scan == 0) && (num_profile == 0))))
@@ -81,13 +94,13 @@ static ble_state_e ble_next_state (ble_state_e current_state)
   {
     /* TODO: Power save */
     printf ("BLE Power save interval %d (ms)\n", sleep_interval);
-    (void)timer_start (sleep_interval, event, ble_callback_timer, &timer_info);
+    (void)ble_start_timer (sleep_interval, event);
 
   }
   else
   {
     printf ("BLE Wait interval %d (ms)\n", sleep_interval);
-    (void)timer_start (sleep_interval, event, ble_callback_timer, &timer_info);
+    (void)ble_start_timer (sleep_interval, event);
   }
 
   return new_state;
@@ -187,6 +200,12 @@ static ble_state_e ble_profile (ble_message_t *message)
         ble_event_attr_value ((ble_event_attr_value_t *)message);
         break;
       }
+      case ((BLE_CLASS_GAP << 8)|BLE_EVENT_SCAN_RESPONSE):
+      {
+        /* Background scan */
+        ble_event_scan_response ((ble_event_scan_response_t *)message);
+        break;
+      }
       case ((BLE_CLASS_HW << 8)|BLE_EVENT_SOFT_TIMER):
       {
         if (message->data[0] == BLE_TIMER_PROFILE)
@@ -204,6 +223,12 @@ static ble_state_e ble_profile (ble_message_t *message)
                                                                                    : BLE_CONNECT_DATA_FAILED;
           
           (void)ble_event_connection_status ((ble_event_connection_status_t *)message);
+
+          /* No disconnect follows a failed set up, move on */
+          if (message->data[0] == BLE_TIMER_CONNECT_SETUP)
+          {
+            ble_next_profile ();
+          }
         }
         else if (message->data[0] == BLE_TIMER_PROFILE_STOP)
         {
@@ -245,6 +270,9 @@ static ble_state_e ble_data (ble_message_t *message)
         {
           ble_update_data ();
         }
+
+        /* Set up done, connect the next device */
+        ble_connect_data ();
         
         break;
       }
@@ -265,6 +293,12 @@ static ble_state_e ble_data (ble_message_t *message)
         ble_event_attr_value ((ble_event_attr_value_t *)message);
         break;
       }      
+      case ((BLE_CLASS_GAP << 8)|BLE_EVENT_SCAN_RESPONSE):
+      {
+        /* Background scan */
+        ble_event_scan_response ((ble_event_scan_response_t *)message);
+        break;
+      }
       case ((BLE_CLASS_HW << 8)|BLE_EVENT_SOFT_TIMER):
       {
         if (message->data[0] == BLE_TIMER_DATA)
@@ -277,6 +311,7 @@ static ble_state_e ble_data (ble_message_t *message)
           {
             os_create_thread (ble_sync, OS_THREAD_PRIORITY_NORMAL,
                               (BLE_SYNC_TIMEOUT/1000), &ble_sync_thread);
+            ble_sync_adapter = ble_current_adapter;
           }
         }
         else if ((message->data[0] == BLE_TIMER_CONNECT_SETUP) ||
@@ -288,11 +323,21 @@ static ble_state_e ble_data (ble_message_t *message)
                                                                                    : BLE_CONNECT_DATA_FAILED;
           
           ble_event_connection_status ((ble_event_connection_status_t *)message);
+
+          /* No disconnect follows a failed set up, move on */
+          if (message->data[0] == BLE_TIMER_CONNECT_SETUP)
+          {
+            ble_next_data ();
+          }
         }
         else if (message->data[0] == BLE_TIMER_DATA_STOP)
         {
-          os_destroy_thread (ble_sync_thread);
-          ble_sync_thread = NULL;
+          /* Sync thread belongs to the adapter that started it */
+          if ((ble_sync_thread != NULL) && (ble_sync_adapter == ble_current_adapter))
+          {
+            os_destroy_thread (ble_sync_thread);
+            ble_sync_thread = NULL;
+          }
 
           new_state = ble_next_state (BLE_STATE_DATA);
         }
@@ -320,40 +365,119 @@ static ble_state_e ble_data (ble_message_t *message)
 
 void master_loop (void)
 {
-  timer_info_t *timer_info = NULL;
+  int32 adapter;
   
-  (void)timer_start (BLE_MIN_TIMER_DURATION, BLE_TIMER_SCAN,
-                     ble_callback_timer, &timer_info);
+  for (adapter = 0; adapter < (ble_get_adapters ()); adapter++)
+  {
+    ble_state[adapter] = BLE_STATE_SCAN;
+
+    ble_set_adapter (adapter);
+    (void)ble_start_timer (BLE_MIN_TIMER_DURATION, BLE_TIMER_SCAN);
+  }
 
   os_create_thread (ble_sync, OS_THREAD_PRIORITY_NORMAL,
                     ((4 * BLE_SYNC_TIMEOUT)/1000), &ble_sync_thread);
+  ble_sync_adapter = 0;
 
-  while (1)
+  while (!ble_terminate)
   {
     int pending;
+    int32 active = 0;
     ble_message_t message;
 
-    if ((ble_check_message_list ()) > 0)
+    /* Service each adapter's queue in turn */
+    for (adapter = 0; adapter < (ble_get_adapters ()); adapter++)
     {
-      do
+      ble_set_adapter (adapter);
+      ble_current_adapter = adapter;
+
+      if ((ble_check_message_list ()) > 0)
       {
-        pending = ble_receive_message (&message);
-        ble_state = ble_state_handler[ble_state](&message);
-      } while (pending > 0);
+        do
+        {
+          pending = ble_receive_message (&message);
+
+          /* Streaming connections are served in any state */
+          if ((ble_event_stream (&message)) <= 0)
+          {
+            ble_state[adapter] = ble_state_handler[ble_state[adapter]](&message);
+          }
+        } while (pending > 0);
+
+        ble_update_scan ();
+        active = 1;
+      }
+    }
+
+    ble_update_stream ();
+
+    if (!active)
+    {
+      /* Batched writes go out once full or old enough */
+      ble_end_update ();
+
+      /* Sleep until serial data, timer expiry or wakeup */
+      (void)event_wait (-1);
     }
   }
 }
 
 int main (int argc, char * argv[])
 {
+  int option;
+  int32 num_nodes = 0;
+  struct sigaction signal_action;
+
+  while ((option = getopt (argc, argv, "d:s:ph")) != -1)
+  {
+    switch (option)
+    {
+      case 'd':
+      {
+        /* Use given serial device(s) instead of USB discovery */
+        if (num_nodes < BLE_MAX_ADAPTERS)
+        {
+          serial_set_node (num_nodes++, optarg);
+        }
+        break;
+      }
+      case 's':
+      {
+        /* Devices per adapter kept connected for streaming */
+        ble_set_streams (atoi (optarg));
+        break;
+      }
+      case 'p':
+      {
+        /* Passive scan whenever the adapter is free */
+        ble_set_background_scan (1);
+        break;
+      }
+      default:
+      {
+        printf ("Usage: %s [-d serial device]... [-s streams] [-p]\n", argv[0]);
+        return 1;
+      }
+    }
+  }
+
+  /* Leave the loop on termination so that queued writes get stored */
+  signal_action.sa_handler = ble_signal;
+  signal_action.sa_flags   = 0;
+  sigemptyset (&signal_action.sa_mask);
+  sigaction (SIGINT, &signal_action, NULL);
+  sigaction (SIGTERM, &signal_action, NULL);
+
   os_init ();
   
-  if ((ble_init ()) > 0)
+  if (((event_init ()) > 0) && ((timer_init ()) > 0) && ((ble_init ()) > 0))
   {
     master_loop ();
   }
 
   ble_deinit ();
+  timer_deinit ();
+  event_deinit ();
 
   printf ("\n");
 
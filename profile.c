@@ -7,8 +7,16 @@
 #include "list.h"
 #include "util.h"
 #include "profile.h"
+#include "device.h"
 #include "temperature.h"
 
+static const ble_profile_t *profile_hash_table[BLE_PROFILE_HASH_SIZE];
+
+/* Readings table of the profile in the same slot */
+static db_table_list_entry_t *profile_table[BLE_PROFILE_HASH_SIZE];
+
+static db_info_t *db_info = NULL;
+
 
 void ble_update_char_type (ble_char_list_entry_t * char_list_entry, uint8 type)
 {
@@ -130,56 +138,270 @@ ble_attribute_t * ble_find_attribute (ble_service_list_entry_t *service_list_ent
   return attribute;
 }
 
-void ble_clear_characteristics (ble_char_list_entry_t *char_list_entry)
+static void ble_index_attribute (ble_attribute_index_t *attribute_index, ble_attribute_t *attribute)
+{
+  int32 index;
+
+  if (attribute == NULL)
+  {
+    return;
+  }
+
+  if (attribute_index->length == attribute_index->size)
+  {
+    attribute_index->size  = (attribute_index->size > 0) ? (2 * attribute_index->size) : 16;
+    attribute_index->entry = realloc (attribute_index->entry,
+                                      (attribute_index->size * sizeof (ble_attribute_index_entry_t)));
+  }
+
+  /* Handles arrive mostly in order, insert from the back */
+  index = attribute_index->length;
+  while ((index > 0) && (attribute_index->entry[index - 1].handle > attribute->handle))
+  {
+    attribute_index->entry[index] = attribute_index->entry[index - 1];
+    index--;
+  }
+
+  attribute_index->entry[index].handle    = attribute->handle;
+  attribute_index->entry[index].attribute = attribute;
+  attribute_index->length++;
+}
+
+static void ble_index_characteristics (ble_attribute_index_t *attribute_index,
+                                       ble_char_list_entry_t *char_list_entry)
 {
   while (char_list_entry != NULL)
   {
-    ble_char_list_entry_t *char_list_entry_del = char_list_entry;
-    
-    if (char_list_entry->declaration != NULL)
+    ble_index_attribute (attribute_index, char_list_entry->declaration);
+    ble_index_attribute (attribute_index, char_list_entry->value);
+    ble_index_attribute (attribute_index, char_list_entry->description);
+    ble_index_attribute (attribute_index, char_list_entry->client_config);
+    ble_index_attribute (attribute_index, char_list_entry->format);
+
+    char_list_entry = char_list_entry->next;
+  }
+}
+
+/* Index covers both char_list & update.char_list so moving
+   characteristics between them leaves it valid */
+void ble_index_attributes (ble_attribute_index_t *attribute_index,
+                           ble_service_list_entry_t *service_list_entry)
+{
+  attribute_index->length = 0;
+
+  while (service_list_entry != NULL)
+  {
+    ble_index_characteristics (attribute_index, service_list_entry->char_list);
+    ble_index_characteristics (attribute_index, service_list_entry->update.char_list);
+
+    service_list_entry = service_list_entry->next;
+  }
+}
+
+ble_attribute_t * ble_lookup_attribute (ble_attribute_index_t *attribute_index,
+                                        uint16 handle)
+{
+  int32 low  = 0;
+  int32 high = attribute_index->length - 1;
+
+  while (low <= high)
+  {
+    int32 middle = (low + high)/2;
+
+    if (attribute_index->entry[middle].handle == handle)
     {
-      if (char_list_entry->declaration->data != NULL)
-      {
-        free (char_list_entry->declaration->data);
-      }
-      free (char_list_entry->declaration);
+      return attribute_index->entry[middle].attribute;
     }
-    if (char_list_entry->value != NULL)
+    else if (attribute_index->entry[middle].handle < handle)
     {
-      if (char_list_entry->value->data != NULL)
-      {
-        free (char_list_entry->value->data);
-      }
-      free (char_list_entry->value);
+      low = middle + 1;
     }
-    if (char_list_entry->description != NULL)
+    else
     {
-      if (char_list_entry->description->data != NULL)
-      {
-        free (char_list_entry->description->data);
-      }
-      free (char_list_entry->description);
+      high = middle - 1;
     }
-    if (char_list_entry->client_config != NULL)
+  }
+
+  return NULL;
+}
+
+void ble_clear_attribute_index (ble_attribute_index_t *attribute_index)
+{
+  free (attribute_index->entry);
+  attribute_index->entry  = NULL;
+  attribute_index->length = 0;
+  attribute_index->size   = 0;
+}
+
+void * ble_arena_alloc (ble_arena_t *arena, uint32 size)
+{
+  struct ble_arena_block *block = arena->block;
+  void *data;
+
+  /* Keep every allocation pointer aligned */
+  size = (size + (sizeof (void *) - 1)) & ~(sizeof (void *) - 1);
+
+  if ((block == NULL) || ((block->used + size) > block->size))
+  {
+    uint32 block_size = (size > BLE_ARENA_BLOCK_SIZE) ? size : BLE_ARENA_BLOCK_SIZE;
+
+    block        = (struct ble_arena_block *)malloc (sizeof (*block) + block_size);
+    block->next  = arena->block;
+    block->used  = 0;
+    block->size  = block_size;
+    arena->block = block;
+  }
+
+  data         = block->data + block->used;
+  block->used += size;
+
+  return data;
+}
+
+void ble_arena_clear (ble_arena_t *arena)
+{
+  while (arena->block != NULL)
+  {
+    struct ble_arena_block *block = arena->block;
+
+    arena->block = block->next;
+    free (block);
+  }
+}
+
+/* Interned uuids, shared by all devices & never freed */
+struct ble_uuid_list_entry
+{
+  struct ble_uuid_list_entry *next;
+  uint8                       uuid_length;
+  uint8                       uuid[BLE_MAX_UUID_LENGTH];
+};
+
+typedef struct ble_uuid_list_entry ble_uuid_list_entry_t;
+
+LIST_HEAD_INIT (ble_uuid_list_entry_t, ble_uuid_list);
+
+const uint8 * ble_intern_uuid (uint8 *uuid, uint8 uuid_length)
+{
+  ble_uuid_list_entry_t *uuid_list_entry = ble_uuid_list;
+
+  if (uuid_length > BLE_MAX_UUID_LENGTH)
+  {
+    uuid_length = BLE_MAX_UUID_LENGTH;
+  }
+
+  while (uuid_list_entry != NULL)
+  {
+    if ((uuid_list_entry->uuid_length == uuid_length) &&
+        ((memcmp (uuid_list_entry->uuid, uuid, uuid_length)) == 0))
     {
-      if (char_list_entry->client_config->data != NULL)
-      {
-        free (char_list_entry->client_config->data);
-      }
-      free (char_list_entry->client_config);
+      break;
     }
-    if (char_list_entry->format != NULL)
+
+    uuid_list_entry = uuid_list_entry->next;
+  }
+
+  if (uuid_list_entry == NULL)
+  {
+    uuid_list_entry = (ble_uuid_list_entry_t *)malloc (sizeof (*uuid_list_entry));
+
+    uuid_list_entry->uuid_length = uuid_length;
+    memcpy (uuid_list_entry->uuid, uuid, uuid_length);
+
+    uuid_list_entry->next = ble_uuid_list;
+    ble_uuid_list         = uuid_list_entry;
+  }
+
+  return uuid_list_entry->uuid;
+}
+
+ble_attribute_t * ble_new_attribute (ble_arena_t *arena, uint8 type, uint16 handle,
+                                     uint8 *uuid, uint8 uuid_length)
+{
+  ble_attribute_t *attribute = (ble_attribute_t *)ble_arena_alloc (arena, sizeof (ble_attribute_t));
+
+  attribute->type        = type;
+  attribute->handle      = handle;
+  attribute->uuid_length = uuid_length;
+  attribute->uuid        = ble_intern_uuid (uuid, uuid_length);
+  attribute->data_length = 0;
+  attribute->data        = NULL;
+  attribute->buffer_size = BLE_ATTR_INLINE_LENGTH;
+  attribute->buffer      = attribute->inline_data;
+
+  return attribute;
+}
+
+ble_char_list_entry_t * ble_new_characteristics (ble_arena_t *arena)
+{
+  ble_char_list_entry_t *char_list_entry
+    = (ble_char_list_entry_t *)ble_arena_alloc (arena, sizeof (ble_char_list_entry_t));
+
+  char_list_entry->next          = NULL;
+  char_list_entry->declaration   = NULL;
+  char_list_entry->value         = NULL;
+  char_list_entry->description   = NULL;
+  char_list_entry->client_config = NULL;
+  char_list_entry->format        = NULL;
+
+  return char_list_entry;
+}
+
+/* Grow attribute buffer to at least length, keeping current data. Old
+   buffer stays in the arena, values only grow so this settles quickly */
+static void ble_size_attribute (ble_arena_t *arena, ble_attribute_t *attribute, uint8 length)
+{
+  if (length > attribute->buffer_size)
+  {
+    uint8 *buffer = (uint8 *)ble_arena_alloc (arena, length);
+
+    if (attribute->data != NULL)
     {
-      if (char_list_entry->format->data != NULL)
-      {
-        free (char_list_entry->format->data);
-      }
-      free (char_list_entry->format);
+      memcpy (buffer, attribute->data, attribute->data_length);
     }
-    
-    list_remove ((list_entry_t **)(&(char_list_entry)), (list_entry_t *)char_list_entry_del);
-    free (char_list_entry_del);
-  }  
+
+    attribute->buffer      = buffer;
+    attribute->buffer_size = length;
+  }
+}
+
+void ble_set_attribute_data (ble_arena_t *arena, ble_attribute_t *attribute,
+                             uint8 *data, uint8 length)
+{
+  attribute->data = NULL;
+  ble_size_attribute (arena, attribute, length);
+
+  memcpy (attribute->buffer, data, length);
+  attribute->data        = attribute->buffer;
+  attribute->data_length = length;
+}
+
+void ble_append_attribute_data (ble_arena_t *arena, ble_attribute_t *attribute,
+                                uint8 *data, uint8 length)
+{
+  if (attribute->data == NULL)
+  {
+    ble_set_attribute_data (arena, attribute, data, length);
+  }
+  else
+  {
+    if ((attribute->data_length + length) > 0xff)
+    {
+      length = 0xff - attribute->data_length;
+    }
+
+    ble_size_attribute (arena, attribute, (attribute->data_length + length));
+
+    memcpy ((attribute->buffer + attribute->data_length), data, length);
+    attribute->data         = attribute->buffer;
+    attribute->data_length += length;
+  }
+}
+
+void ble_clear_attribute_data (ble_attribute_t *attribute)
+{
+  attribute->data        = NULL;
+  attribute->data_length = 0;
 }
 
 void ble_print_service (ble_service_list_entry_t *service_list_entry)
@@ -187,7 +409,8 @@ void ble_print_service (ble_service_list_entry_t *service_list_entry)
   while (service_list_entry != NULL)
   {
     int32 i;
-    uint16 uuid = BLE_PACK_GATT_UUID (service_list_entry->declaration->uuid);
+    uint16 uuid = (service_list_entry->declaration->uuid != NULL) ? BLE_PACK_GATT_UUID (service_list_entry->declaration->uuid)
+                                                                  : BLE_GATT_PRI_SERVICE;
     ble_char_list_entry_t *char_list_entry = service_list_entry->char_list;
       
     printf ("Service -- %s\n", ((uuid == BLE_GATT_PRI_SERVICE) ? "primary" : "secondary"));
@@ -263,28 +486,262 @@ void ble_print_service (ble_service_list_entry_t *service_list_entry)
   }
 }
 
+static uint32 ble_hash_uuid (const uint8 *uuid, uint8 uuid_length)
+{
+  uint32 hash = 2166136261U;
+  uint8 index;
+
+  for (index = 0; index < uuid_length; index++)
+  {
+    hash ^= uuid[index];
+    hash *= 16777619U;
+  }
+
+  return hash;
+}
+
+int32 ble_register_profile (const ble_profile_t *profile)
+{
+  uint32 mask = BLE_PROFILE_HASH_SIZE - 1;
+  uint32 slot = ble_hash_uuid (profile->uuid, profile->uuid_length) & mask;
+  uint32 count;
+
+  for (count = 0; count < BLE_PROFILE_HASH_SIZE; count++)
+  {
+    const ble_profile_t *hash_entry = profile_hash_table[slot];
+    
+    if (hash_entry == NULL)
+    {
+      profile_hash_table[slot] = profile;
+      return 1;
+    }
+    else if ((hash_entry->uuid_length == profile->uuid_length) &&
+             ((memcmp (hash_entry->uuid, profile->uuid, profile->uuid_length)) == 0))
+    {
+      printf ("BLE Profile %s already registered\n", hash_entry->name);
+      return -1;
+    }
+
+    slot = (slot + 1) & mask;
+  }
+
+  printf ("BLE Profile registry full, %s not added\n", profile->name);
+  return -1;
+}
+
+const ble_profile_t * ble_lookup_profile (uint8 *uuid, uint8 uuid_length)
+{
+  uint32 mask = BLE_PROFILE_HASH_SIZE - 1;
+  uint32 slot = ble_hash_uuid (uuid, uuid_length) & mask;
+  uint32 count;
+
+  for (count = 0; (count < BLE_PROFILE_HASH_SIZE) && (profile_hash_table[slot] != NULL); count++)
+  {
+    const ble_profile_t *hash_entry = profile_hash_table[slot];
+
+    if ((hash_entry->uuid_length == uuid_length) &&
+        ((memcmp (hash_entry->uuid, uuid, uuid_length)) == 0))
+    {
+      return hash_entry;
+    }
+
+    slot = (slot + 1) & mask;
+  }
+
+  return NULL;
+}
+
+/* Supported profiles */
+void ble_init_profile (void)
+{
+  (void)ble_register_profile (&ble_temperature_profile);
+
+  /* Samples & device rows share the connection, writes are batched
+     & done by the storage thread once started */
+  if ((db_open ("gateway.db", &db_info)) > 0)
+  {
+    db_set_batch (db_info, DB_BATCH_ROWS, DB_BATCH_TIMEOUT);
+  }
+}
+
+/* Waits for queued writes to be committed */
+void ble_deinit_profile (void)
+{
+  if (db_info != NULL)
+  {
+    (void)db_stop_writer (db_info);
+  }
+}
+
+/* Profile of a service, looked up once & kept in the service */
+static const ble_profile_t * ble_service_profile (ble_service_list_entry_t *service_list_entry)
+{
+  if (service_list_entry->profile == NULL)
+  {
+    service_list_entry->profile = ble_lookup_profile (service_list_entry->declaration->data,
+                                                      service_list_entry->declaration->data_length);
+  }
+
+  return service_list_entry->profile;
+}
+
 void ble_update_service (ble_service_list_entry_t *service_list_entry,
                          ble_device_list_entry_t *device_list_entry)
 {
   while (service_list_entry != NULL)
   {
+    /* Only initialised services have an update list */
     if ((service_list_entry->update.char_list != NULL) &&
         (service_list_entry->update.wait <= 0))
     {
-      uint8 uuid_length;
-      uint16 uuid;
-  
-      uuid_length = service_list_entry->declaration->data_length;
-      uuid        = BLE_PACK_GATT_UUID (service_list_entry->declaration->data);
-  
-      if ((uuid_length == BLE_GATT_UUID_LENGTH) && (uuid == BLE_TEMPERATURE_SERVICE_UUID))
+      service_list_entry->profile->update (service_list_entry, device_list_entry);
+    }
+
+    service_list_entry = service_list_entry->next;
+  }
+}
+
+/* Updates in between are stored in one transaction */
+void ble_begin_update (void)
+{
+  if (db_info != NULL)
+  {
+    (void)db_begin (db_info);
+  }
+}
+
+void ble_end_update (void)
+{
+  if (db_info != NULL)
+  {
+    (void)db_commit (db_info);
+  }
+}
+
+/* Commit the batch now, on state change */
+void ble_flush_update (void)
+{
+  if (db_info != NULL)
+  {
+    (void)db_flush (db_info);
+  }
+}
+
+/* Whether the service handler uses a characteristics, only those
+   get their descriptors discovered */
+int32 ble_check_characteristics (ble_service_list_entry_t *service_list_entry,
+                                 uint8 *uuid, uint8 uuid_length)
+{
+  int32 found = 0;
+  const ble_profile_t *profile = ble_service_profile (service_list_entry);
+
+  if ((profile != NULL) && (uuid_length == BLE_GATT_UUID_LENGTH))
+  {
+    uint16 char_uuid = BLE_PACK_GATT_UUID (uuid);
+    int32 index;
+
+    for (index = 0; (index < profile->num_chars) && (found == 0); index++)
+    {
+      found = (profile->char_uuid[index] == char_uuid);
+    }
+  }
+
+  return found;
+}
+
+/* Readings of all devices of a profile go in one table named after the
+   profile, keyed by device id & time. Tables are created by
+   ble_init_storage (), here a device only looks its table up */
+static void ble_init_table (const ble_profile_t *profile, ble_device_list_entry_t *device_list_entry)
+{
+  uint32 slot;
+
+  if (device_list_entry->data != NULL)
+  {
+    return;
+  }
+
+  for (slot = 0; (slot < BLE_PROFILE_HASH_SIZE) && (profile_hash_table[slot] != profile); slot++);
+        
+  if ((slot < BLE_PROFILE_HASH_SIZE) && (profile_table[slot] != NULL))
+  {
+    (void)ble_device_id (device_list_entry);
+    device_list_entry->data = profile_table[slot];
+  }
+}
+
+/* Schema changes need the connection to themselves, so they are all
+   done before the storage thread is started: the readings table of each
+   profile is created & legacy tables, named after known devices, are
+   moved in. The BLE loop only queues rows after this */
+void ble_init_storage (ble_device_list_entry_t *device_list_entry)
+{
+  uint32 slot;
+
+  if (db_info == NULL)
+  {
+    return;
+  }
+
+  for (slot = 0; slot < BLE_PROFILE_HASH_SIZE; slot++)
+  {
+    const ble_profile_t *profile = profile_hash_table[slot];
+
+    if ((profile != NULL) && (profile->num_columns > 0) && (profile_table[slot] == NULL))
+    {
+      db_table_list_entry_t *table_list_entry;
+
+      table_list_entry = (db_table_list_entry_t *)calloc (1, sizeof (*table_list_entry));
+      
+      table_list_entry->title       = strdup (profile->name);
+      table_list_entry->num_columns = profile->num_columns;
+      table_list_entry->column      = profile->column;
+
+      if ((db_create_table (db_info, table_list_entry)) > 0)
       {
-        ble_update_temperature (service_list_entry, device_list_entry);
+        profile_table[slot] = table_list_entry;
+      }
+      else
+      {
+        free (table_list_entry->title);
+        free (table_list_entry);
       }
     }
+  }
 
-    service_list_entry = service_list_entry->next;
+  while (device_list_entry != NULL)
+  {
+    ble_service_list_entry_t *service_list_entry = device_list_entry->service_list;
+
+    while (service_list_entry != NULL)
+    {
+      const ble_profile_t *profile = ble_service_profile (service_list_entry);
+
+      if ((profile != NULL) && (profile->num_columns > 0))
+      {
+        uint32 index;
+
+        ble_init_table (profile, device_list_entry);
+
+        /* First index key is the device id */
+        for (index = 0; (index < profile->num_columns) &&
+                        (!(profile->column[index].flags & DB_COLUMN_FLAG_INDEX_KEY)); index++);
+
+        if ((device_list_entry->data != NULL) && (index < profile->num_columns))
+        {
+          (void)db_merge_table (db_info, device_list_entry->name,
+                                (db_table_list_entry_t *)(device_list_entry->data),
+                                index, device_list_entry->id);
+        }
+      }
+
+      service_list_entry = service_list_entry->next;
+    }
+
+    device_list_entry = device_list_entry->next;
   }
+
+  (void)db_start_writer (db_info);
 }
 
 int32 ble_init_service (ble_service_list_entry_t *service_list_entry,
@@ -294,15 +751,18 @@ int32 ble_init_service (ble_service_list_entry_t *service_list_entry,
   
   while (service_list_entry != NULL)
   {
-    uint8 uuid_length;
-    uint16 uuid;
-
-    uuid_length = service_list_entry->declaration->data_length;
-    uuid        = BLE_PACK_GATT_UUID (service_list_entry->declaration->data);
+    const ble_profile_t *profile = ble_service_profile (service_list_entry);
 
-    if ((uuid_length == BLE_GATT_UUID_LENGTH) && (uuid == BLE_TEMPERATURE_SERVICE_UUID))
+    if (profile != NULL)
     {
-      status += (ble_init_temperature (service_list_entry, device_list_entry));
+      int32 found = profile->init (service_list_entry, device_list_entry);
+
+      if ((found > 0) && (profile->num_columns > 0))
+      {
+        ble_init_table (profile, device_list_entry);
+      }
+
+      status += found;
     }
 
     service_list_entry = service_list_entry->next;
@@ -311,6 +771,106 @@ int32 ble_init_service (ble_service_list_entry_t *service_list_entry,
   return status;  
 }
 
+/* Whether an advertised reading is new. With a sequence number (>= 0)
+   any change is new, otherwise one reading per update interval */
+int32 ble_check_advertisement (ble_service_list_entry_t *service_list_entry,
+                               int32 sequence)
+{
+  int32 found = 0;
+  int32 current_time = clock_get_count ();
+
+  if (sequence >= 0)
+  {
+    found = (sequence != service_list_entry->update.sequence);
+    service_list_entry->update.sequence = sequence;
+  }
+  else if ((service_list_entry->update.init) ||
+           (((int32)(current_time - service_list_entry->update.time)) >= 0))
+  {
+    found = 1;
+  }
+
+  if (found)
+  {
+    service_list_entry->update.init = 0;
+    service_list_entry->update.time = current_time + service_list_entry->update.interval;
+  }
+
+  return found;
+}
+
+static int32 ble_advertise_profile (ble_service_list_entry_t *service_list_entry,
+                                    ble_device_list_entry_t *device_list_entry,
+                                    uint8 *data, uint8 length)
+{
+  int32 status = -1;
+  const ble_profile_t *profile = service_list_entry->profile;
+
+  if ((device_list_entry->data == NULL) && (profile->num_columns > 0))
+  {
+    ble_init_table (profile, device_list_entry);
+  }
+
+  if ((device_list_entry->data != NULL) || (profile->num_columns == 0))
+  {
+    status = profile->advertise (service_list_entry, device_list_entry, data, length);
+  }
+
+  return status;
+}
+
+/* Service data of a listed service, taken by its profile decoder */
+int32 ble_advertise_service (ble_device_list_entry_t *device_list_entry,
+                             uint8 *uuid, uint8 uuid_length, uint8 *data, uint8 length)
+{
+  int32 status = -1;
+  ble_service_list_entry_t *service_list_entry = device_list_entry->service_list;
+
+  while (service_list_entry != NULL)
+  {
+    if ((service_list_entry->declaration->data_length == uuid_length) &&
+        ((memcmp (uuid, service_list_entry->declaration->data, uuid_length)) == 0))
+    {
+      const ble_profile_t *profile = ble_service_profile (service_list_entry);
+
+      if ((profile != NULL) && (profile->advertise != NULL))
+      {
+        status = ble_advertise_profile (service_list_entry, device_list_entry, data, length);
+      }
+
+      break;
+    }
+
+    service_list_entry = service_list_entry->next;
+  }
+
+  return status;
+}
+
+/* Manufacturer data, taken by the first listed service whose profile
+   decodes data of that company */
+int32 ble_advertise_company (ble_device_list_entry_t *device_list_entry,
+                             uint16 company, uint8 *data, uint8 length)
+{
+  int32 status = -1;
+  ble_service_list_entry_t *service_list_entry = device_list_entry->service_list;
+
+  while ((service_list_entry != NULL) && (status <= 0))
+  {
+    const ble_profile_t *profile = ble_service_profile (service_list_entry);
+
+    if ((profile != NULL) && (profile->advertise != NULL) &&
+        (profile->company != BLE_NO_COMPANY_ID) && (profile->company == company))
+    {
+      status = ble_advertise_profile (service_list_entry, device_list_entry, data, length);
+    }
+
+    service_list_entry = service_list_entry->next;
+  }
+
+  return status;
+}
+
 ble_service_list_entry_t * ble_find_service (ble_service_list_entry_t *service_list_entry,
                                              uint8 *uuid, uint8 uuid_length)
 {
@@ -327,15 +887,113 @@ ble_service_list_entry_t * ble_find_service (ble_service_list_entry_t *service_l
   return service_list_entry;  
 }
 
-void ble_clear_service (ble_service_list_entry_t *service_list_entry)
+/* Drop discovered characteristics of all services, which frees the
+   device arena in one go */
+void ble_clear_service (ble_device_list_entry_t *device_list_entry)
 {
+  ble_service_list_entry_t *service_list_entry = device_list_entry->service_list;
+
   while (service_list_entry != NULL)
   {
-    ble_clear_characteristics (service_list_entry->char_list);
-    service_list_entry->char_list = NULL;
-    ble_clear_characteristics (service_list_entry->update.char_list);
+    service_list_entry->char_list        = NULL;
     service_list_entry->update.char_list = NULL;
+    ble_unschedule_service (service_list_entry);
     service_list_entry = service_list_entry->next;
   }
+
+  ble_clear_attribute_index (&(device_list_entry->attribute_index));
+  ble_arena_clear (&(device_list_entry->arena));
+}
+
+static void ble_schedule_set (ble_schedule_t *schedule, int32 index, ble_schedule_entry_t *schedule_entry)
+{
+  schedule->entry[index]                = *schedule_entry;
+  schedule_entry->service->update.index = index;
+}
+
+static int32 ble_schedule_before (ble_schedule_entry_t *entry, ble_schedule_entry_t *other)
+{
+  return ((entry->service->update.time - other->service->update.time) < 0);
+}
+
+/* Restore heap order around index after its time changed */
+static void ble_schedule_fix (ble_schedule_t *schedule, int32 index)
+{
+  ble_schedule_entry_t schedule_entry = schedule->entry[index];
+
+  while ((index > 0) &&
+         (ble_schedule_before (&schedule_entry, &(schedule->entry[(index - 1)/2]))))
+  {
+    ble_schedule_set (schedule, index, &(schedule->entry[(index - 1)/2]));
+    index = (index - 1)/2;
+  }
+
+  while (((2 * index) + 1) < schedule->length)
+  {
+    int32 child = (2 * index) + 1;
+
+    if (((child + 1) < schedule->length) &&
+        (ble_schedule_before (&(schedule->entry[child + 1]), &(schedule->entry[child]))))
+    {
+      child++;
+    }
+
+    if (!(ble_schedule_before (&(schedule->entry[child]), &schedule_entry)))
+    {
+      break;
+    }
+
+    ble_schedule_set (schedule, index, &(schedule->entry[child]));
+    index = child;
+  }
+
+  ble_schedule_set (schedule, index, &schedule_entry);
+}
+
+void ble_schedule_service (ble_schedule_t *schedule, ble_service_list_entry_t *service_list_entry,
+                           ble_device_list_entry_t *device_list_entry)
+{
+  if (service_list_entry->update.schedule != schedule)
+  {
+    ble_schedule_entry_t schedule_entry;
+
+    ble_unschedule_service (service_list_entry);
+
+    if (schedule->length == schedule->size)
+    {
+      schedule->size  = (schedule->size > 0) ? (2 * schedule->size) : 16;
+      schedule->entry = (ble_schedule_entry_t *)realloc (schedule->entry,
+                                                          (schedule->size * (sizeof (*(schedule->entry)))));
+    }
+
+    schedule_entry.service = service_list_entry;
+    schedule_entry.device  = device_list_entry;
+
+    service_list_entry->update.schedule = schedule;
+    ble_schedule_set (schedule, schedule->length++, &schedule_entry);
+  }
+
+  ble_schedule_fix (schedule, service_list_entry->update.index);
+}
+
+void ble_unschedule_service (ble_service_list_entry_t *service_list_entry)
+{
+  ble_schedule_t *schedule = service_list_entry->update.schedule;
+
+  if (schedule != NULL)
+  {
+    int32 index = service_list_entry->update.index;
+
+    /* Last entry fills the hole */
+    schedule->length--;
+    if (index < schedule->length)
+    {
+      ble_schedule_set (schedule, index, &(schedule->entry[schedule->length]));
+      ble_schedule_fix (schedule, index);
+    }
+
+    service_list_entry->update.schedule = NULL;
+    service_list_entry->update.index    = -1;
+  }
 }
 
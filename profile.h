@@ -2,6 +2,7 @@
 #define __PROFILE_H__
 
 #include "types.h"
+#include "util.h"
 
 #define BLE_PACK_GATT_UUID(byte)  (((byte)[0] << 8) | (byte)[1])
 #define BLE_UNPACK_GATT_UUID(uuid, byte)  { (byte)[1] = ((uuid) & 0xff); (byte)[0] = (((uuid) & 0xff00) >> 8); } 
@@ -68,16 +69,42 @@ typedef struct PACKED
   uint16 description;
 } ble_char_format_t;
 
+/* Values up to this length live in the attribute itself */
+#define BLE_ATTR_INLINE_LENGTH  (8)
+
+/* uuid is interned, see ble_intern_uuid (). data is NULL until the
+   value is known and then points to buffer, which is either inline or
+   taken from the device arena & reused */
 typedef struct
 {
-  uint8   type;
-  uint16  handle;
-  uint8   uuid_length;
-  uint8   uuid[BLE_MAX_UUID_LENGTH];
-  uint8   data_length;
-  uint8  *data;  
+  uint8         type;
+  uint16        handle;
+  uint8         uuid_length;
+  const uint8  *uuid;
+  uint8         data_length;
+  uint8        *data;
+  uint8         buffer_size;
+  uint8        *buffer;
+  uint8         inline_data[BLE_ATTR_INLINE_LENGTH];
 } ble_attribute_t;
 
+/* Device GATT store, characteristics & attributes are carved out of
+   arena blocks which are freed together */
+#define BLE_ARENA_BLOCK_SIZE  (512)
+
+struct ble_arena_block
+{
+  struct ble_arena_block *next;
+  uint32                  used;
+  uint32                  size;
+  uint8                   data[];
+};
+
+typedef struct
+{
+  struct ble_arena_block *block;
+} ble_arena_t;
+
 struct ble_char_list_entry
 {
   struct ble_char_list_entry *next;
@@ -90,6 +117,10 @@ struct ble_char_list_entry
 
 typedef struct ble_char_list_entry ble_char_list_entry_t;
 
+struct ble_schedule;
+
+struct ble_profile;
+
 typedef struct
 {
   ble_char_list_entry_t  *char_list;
@@ -98,12 +129,16 @@ typedef struct
   int32                   time_offset;
   int32                   wait;
   int32                   interval;
+  struct ble_schedule    *schedule;
+  int32                   index;
+  int32                   sequence;
 } ble_service_update_t;
 
 struct ble_service_list_entry
 {
   struct ble_service_list_entry *next;
   ble_attribute_t               *declaration;
+  const struct ble_profile      *profile;
   uint16                         start_handle;
   uint16                         end_handle;
   struct ble_service_list_entry *include_list;
@@ -113,6 +148,20 @@ struct ble_service_list_entry
 
 typedef struct ble_service_list_entry ble_service_list_entry_t;
 
+/* Handle to attribute index, sorted on handle */
+typedef struct
+{
+  uint16           handle;
+  ble_attribute_t *attribute;
+} ble_attribute_index_entry_t;
+
+typedef struct
+{
+  ble_attribute_index_entry_t *entry;
+  int32                        length;
+  int32                        size;
+} ble_attribute_index_t;
+
 /* BLE device address */
 #define BLE_DEVICE_ADDRESS_LENGTH  (6)
 
@@ -138,6 +187,7 @@ typedef enum
   BLE_DEVICE_DISCOVER_CHAR,
   BLE_DEVICE_CONFIGURE_CHAR,
   BLE_DEVICE_DATA,
+  BLE_DEVICE_ADVERTISE,
   BLE_DEVICE_IGNORE
 } ble_device_status_e;
 
@@ -149,34 +199,147 @@ typedef struct
 struct ble_device_list_entry
 {
   struct ble_device_list_entry  *next;
+  struct ble_device_list_entry  *prev;
   ble_device_address_t           address;
   int8                          *name;
   ble_service_list_entry_t      *service_list;
+  ble_attribute_index_t          attribute_index;
+  ble_arena_t                    arena;
+  uint8                         *profile_cache;
+  uint32                         profile_cache_length;
   ble_device_status_e            status;
+  int32                          adapter;
+  int32                          id;
   void                          *data;
 };
 
 typedef struct ble_device_list_entry ble_device_list_entry_t;
 
+/* Profile handler, one per supported service uuid. Only characteristics
+   in char_uuid get their descriptors discovered & column is the schema
+   of the device data table. Optional advertise decodes readings sent in
+   service data, or in manufacturer data under company */
+struct ble_profile
+{
+  int8               *name;
+  uint8               uuid_length;
+  uint8               uuid[BLE_MAX_UUID_LENGTH];
+  const uint16       *char_uuid;
+  int32               num_chars;
+  db_column_entry_t  *column;
+  uint32              num_columns;
+  int32             (*init)(ble_service_list_entry_t *service_list_entry,
+                            ble_device_list_entry_t *device_list_entry);
+  void              (*update)(ble_service_list_entry_t *service_list_entry,
+                              ble_device_list_entry_t *device_list_entry);
+  uint16              company;
+  int32             (*advertise)(ble_service_list_entry_t *service_list_entry,
+                                 ble_device_list_entry_t *device_list_entry,
+                                 uint8 *data, uint8 length);
+};
+
+typedef struct ble_profile ble_profile_t;
+
+/* No manufacturer data for the profile */
+#define BLE_NO_COMPANY_ID  (0xffff)
+
+/* Profile registry size, power of 2 */
+#define BLE_PROFILE_HASH_SIZE  (16)
+
+/* Service update schedule, min-heap on update.time. Each scheduled
+   service keeps its schedule & heap position */
+typedef struct
+{
+  ble_service_list_entry_t *service;
+  ble_device_list_entry_t  *device;
+} ble_schedule_entry_t;
+
+struct ble_schedule
+{
+  ble_schedule_entry_t *entry;
+  int32                 length;
+  int32                 size;
+};
+
+typedef struct ble_schedule ble_schedule_t;
+
 extern void ble_update_char_type (ble_char_list_entry_t * char_list_entry, uint8 type);
 
 extern ble_attribute_t * ble_find_attribute (ble_service_list_entry_t *service_list_entry,
                                              uint16 handle);
 
-extern void ble_clear_characteristics (ble_char_list_entry_t *char_list_entry);
+extern void ble_index_attributes (ble_attribute_index_t *attribute_index,
+                                  ble_service_list_entry_t *service_list_entry);
+
+extern ble_attribute_t * ble_lookup_attribute (ble_attribute_index_t *attribute_index,
+                                               uint16 handle);
+
+extern void ble_clear_attribute_index (ble_attribute_index_t *attribute_index);
+
+extern void * ble_arena_alloc (ble_arena_t *arena, uint32 size);
+
+extern void ble_arena_clear (ble_arena_t *arena);
+
+extern const uint8 * ble_intern_uuid (uint8 *uuid, uint8 uuid_length);
+
+extern ble_attribute_t * ble_new_attribute (ble_arena_t *arena, uint8 type, uint16 handle,
+                                            uint8 *uuid, uint8 uuid_length);
+
+extern ble_char_list_entry_t * ble_new_characteristics (ble_arena_t *arena);
+
+extern void ble_set_attribute_data (ble_arena_t *arena, ble_attribute_t *attribute,
+                                    uint8 *data, uint8 length);
+
+extern void ble_append_attribute_data (ble_arena_t *arena, ble_attribute_t *attribute,
+                                       uint8 *data, uint8 length);
+
+extern void ble_clear_attribute_data (ble_attribute_t *attribute);
+
+extern int32 ble_register_profile (const ble_profile_t *profile);
+
+extern const ble_profile_t * ble_lookup_profile (uint8 *uuid, uint8 uuid_length);
+
+extern void ble_init_profile (void);
+
+extern void ble_init_storage (ble_device_list_entry_t *device_list_entry);
+
+extern void ble_deinit_profile (void);
 
 extern void ble_print_service (ble_service_list_entry_t *service_list_entry);
 
 extern void ble_update_service (ble_service_list_entry_t *service_list_entry,
                                 ble_device_list_entry_t *device_list_entry);
 
+extern void ble_begin_update (void);
+
+extern void ble_end_update (void);
+
+extern void ble_flush_update (void);
+
+extern int32 ble_check_advertisement (ble_service_list_entry_t *service_list_entry,
+                                      int32 sequence);
+
+extern int32 ble_advertise_service (ble_device_list_entry_t *device_list_entry,
+                                    uint8 *uuid, uint8 uuid_length, uint8 *data, uint8 length);
+
+extern int32 ble_advertise_company (ble_device_list_entry_t *device_list_entry,
+                                    uint16 company, uint8 *data, uint8 length);
+
+extern int32 ble_check_characteristics (ble_service_list_entry_t *service_list_entry,
+                                        uint8 *uuid, uint8 uuid_length);
+
 extern int32 ble_init_service (ble_service_list_entry_t *service_list_entry,
                                ble_device_list_entry_t *device_list_entry);
 
 extern ble_service_list_entry_t * ble_find_service (ble_service_list_entry_t *service_list_entry,
                                                     uint8 *uuid, uint8 uuid_length);
 
-extern void ble_clear_service (ble_service_list_entry_t *service_list_entry);
+extern void ble_clear_service (ble_device_list_entry_t *device_list_entry);
+
+extern void ble_schedule_service (ble_schedule_t *schedule, ble_service_list_entry_t *service_list_entry,
+                                  ble_device_list_entry_t *device_list_entry);
+
+extern void ble_unschedule_service (ble_service_list_entry_t *service_list_entry);
 
 #endif
 
@@ -0,0 +1,1326 @@
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+
+#include "types.h"
+#include "list.h"
+#include "util.h"
+#include "profile.h"
+#include "ble.h"
+
+/* Simulated BLED112 dongle, serving a fleet of Health Thermometer
+ * sensors over BGAPI on a pseudo-terminal */
+
+/* Simulator limits/defaults */
+#define SIM_MAX_SENSORS          (4096)
+#define SIM_MAX_CONNECTIONS      (8)
+#define SIM_DEFAULT_SENSORS      (16)
+#define SIM_DEFAULT_CONNECTIONS  (3)
+#define SIM_DEFAULT_ADV_INTERVAL (1000)
+#define SIM_DEFAULT_MEAS_DELAY   (100)
+#define SIM_DEFAULT_CONN_INTERVAL  (20)
+#define SIM_WHITELIST_SIZE         (8)
+
+/* ATT payload per attribute value event (default MTU) */
+#define SIM_ATT_PAYLOAD  (22)
+
+/* BGAPI error codes */
+#define SIM_ERROR_WRONG_STATE    (0x0181)
+#define SIM_ERROR_OUT_OF_MEMORY  (0x0182)
+#define SIM_ERROR_NOT_CONNECTED  (0x0186)
+#define SIM_ERROR_INVALID_HANDLE (0x0401)
+#define SIM_DISCONNECT_LOCAL     (0x0216)
+
+/* Attribute handles of the sensor profile, see sim_profile */
+enum
+{
+  SIM_HANDLE_MEAS_VALUE      = 0x000c,
+  SIM_HANDLE_MEAS_CONFIG     = 0x000e,
+  SIM_HANDLE_INTERVAL_VALUE  = 0x0012,
+  SIM_HANDLE_INTERVAL_CONFIG = 0x0013,
+  SIM_HANDLE_BATTERY_VALUE   = 0x0017
+};
+
+typedef struct
+{
+  uint16  handle;
+  uint16  uuid;
+  uint8   length;
+  uint8   data[24];
+} sim_attribute_t;
+
+#define SIM_NUM_ATTRIBUTES  (25)
+
+static const sim_attribute_t sim_profile[SIM_NUM_ATTRIBUTES] =
+{
+  /* Generic access */
+  {0x0001, BLE_GATT_PRI_SERVICE,        2, {0x00, 0x18}},
+  {0x0002, BLE_GATT_CHAR_DECL,          5, {0x02, 0x03, 0x00, 0x00, 0x2a}},
+  {0x0003, 0x2a00,                     15, "Sim Thermometer"},
+  {0x0004, BLE_GATT_CHAR_DECL,          5, {0x02, 0x05, 0x00, 0x01, 0x2a}},
+  {0x0005, 0x2a01,                      2, {0x00, 0x03}},
+  /* Generic attribute */
+  {0x0006, BLE_GATT_PRI_SERVICE,        2, {0x01, 0x18}},
+  {0x0007, BLE_GATT_CHAR_DECL,          5, {0x20, 0x08, 0x00, 0x05, 0x2a}},
+  {0x0008, 0x2a05,                      4, {0x01, 0x00, 0xff, 0xff}},
+  {0x0009, BLE_GATT_CHAR_CLIENT_CONFIG, 2, {0x00, 0x00}},
+  /* Health thermometer */
+  {0x000a, BLE_GATT_PRI_SERVICE,        2, {0x09, 0x18}},
+  {0x000b, BLE_GATT_CHAR_DECL,          5, {0x20, 0x0c, 0x00, 0x1c, 0x2a}},
+  {0x000c, 0x2a1c,                      0, {0}},
+  {0x000d, BLE_GATT_CHAR_USER_DESC,    11, "Temperature"},
+  {0x000e, BLE_GATT_CHAR_CLIENT_CONFIG, 2, {0x00, 0x00}},
+  {0x000f, BLE_GATT_CHAR_DECL,          5, {0x02, 0x10, 0x00, 0x1d, 0x2a}},
+  {0x0010, 0x2a1d,                      1, {0x02}},
+  {0x0011, BLE_GATT_CHAR_DECL,          5, {0x2a, 0x12, 0x00, 0x21, 0x2a}},
+  {0x0012, 0x2a21,                      2, {0x3c, 0x00}},
+  {0x0013, BLE_GATT_CHAR_CLIENT_CONFIG, 2, {0x00, 0x00}},
+  {0x0014, BLE_GATT_CHAR_VALID_RANGE,   4, {0x3c, 0x00, 0x08, 0x07}},
+  /* Battery */
+  {0x0015, BLE_GATT_PRI_SERVICE,        2, {0x0f, 0x18}},
+  {0x0016, BLE_GATT_CHAR_DECL,          5, {0x12, 0x17, 0x00, 0x19, 0x2a}},
+  {0x0017, 0x2a19,                      1, {0x64}},
+  {0x0018, BLE_GATT_CHAR_CLIENT_CONFIG, 2, {0x00, 0x00}},
+  {0x0019, BLE_GATT_CHAR_FORMAT,        7, {0x04, 0x00, 0xad, 0x27, 0x01, 0x00, 0x00}}
+};
+
+/* Procedures tracked for latency statistics */
+enum
+{
+  SIM_PROC_CONNECT = 0,
+  SIM_PROC_READ_GROUP,
+  SIM_PROC_READ_TYPE,
+  SIM_PROC_FIND_INFORMATION,
+  SIM_PROC_READ_LONG,
+  SIM_PROC_READ_HANDLE,
+  SIM_PROC_WRITE,
+  SIM_PROC_DISCONNECT,
+  SIM_PROC_TURNAROUND,
+  SIM_PROC_CYCLE,
+  SIM_PROC_MAX
+};
+
+static const char *sim_proc_name[SIM_PROC_MAX] =
+{
+  "connect",
+  "read_group",
+  "read_type",
+  "find_information",
+  "read_long",
+  "read_handle",
+  "write",
+  "disconnect",
+  "turnaround",
+  "cycle"
+};
+
+typedef struct
+{
+  uint32 count;
+  double total;
+  double max;
+} sim_stat_t;
+
+typedef struct
+{
+  uint8            address[BLE_DEVICE_ADDRESS_LENGTH];
+  sim_attribute_t  attribute[SIM_NUM_ATTRIBUTES];
+  int32            lost;
+  int32            connection;
+  float            temperature;
+  double           next_meas;
+  int32            broadcast;
+  uint8            sequence;
+  double           next_broadcast;
+  int32            whitelisted;
+} sim_sensor_t;
+
+typedef struct
+{
+  int32         used;
+  sim_sensor_t *sensor;
+  int32         established;
+  double        connect_time;
+  double        idle_time;
+  int32         proc;
+  double        proc_time;
+  double        busy_until;
+} sim_connection_t;
+
+struct sim_output_list_entry
+{
+  struct sim_output_list_entry *next;
+  double                        time;
+  int32                         connection;
+  int32                         proc;
+  ble_message_t                 message;
+};
+
+typedef struct sim_output_list_entry sim_output_list_entry_t;
+
+LIST_HEAD_INIT (sim_output_list_entry_t, sim_output_list);
+
+static sim_sensor_t *sim_sensor = NULL;
+static int32 sim_num_sensors = SIM_DEFAULT_SENSORS;
+static int32 sim_max_connections = SIM_DEFAULT_CONNECTIONS;
+static int32 sim_adv_interval = SIM_DEFAULT_ADV_INTERVAL;
+static int32 sim_meas_delay = SIM_DEFAULT_MEAS_DELAY;
+static int32 sim_loss = 0;
+static int32 sim_broadcast = 0;
+static int32 sim_verbose = 0;
+
+static sim_connection_t sim_connection[SIM_MAX_CONNECTIONS];
+static int32 sim_connect_pending = -1;
+static int32 sim_scanning = 0;
+static int32 sim_duplicate_filter = 1;
+static int32 sim_scan_whitelist = 0;
+static int32 sim_whitelist_length = 0;
+static double sim_conn_interval = SIM_DEFAULT_CONN_INTERVAL;
+
+static sim_stat_t sim_stat[SIM_PROC_MAX];
+static uint32 sim_samples = 0;
+static uint32 sim_scan_reports = 0;
+static double sim_start_time = 0;
+
+static volatile sig_atomic_t sim_terminate = 0;
+
+
+static double sim_time (void)
+{
+  struct timespec current_time;
+
+  clock_gettime (CLOCK_MONOTONIC, &current_time);
+
+  return (current_time.tv_sec * 1000.0) + (current_time.tv_nsec / 1000000.0);
+}
+
+static double sim_random (double range)
+{
+  return (range * rand ())/((double)RAND_MAX + 1.0);
+}
+
+static void sim_stat_add (int32 proc, double elapsed)
+{
+  sim_stat[proc].count++;
+  sim_stat[proc].total += elapsed;
+  if (elapsed > sim_stat[proc].max)
+  {
+    sim_stat[proc].max = elapsed;
+  }
+}
+
+static void sim_signal (int signal_id)
+{
+  sim_terminate = 1;
+}
+
+static void sim_init_sensor (sim_sensor_t *sensor, int32 index)
+{
+  /* Address 00:07:80:xx:xx:xx, over the air in little endian */
+  sensor->address[5] = 0x00;
+  sensor->address[4] = 0x07;
+  sensor->address[3] = 0x80;
+  sensor->address[2] = ((index + 1) >> 16) & 0xff;
+  sensor->address[1] = ((index + 1) >> 8) & 0xff;
+  sensor->address[0] = (index + 1) & 0xff;
+
+  memcpy (sensor->attribute, sim_profile, sizeof (sim_profile));
+  sensor->lost        = (sim_random (100) < sim_loss);
+  sensor->connection  = -1;
+  sensor->temperature = 20.0 + sim_random (10);
+  sensor->next_meas   = 0;
+
+  /* Broadcasting sensors put readings in temperature service data */
+  sensor->broadcast      = (sim_broadcast > 0) && (sim_random (100) < sim_broadcast);
+  sensor->sequence       = 0;
+  sensor->next_broadcast = 0;
+  sensor->whitelisted    = 0;
+}
+
+static sim_attribute_t * sim_find_attribute (sim_sensor_t *sensor, uint16 handle)
+{
+  int32 i;
+
+  for (i = 0; i < SIM_NUM_ATTRIBUTES; i++)
+  {
+    if (sensor->attribute[i].handle == handle)
+    {
+      return &(sensor->attribute[i]);
+    }
+  }
+
+  return NULL;
+}
+
+static sim_sensor_t * sim_find_sensor (ble_device_address_t *address)
+{
+  int32 i;
+
+  for (i = 0; i < sim_num_sensors; i++)
+  {
+    if ((memcmp (sim_sensor[i].address, address->byte, BLE_DEVICE_ADDRESS_LENGTH)) == 0)
+    {
+      return &(sim_sensor[i]);
+    }
+  }
+
+  return NULL;
+}
+
+/* Queue a message for output at 'time', ordered by time */
+static ble_message_t * sim_queue (double time, int32 connection, int32 proc,
+                                  uint8 type, uint8 class, uint8 command, uint8 length)
+{
+  sim_output_list_entry_t *output_list_entry;
+  sim_output_list_entry_t **entry;
+
+  output_list_entry = (sim_output_list_entry_t *)malloc (sizeof (*output_list_entry));
+  output_list_entry->time                   = time;
+  output_list_entry->connection             = connection;
+  output_list_entry->proc                   = proc;
+  output_list_entry->message.header.type    = type;
+  output_list_entry->message.header.length  = length;
+  output_list_entry->message.header.class   = class;
+  output_list_entry->message.header.command = command;
+
+  for (entry = &sim_output_list; ((*entry != NULL) && ((*entry)->time <= time)); entry = &((*entry)->next));
+  output_list_entry->next = *entry;
+  *entry = output_list_entry;
+
+  return &(output_list_entry->message);
+}
+
+static void sim_response (uint8 class, uint8 command, uint8 length, uint8 *data)
+{
+  ble_message_t *message = sim_queue (0, -1, -1, BLE_RESPONSE, class, command, length);
+
+  memcpy (message->data, data, length);
+}
+
+static void sim_response_result (uint8 class, uint8 command, uint16 result)
+{
+  uint8 data[2] = {(result & 0xff), (result >> 8)};
+
+  sim_response (class, command, 2, data);
+}
+
+static void sim_response_connection (uint8 class, uint8 command, uint8 connection, uint16 result)
+{
+  uint8 data[3] = {connection, (result & 0xff), (result >> 8)};
+
+  sim_response (class, command, 3, data);
+}
+
+/* Time at which the next air transaction on a connection completes */
+static double sim_air_time (int32 connection, int32 intervals)
+{
+  double now = sim_time ();
+
+  if (sim_connection[connection].busy_until < now)
+  {
+    sim_connection[connection].busy_until = now;
+  }
+  sim_connection[connection].busy_until += (intervals * sim_conn_interval);
+
+  return sim_connection[connection].busy_until;
+}
+
+static void sim_procedure_completed (int32 connection, int32 proc, uint16 result, uint16 handle)
+{
+  ble_message_t *message;
+
+  message = sim_queue (sim_air_time (connection, 0), connection, proc,
+                       BLE_EVENT, BLE_CLASS_ATTR_CLIENT, BLE_EVENT_PROCEDURE_COMPLETED, 5);
+  message->data[0] = connection;
+  message->data[1] = result & 0xff;
+  message->data[2] = result >> 8;
+  message->data[3] = handle & 0xff;
+  message->data[4] = handle >> 8;
+}
+
+static void sim_attribute_value (int32 connection, int32 proc, uint16 handle,
+                                 uint8 type, uint8 length, uint8 *data)
+{
+  ble_message_t *message;
+
+  message = sim_queue (sim_air_time (connection, 1), connection, proc, BLE_EVENT,
+                       BLE_CLASS_ATTR_CLIENT, BLE_EVENT_ATTR_CLIENT_VALUE, (5 + length));
+  message->data[0] = connection;
+  message->data[1] = handle & 0xff;
+  message->data[2] = handle >> 8;
+  message->data[3] = type;
+  message->data[4] = length;
+  memcpy (&(message->data[5]), data, length);
+}
+
+static void sim_measure (sim_sensor_t *sensor)
+{
+  sim_attribute_t *attribute = sim_find_attribute (sensor, SIM_HANDLE_MEAS_VALUE);
+  time_t utc = time (NULL);
+  struct tm *utc_tm = localtime (&utc);
+
+  sensor->temperature += (sim_random (0.2) - 0.1);
+
+  /* Flags (time stamp, type), value, time stamp, type */
+  attribute->length  = 13;
+  attribute->data[0] = 0x06;
+  memcpy (&(attribute->data[1]), &(sensor->temperature), sizeof (float));
+  attribute->data[5]  = (utc_tm->tm_year + 1900) & 0xff;
+  attribute->data[6]  = (utc_tm->tm_year + 1900) >> 8;
+  attribute->data[7]  = utc_tm->tm_mon + 1;
+  attribute->data[8]  = utc_tm->tm_mday;
+  attribute->data[9]  = utc_tm->tm_hour;
+  attribute->data[10] = utc_tm->tm_min;
+  attribute->data[11] = utc_tm->tm_sec;
+  attribute->data[12] = 0x02;
+}
+
+/* Queue an advertising report of the sensor for 'time' */
+static void sim_advertise (sim_sensor_t *sensor, double time)
+{
+  ble_message_t *report;
+
+  report = sim_queue (time, -1, -1, BLE_EVENT, BLE_CLASS_GAP, BLE_EVENT_SCAN_RESPONSE,
+                      ((sensor->broadcast) ? 29 : 20));
+  report->data[0] = (uint8)(-60 - (int32)sim_random (30));
+  report->data[1] = BLE_ADV_IND;
+  memcpy (&(report->data[2]), sensor->address, BLE_DEVICE_ADDRESS_LENGTH);
+  report->data[8]  = BLE_ADDR_PUBLIC;
+  report->data[9]  = 0xff;
+  report->data[10] = 9;
+  /* Flags, complete 16-bit service list */
+  report->data[11] = 2;
+  report->data[12] = BLE_ADV_FLAGS;
+  report->data[13] = 0x06;
+  report->data[14] = 5;
+  report->data[15] = BLE_ADV_16BIT_UUID;
+  report->data[16] = 0x09;
+  report->data[17] = 0x18;
+  report->data[18] = 0x0f;
+  report->data[19] = 0x18;
+
+  if (sensor->broadcast)
+  {
+    sim_attribute_t *interval = sim_find_attribute (sensor, SIM_HANDLE_INTERVAL_VALUE);
+    int32 period = (interval->data[0] | (interval->data[1] << 8)) * 1000;
+
+    /* New reading once per measurement interval */
+    if (sensor->next_broadcast <= time)
+    {
+      sim_measure (sensor);
+      sensor->sequence++;
+      sensor->next_broadcast = time + ((period > 0) ? period : 60000);
+      sim_samples++;
+    }
+
+    /* Temperature service data, value & sequence number */
+    report->data[10] = 18;
+    report->data[20] = 8;
+    report->data[21] = BLE_ADV_SERVICE_DATA;
+    report->data[22] = 0x09;
+    report->data[23] = 0x18;
+    memcpy (&(report->data[24]), &(sensor->temperature), sizeof (float));
+    report->data[28] = sensor->sequence;
+  }
+}
+
+static void sim_disconnected (int32 connection, double time, uint16 reason)
+{
+  ble_message_t *message;
+
+  message = sim_queue (time, connection, SIM_PROC_DISCONNECT, BLE_EVENT,
+                       BLE_CLASS_CONNECTION, BLE_EVENT_DISCONNECTED, 3);
+  message->data[0] = connection;
+  message->data[1] = reason & 0xff;
+  message->data[2] = reason >> 8;
+}
+
+static void sim_release (int32 connection)
+{
+  sim_output_list_entry_t **entry = &sim_output_list;
+
+  /* Drop anything still in flight for this connection */
+  while (*entry != NULL)
+  {
+    if (((*entry)->connection == connection) &&
+        ((*entry)->message.header.type == BLE_EVENT) &&
+        (!(((*entry)->message.header.class == BLE_CLASS_CONNECTION) &&
+           ((*entry)->message.header.command == BLE_EVENT_DISCONNECTED))))
+    {
+      sim_output_list_entry_t *output_list_entry = *entry;
+
+      *entry = output_list_entry->next;
+      free (output_list_entry);
+    }
+    else
+    {
+      entry = &((*entry)->next);
+    }
+  }
+}
+
+static void sim_command_system (ble_message_t *message)
+{
+  if (message->header.command == BLE_COMMAND_HELLO)
+  {
+    sim_response (BLE_CLASS_SYSTEM, BLE_COMMAND_HELLO, 0, NULL);
+  }
+  else if (message->header.command == BLE_COMMAND_RESET)
+  {
+    int32 i;
+
+    if (sim_verbose)
+    {
+      fprintf (stderr, "sim: reset\n");
+    }
+
+    while (sim_output_list != NULL)
+    {
+      sim_output_list_entry_t *output_list_entry = sim_output_list;
+
+      sim_output_list = output_list_entry->next;
+      free (output_list_entry);
+    }
+
+    for (i = 0; i < SIM_MAX_CONNECTIONS; i++)
+    {
+      if (sim_connection[i].sensor != NULL)
+      {
+        sim_connection[i].sensor->connection = -1;
+      }
+      memset (&(sim_connection[i]), 0, sizeof (sim_connection[i]));
+    }
+
+    for (i = 0; i < sim_num_sensors; i++)
+    {
+      sim_sensor[i].whitelisted = 0;
+    }
+
+    sim_connect_pending  = -1;
+    sim_scanning         = 0;
+    sim_whitelist_length = 0;
+  }
+  else if ((message->header.command == BLE_COMMAND_APPEND_WHITELIST) ||
+           (message->header.command == BLE_COMMAND_REMOVE_WHITELIST))
+  {
+    ble_command_whitelist_t *whitelist = (ble_command_whitelist_t *)message;
+    sim_sensor_t *sensor = sim_find_sensor (&(whitelist->device_address));
+    uint16 result = 0;
+
+    /* Whitelist is in use while scanning */
+    if (sim_scanning)
+    {
+      result = SIM_ERROR_WRONG_STATE;
+    }
+    else if (message->header.command == BLE_COMMAND_APPEND_WHITELIST)
+    {
+      if (sim_whitelist_length >= SIM_WHITELIST_SIZE)
+      {
+        result = SIM_ERROR_OUT_OF_MEMORY;
+      }
+      else
+      {
+        sim_whitelist_length++;
+        if (sensor != NULL)
+        {
+          sensor->whitelisted = 1;
+        }
+      }
+    }
+    else if ((sensor != NULL) && (sensor->whitelisted))
+    {
+      sim_whitelist_length--;
+      sensor->whitelisted = 0;
+    }
+
+    sim_response_result (BLE_CLASS_SYSTEM, message->header.command, result);
+  }
+  else if (message->header.command == BLE_COMMAND_CLEAR_WHITELIST)
+  {
+    int32 i;
+
+    for (i = 0; i < sim_num_sensors; i++)
+    {
+      sim_sensor[i].whitelisted = 0;
+    }
+
+    sim_whitelist_length = 0;
+    sim_response (BLE_CLASS_SYSTEM, BLE_COMMAND_CLEAR_WHITELIST, 0, NULL);
+  }
+  else if (message->header.command == BLE_COMMAND_GET_CONNECTIONS)
+  {
+    uint8 max_connections = sim_max_connections;
+
+    sim_response (BLE_CLASS_SYSTEM, BLE_COMMAND_GET_CONNECTIONS, 1, &max_connections);
+  }
+  else
+  {
+    fprintf (stderr, "sim: system command %d not supported\n", message->header.command);
+  }
+}
+
+static void sim_command_gap (ble_message_t *message)
+{
+  if (message->header.command == BLE_COMMAND_SET_SCAN_PARAMS)
+  {
+    sim_response_result (BLE_CLASS_GAP, BLE_COMMAND_SET_SCAN_PARAMS, 0);
+  }
+  else if (message->header.command == BLE_COMMAND_SET_FILTERING)
+  {
+    ble_command_set_filtering_t *set_filtering = (ble_command_set_filtering_t *)message;
+
+    sim_duplicate_filter = (set_filtering->scan_duplicate == BLE_SCAN_DUPLICATE_FILTER);
+    sim_scan_whitelist   = (set_filtering->scan_policy == BLE_SCAN_POLICY_WHITELIST);
+    sim_response_result (BLE_CLASS_GAP, BLE_COMMAND_SET_FILTERING, 0);
+  }
+  else if (message->header.command == BLE_COMMAND_DISCOVER)
+  {
+    if ((sim_scanning) || (sim_connect_pending >= 0))
+    {
+      sim_response_result (BLE_CLASS_GAP, BLE_COMMAND_DISCOVER, SIM_ERROR_WRONG_STATE);
+    }
+    else
+    {
+      int32 i;
+      double now = sim_time ();
+
+      sim_scanning = 1;
+      sim_response_result (BLE_CLASS_GAP, BLE_COMMAND_DISCOVER, 0);
+
+      /* First advertisement of each sensor in range */
+      for (i = 0; i < sim_num_sensors; i++)
+      {
+        if ((!(sim_sensor[i].lost)) && (sim_sensor[i].connection < 0) &&
+            ((!sim_scan_whitelist) || (sim_sensor[i].whitelisted)))
+        {
+          sim_advertise (&(sim_sensor[i]), (now + sim_random (sim_adv_interval)));
+        }
+      }
+    }
+  }
+  else if (message->header.command == BLE_COMMAND_END_PROCEDURE)
+  {
+    if (sim_scanning)
+    {
+      sim_output_list_entry_t **entry = &sim_output_list;
+
+      while (*entry != NULL)
+      {
+        if (((*entry)->message.header.class == BLE_CLASS_GAP) &&
+            ((*entry)->message.header.command == BLE_EVENT_SCAN_RESPONSE))
+        {
+          sim_output_list_entry_t *output_list_entry = *entry;
+
+          *entry = output_list_entry->next;
+          free (output_list_entry);
+        }
+        else
+        {
+          entry = &((*entry)->next);
+        }
+      }
+
+      sim_scanning = 0;
+      sim_response_result (BLE_CLASS_GAP, BLE_COMMAND_END_PROCEDURE, 0);
+    }
+    else if (sim_connect_pending >= 0)
+    {
+      int32 connection = sim_connect_pending;
+
+      sim_release (connection);
+      if (sim_connection[connection].sensor != NULL)
+      {
+        sim_connection[connection].sensor->connection = -1;
+      }
+      memset (&(sim_connection[connection]), 0, sizeof (sim_connection[connection]));
+      sim_connect_pending = -1;
+      sim_response_result (BLE_CLASS_GAP, BLE_COMMAND_END_PROCEDURE, 0);
+    }
+    else
+    {
+      sim_response_result (BLE_CLASS_GAP, BLE_COMMAND_END_PROCEDURE, SIM_ERROR_WRONG_STATE);
+    }
+  }
+  else if (message->header.command == BLE_COMMAND_CONNECT_DIRECT)
+  {
+    ble_command_connect_direct_t *connect_direct = (ble_command_connect_direct_t *)message;
+    sim_sensor_t *sensor = sim_find_sensor (&(connect_direct->address));
+    uint8 data[3] = {0, 0, 0};
+    int32 connection;
+
+    for (connection = 0; ((connection < sim_max_connections) &&
+                          (sim_connection[connection].used)); connection++);
+
+    if ((sim_scanning) || (sim_connect_pending >= 0))
+    {
+      data[0] = SIM_ERROR_WRONG_STATE & 0xff;
+      data[1] = SIM_ERROR_WRONG_STATE >> 8;
+    }
+    else if (connection >= sim_max_connections)
+    {
+      data[0] = SIM_ERROR_OUT_OF_MEMORY & 0xff;
+      data[1] = SIM_ERROR_OUT_OF_MEMORY >> 8;
+    }
+    else
+    {
+      sim_connection_t *params = &(sim_connection[connection]);
+
+      data[2] = connection;
+
+      memset (params, 0, sizeof (*params));
+      params->used         = 1;
+      params->connect_time = sim_time ();
+      params->busy_until   = params->connect_time;
+      params->proc         = -1;
+      sim_connect_pending  = connection;
+      sim_conn_interval    = (connect_direct->max_interval * 1.25);
+      if (sim_conn_interval < 7.5)
+      {
+        sim_conn_interval = 7.5;
+      }
+
+      /* Unknown, lost or busy sensors never answer; the host ends the procedure */
+      if ((sensor != NULL) && (!(sensor->lost)) && (sensor->connection < 0))
+      {
+        ble_message_t *status;
+
+        params->sensor     = sensor;
+        sensor->connection = connection;
+
+        /* Connectable advertisement, then the connection request */
+        status = sim_queue ((params->connect_time + sim_random (sim_adv_interval) + sim_conn_interval),
+                            connection, SIM_PROC_CONNECT, BLE_EVENT, BLE_CLASS_CONNECTION, BLE_EVENT_STATUS, 16);
+        status->data[0] = connection;
+        status->data[1] = (BLE_CONNECT_CREATED | BLE_CONNECT_ESTABLISHED);
+        memcpy (&(status->data[2]), sensor->address, BLE_DEVICE_ADDRESS_LENGTH);
+        status->data[8]  = BLE_ADDR_PUBLIC;
+        status->data[9]  = connect_direct->max_interval & 0xff;
+        status->data[10] = connect_direct->max_interval >> 8;
+        status->data[11] = connect_direct->timeout & 0xff;
+        status->data[12] = connect_direct->timeout >> 8;
+        status->data[13] = connect_direct->latency & 0xff;
+        status->data[14] = connect_direct->latency >> 8;
+        status->data[15] = 0xff;
+      }
+    }
+
+    sim_response (BLE_CLASS_GAP, BLE_COMMAND_CONNECT_DIRECT, 3, data);
+  }
+  else
+  {
+    fprintf (stderr, "sim: GAP command %d not supported\n", message->header.command);
+  }
+}
+
+static sim_sensor_t * sim_check_connection (uint8 class, uint8 command, uint8 connection)
+{
+  if ((connection < sim_max_connections) &&
+      (sim_connection[connection].sensor != NULL) &&
+      (sim_connection[connection].established))
+  {
+    return sim_connection[connection].sensor;
+  }
+
+  sim_response_connection (class, command, connection, SIM_ERROR_NOT_CONNECTED);
+
+  return NULL;
+}
+
+static void sim_command_connection (ble_message_t *message)
+{
+  if (message->header.command == BLE_COMMAND_DISCONNECT)
+  {
+    uint8 connection = message->data[0];
+
+    if (sim_check_connection (BLE_CLASS_CONNECTION, BLE_COMMAND_DISCONNECT, connection) != NULL)
+    {
+      sim_response_connection (BLE_CLASS_CONNECTION, BLE_COMMAND_DISCONNECT, connection, 0);
+      sim_connection[connection].proc      = SIM_PROC_DISCONNECT;
+      sim_connection[connection].proc_time = sim_time ();
+      sim_release (connection);
+      sim_disconnected (connection, sim_air_time (connection, 1), SIM_DISCONNECT_LOCAL);
+      sim_connection[connection].established = 0;
+    }
+  }
+  else
+  {
+    fprintf (stderr, "sim: connection command %d not supported\n", message->header.command);
+  }
+}
+
+static void sim_command_attr_client (ble_message_t *message)
+{
+  uint8 connection = message->data[0];
+  sim_sensor_t *sensor;
+  int32 i;
+
+  sensor = sim_check_connection (BLE_CLASS_ATTR_CLIENT, message->header.command, connection);
+  if (sensor == NULL)
+  {
+    return;
+  }
+
+  if (message->header.command == BLE_COMMAND_READ_BY_GROUP_TYPE)
+  {
+    ble_command_read_group_t *read_group = (ble_command_read_group_t *)message;
+
+    sim_response_connection (BLE_CLASS_ATTR_CLIENT, BLE_COMMAND_READ_BY_GROUP_TYPE, connection, 0);
+    sim_connection[connection].proc      = SIM_PROC_READ_GROUP;
+    sim_connection[connection].proc_time = sim_time ();
+
+    for (i = 0; i < SIM_NUM_ATTRIBUTES; i++)
+    {
+      sim_attribute_t *attribute = &(sensor->attribute[i]);
+
+      if ((attribute->uuid == BLE_GATT_PRI_SERVICE) &&
+          (attribute->handle >= read_group->start_handle) &&
+          (attribute->handle <= read_group->end_handle))
+      {
+        ble_message_t *group;
+        uint16 end_handle = BLE_MAX_GATT_HANDLE;
+        int32 j;
+
+        for (j = i + 1; j < SIM_NUM_ATTRIBUTES; j++)
+        {
+          if (sensor->attribute[j].uuid == BLE_GATT_PRI_SERVICE)
+          {
+            end_handle = sensor->attribute[j].handle - 1;
+            break;
+          }
+        }
+
+        group = sim_queue (sim_air_time (connection, 1), connection, SIM_PROC_READ_GROUP, BLE_EVENT,
+                           BLE_CLASS_ATTR_CLIENT, BLE_EVENT_GROUP_FOUND, (6 + attribute->length));
+        group->data[0] = connection;
+        group->data[1] = attribute->handle & 0xff;
+        group->data[2] = attribute->handle >> 8;
+        group->data[3] = end_handle & 0xff;
+        group->data[4] = end_handle >> 8;
+        group->data[5] = attribute->length;
+        memcpy (&(group->data[6]), attribute->data, attribute->length);
+      }
+    }
+
+    sim_procedure_completed (connection, SIM_PROC_READ_GROUP, 0, 0);
+  }
+  else if (message->header.command == BLE_COMMAND_READ_BY_TYPE)
+  {
+    ble_command_read_type_t *read_type = (ble_command_read_type_t *)message;
+    uint16 uuid = read_type->data[0] | (read_type->data[1] << 8);
+    int32 found = 0;
+
+    sim_response_connection (BLE_CLASS_ATTR_CLIENT, BLE_COMMAND_READ_BY_TYPE, connection, 0);
+    sim_connection[connection].proc      = SIM_PROC_READ_TYPE;
+    sim_connection[connection].proc_time = sim_time ();
+
+    for (i = 0; i < SIM_NUM_ATTRIBUTES; i++)
+    {
+      sim_attribute_t *attribute = &(sensor->attribute[i]);
+
+      if ((attribute->uuid == uuid) &&
+          (attribute->handle >= read_type->start_handle) &&
+          (attribute->handle <= read_type->end_handle))
+      {
+        ble_message_t *value;
+
+        /* As many handle/value pairs per response PDU as fit */
+        value = sim_queue (sim_air_time (connection, ((found % ((SIM_ATT_PAYLOAD - 1)/(2 + attribute->length))) == 0)),
+                           connection, SIM_PROC_READ_TYPE, BLE_EVENT, BLE_CLASS_ATTR_CLIENT,
+                           BLE_EVENT_ATTR_CLIENT_VALUE, (5 + attribute->length));
+        value->data[0] = connection;
+        value->data[1] = attribute->handle & 0xff;
+        value->data[2] = attribute->handle >> 8;
+        value->data[3] = BLE_ATTR_VALUE_READ_TYPE;
+        value->data[4] = attribute->length;
+        memcpy (&(value->data[5]), attribute->data, attribute->length);
+        found++;
+      }
+    }
+
+    /* Final request ends with attribute not found */
+    sim_air_time (connection, 1);
+    sim_procedure_completed (connection, SIM_PROC_READ_TYPE, 0, 0);
+  }
+  else if (message->header.command == BLE_COMMAND_FIND_INFORMATION)
+  {
+    ble_command_find_information_t *find_information = (ble_command_find_information_t *)message;
+    int32 found = 0;
+
+    sim_response_connection (BLE_CLASS_ATTR_CLIENT, BLE_COMMAND_FIND_INFORMATION, connection, 0);
+    sim_connection[connection].proc      = SIM_PROC_FIND_INFORMATION;
+    sim_connection[connection].proc_time = sim_time ();
+
+    for (i = 0; i < SIM_NUM_ATTRIBUTES; i++)
+    {
+      sim_attribute_t *attribute = &(sensor->attribute[i]);
+
+      if ((attribute->handle >= find_information->start_handle) &&
+          (attribute->handle <= find_information->end_handle))
+      {
+        ble_message_t *information;
+
+        /* Up to 5 16-bit entries per response PDU */
+        information = sim_queue (sim_air_time (connection, ((found++ % 5) == 0)), connection,
+                                 SIM_PROC_FIND_INFORMATION, BLE_EVENT, BLE_CLASS_ATTR_CLIENT,
+                                 BLE_EVENT_INFORMATION_FOUND, 6);
+        information->data[0] = connection;
+        information->data[1] = attribute->handle & 0xff;
+        information->data[2] = attribute->handle >> 8;
+        information->data[3] = BLE_GATT_UUID_LENGTH;
+        information->data[4] = attribute->uuid & 0xff;
+        information->data[5] = attribute->uuid >> 8;
+      }
+    }
+
+    sim_procedure_completed (connection, SIM_PROC_FIND_INFORMATION, 0, 0);
+  }
+  else if ((message->header.command == BLE_COMMAND_READ_LONG) ||
+           (message->header.command == BLE_COMMAND_READ_BY_HANDLE))
+  {
+    ble_command_read_handle_t *read_handle = (ble_command_read_handle_t *)message;
+    sim_attribute_t *attribute = sim_find_attribute (sensor, read_handle->attr_handle);
+    int32 proc = (message->header.command == BLE_COMMAND_READ_LONG) ? SIM_PROC_READ_LONG
+                                                                    : SIM_PROC_READ_HANDLE;
+
+    sim_response_connection (BLE_CLASS_ATTR_CLIENT, message->header.command, connection, 0);
+    sim_connection[connection].proc      = proc;
+    sim_connection[connection].proc_time = sim_time ();
+
+    if (attribute != NULL)
+    {
+      if (attribute->handle == SIM_HANDLE_MEAS_VALUE)
+      {
+        sim_measure (sensor);
+      }
+
+      if (proc == SIM_PROC_READ_LONG)
+      {
+        int32 offset = 0;
+
+        do
+        {
+          int32 length = attribute->length - offset;
+
+          length = (length > SIM_ATT_PAYLOAD) ? SIM_ATT_PAYLOAD : length;
+          sim_attribute_value (connection, proc, attribute->handle, BLE_ATTR_VALUE_READ_BLOB,
+                               length, &(attribute->data[offset]));
+          offset += length;
+        } while (offset < attribute->length);
+
+        sim_procedure_completed (connection, proc, 0, attribute->handle);
+      }
+      else
+      {
+        sim_attribute_value (connection, proc, attribute->handle, BLE_ATTR_VALUE_READ,
+                             attribute->length, attribute->data);
+      }
+    }
+    else
+    {
+      sim_air_time (connection, 1);
+      sim_procedure_completed (connection, proc, SIM_ERROR_INVALID_HANDLE, read_handle->attr_handle);
+    }
+  }
+  else if (message->header.command == BLE_COMMAND_WRITE_ATTR_CLIENT)
+  {
+    ble_command_write_handle_t *write_handle = (ble_command_write_handle_t *)message;
+    sim_attribute_t *attribute = sim_find_attribute (sensor, write_handle->attr_handle);
+
+    sim_response_connection (BLE_CLASS_ATTR_CLIENT, BLE_COMMAND_WRITE_ATTR_CLIENT, connection, 0);
+    sim_connection[connection].proc      = SIM_PROC_WRITE;
+    sim_connection[connection].proc_time = sim_time ();
+    sim_air_time (connection, 2);
+
+    if ((attribute != NULL) && (write_handle->length <= sizeof (attribute->data)))
+    {
+      memcpy (attribute->data, write_handle->data, write_handle->length);
+      attribute->length = write_handle->length;
+      sim_procedure_completed (connection, SIM_PROC_WRITE, 0, attribute->handle);
+
+      if ((attribute->handle == SIM_HANDLE_MEAS_CONFIG) &&
+          (attribute->data[0] & (BLE_CHAR_CLIENT_NOTIFY | BLE_CHAR_CLIENT_INDICATE)))
+      {
+        /* Measurement ready shortly after indications are enabled */
+        sensor->next_meas = sim_time () + sim_meas_delay;
+      }
+    }
+    else
+    {
+      sim_procedure_completed (connection, SIM_PROC_WRITE, SIM_ERROR_INVALID_HANDLE,
+                               write_handle->attr_handle);
+    }
+  }
+  else
+  {
+    fprintf (stderr, "sim: attribute client command %d not supported\n", message->header.command);
+    sim_response_connection (BLE_CLASS_ATTR_CLIENT, message->header.command, connection, SIM_ERROR_WRONG_STATE);
+  }
+}
+
+static void sim_command (ble_message_t *message)
+{
+  double now = sim_time ();
+  uint8 connection = message->data[0];
+
+  if (sim_verbose)
+  {
+    fprintf (stderr, "sim: command class %d, command %d\n", message->header.class, message->header.command);
+  }
+
+  /* Host turnaround, from last event to the next request on a connection */
+  if (((message->header.class == BLE_CLASS_ATTR_CLIENT) ||
+       (message->header.class == BLE_CLASS_CONNECTION)) &&
+      (connection < SIM_MAX_CONNECTIONS) &&
+      (sim_connection[connection].established) &&
+      (sim_connection[connection].idle_time > 0))
+  {
+    sim_stat_add (SIM_PROC_TURNAROUND, (now - sim_connection[connection].idle_time));
+    sim_connection[connection].idle_time = 0;
+  }
+
+  switch (message->header.class)
+  {
+    case BLE_CLASS_SYSTEM:
+    {
+      sim_command_system (message);
+      break;
+    }
+    case BLE_CLASS_GAP:
+    {
+      sim_command_gap (message);
+      break;
+    }
+    case BLE_CLASS_CONNECTION:
+    {
+      sim_command_connection (message);
+      break;
+    }
+    case BLE_CLASS_ATTR_CLIENT:
+    {
+      sim_command_attr_client (message);
+      break;
+    }
+    default:
+    {
+      fprintf (stderr, "sim: class %d not supported\n", message->header.class);
+      break;
+    }
+  }
+}
+
+/* Bookkeeping when an output message actually leaves */
+static void sim_output (sim_output_list_entry_t *output_list_entry, double now)
+{
+  ble_message_t *message = &(output_list_entry->message);
+  int32 connection       = output_list_entry->connection;
+
+  if (message->header.type != BLE_EVENT)
+  {
+    return;
+  }
+
+  if ((message->header.class == BLE_CLASS_CONNECTION) &&
+      (message->header.command == BLE_EVENT_STATUS))
+  {
+    sim_connection[connection].established = 1;
+    sim_connection[connection].idle_time   = now;
+    sim_connect_pending = -1;
+    sim_stat_add (SIM_PROC_CONNECT, (now - sim_connection[connection].connect_time));
+  }
+  else if ((message->header.class == BLE_CLASS_CONNECTION) &&
+           (message->header.command == BLE_EVENT_DISCONNECTED))
+  {
+    if (sim_connection[connection].proc == SIM_PROC_DISCONNECT)
+    {
+      sim_stat_add (SIM_PROC_DISCONNECT, (now - sim_connection[connection].proc_time));
+    }
+    sim_stat_add (SIM_PROC_CYCLE, (now - sim_connection[connection].connect_time));
+    if (sim_connection[connection].sensor != NULL)
+    {
+      sim_connection[connection].sensor->connection = -1;
+    }
+    memset (&(sim_connection[connection]), 0, sizeof (sim_connection[connection]));
+  }
+  else if ((message->header.class == BLE_CLASS_ATTR_CLIENT) &&
+           (connection >= 0))
+  {
+    sim_connection[connection].idle_time = now;
+
+    if (message->header.command == BLE_EVENT_PROCEDURE_COMPLETED)
+    {
+      if (sim_connection[connection].proc >= 0)
+      {
+        sim_stat_add (sim_connection[connection].proc, (now - sim_connection[connection].proc_time));
+        sim_connection[connection].proc = -1;
+      }
+    }
+    else if ((message->header.command == BLE_EVENT_ATTR_CLIENT_VALUE) &&
+             (output_list_entry->proc == SIM_PROC_READ_HANDLE))
+    {
+      sim_stat_add (SIM_PROC_READ_HANDLE, (now - sim_connection[connection].proc_time));
+      sim_connection[connection].proc = -1;
+    }
+    else if ((message->header.command == BLE_EVENT_ATTR_CLIENT_VALUE) &&
+             (message->data[3] == BLE_ATTR_VALUE_INDICATE))
+    {
+      sim_samples++;
+    }
+  }
+  else if ((message->header.class == BLE_CLASS_GAP) &&
+           (message->header.command == BLE_EVENT_SCAN_RESPONSE))
+  {
+    sim_scan_reports++;
+  }
+}
+
+static void sim_measurement_check (double now)
+{
+  int32 connection;
+
+  for (connection = 0; connection < sim_max_connections; connection++)
+  {
+    sim_sensor_t *sensor = sim_connection[connection].sensor;
+
+    if ((sensor != NULL) && (sim_connection[connection].established) &&
+        (sensor->next_meas > 0) && (sensor->next_meas <= now))
+    {
+      sim_attribute_t *config   = sim_find_attribute (sensor, SIM_HANDLE_MEAS_CONFIG);
+      sim_attribute_t *interval = sim_find_attribute (sensor, SIM_HANDLE_INTERVAL_VALUE);
+      sim_attribute_t *value    = sim_find_attribute (sensor, SIM_HANDLE_MEAS_VALUE);
+      int32 period = (interval->data[0] | (interval->data[1] << 8)) * 1000;
+
+      if (config->data[0] & (BLE_CHAR_CLIENT_NOTIFY | BLE_CHAR_CLIENT_INDICATE))
+      {
+        sim_measure (sensor);
+        sim_attribute_value (connection, -1, SIM_HANDLE_MEAS_VALUE,
+                             ((config->data[0] & BLE_CHAR_CLIENT_INDICATE) ? BLE_ATTR_VALUE_INDICATE
+                                                                          : BLE_ATTR_VALUE_NOTIFY),
+                             value->length, value->data);
+        sensor->next_meas = now + ((period > 0) ? period : 60000);
+      }
+      else
+      {
+        sensor->next_meas = 0;
+      }
+    }
+  }
+}
+
+static void sim_advertise_check (double now)
+{
+  sim_output_list_entry_t *output_list_entry = sim_output_list;
+
+  /* Without duplicate filtering, sensors keep reporting every interval */
+  if ((sim_scanning) && (!sim_duplicate_filter))
+  {
+    while (output_list_entry != NULL)
+    {
+      if ((output_list_entry->message.header.class == BLE_CLASS_GAP) &&
+          (output_list_entry->message.header.command == BLE_EVENT_SCAN_RESPONSE) &&
+          (output_list_entry->time <= now))
+      {
+        sim_sensor_t *sensor = sim_find_sensor ((ble_device_address_t *)(&(output_list_entry->message.data[2])));
+
+        /* Rebuilt, broadcast readings move on */
+        if (sensor != NULL)
+        {
+          sim_advertise (sensor, (output_list_entry->time + sim_adv_interval));
+        }
+      }
+
+      output_list_entry = output_list_entry->next;
+    }
+  }
+}
+
+static void sim_report (void)
+{
+  int32 proc;
+  double elapsed = (sim_time () - sim_start_time)/1000.0;
+
+  printf ("elapsed %.1f\n", elapsed);
+  printf ("sensors %d\n", sim_num_sensors);
+  printf ("samples %u\n", sim_samples);
+  printf ("scan_reports %u\n", sim_scan_reports);
+
+  for (proc = 0; proc < SIM_PROC_MAX; proc++)
+  {
+    printf ("latency %-16s count %6u mean %8.1f max %8.1f (ms)\n", sim_proc_name[proc],
+            sim_stat[proc].count,
+            ((sim_stat[proc].count > 0) ? (sim_stat[proc].total/sim_stat[proc].count) : 0.0),
+            sim_stat[proc].max);
+  }
+
+  fflush (stdout);
+}
+
+static void sim_usage (char *name)
+{
+  printf ("Usage: %s [-n sensors] [-m max connections] [-a advertising interval (ms)]\n"
+          "          [-d measurement delay (ms)] [-l loss (%%)] [-b broadcasting (%%)] [-s seed] [-v]\n", name);
+}
+
+int main (int argc, char *argv[])
+{
+  int32 master;
+  int32 option;
+  int32 seed = 1;
+  uint8 input[sizeof (ble_message_t)];
+  uint32 input_length = 0;
+  struct sigaction signal_action;
+  struct termios options;
+
+  while ((option = getopt (argc, argv, "n:m:a:d:l:b:s:vh")) != -1)
+  {
+    switch (option)
+    {
+      case 'n': sim_num_sensors     = atoi (optarg); break;
+      case 'm': sim_max_connections = atoi (optarg); break;
+      case 'a': sim_adv_interval    = atoi (optarg); break;
+      case 'd': sim_meas_delay      = atoi (optarg); break;
+      case 'l': sim_loss            = atoi (optarg); break;
+      case 'b': sim_broadcast       = atoi (optarg); break;
+      case 's': seed                = atoi (optarg); break;
+      case 'v': sim_verbose         = 1;             break;
+      default:
+      {
+        sim_usage (argv[0]);
+        return 1;
+      }
+    }
+  }
+
+  if ((sim_num_sensors < 1) || (sim_num_sensors > SIM_MAX_SENSORS) ||
+      (sim_max_connections < 1) || (sim_max_connections > SIM_MAX_CONNECTIONS) ||
+      (sim_adv_interval < 20))
+  {
+    sim_usage (argv[0]);
+    return 1;
+  }
+
+  srand (seed);
+  sim_sensor = (sim_sensor_t *)malloc (sim_num_sensors * sizeof (*sim_sensor));
+  for (option = 0; option < sim_num_sensors; option++)
+  {
+    sim_init_sensor (&(sim_sensor[option]), option);
+  }
+
+  master = posix_openpt (O_RDWR | O_NOCTTY);
+  if ((master < 0) || (grantpt (master) != 0) || (unlockpt (master) != 0))
+  {
+    perror ("sim: pseudo-terminal");
+    return 1;
+  }
+
+  /* Raw master side */
+  tcgetattr (master, &options);
+  cfmakeraw (&options);
+  tcsetattr (master, TCSANOW, &options);
+
+  signal_action.sa_handler = sim_signal;
+  signal_action.sa_flags   = 0;
+  sigemptyset (&signal_action.sa_mask);
+  sigaction (SIGINT, &signal_action, NULL);
+  sigaction (SIGTERM, &signal_action, NULL);
+  signal (SIGPIPE, SIG_IGN);
+
+  printf ("pty %s\n", ptsname (master));
+  fflush (stdout);
+
+  sim_start_time = sim_time ();
+
+  while (!sim_terminate)
+  {
+    struct pollfd poll_fd;
+    double now = sim_time ();
+    int32 timeout = -1;
+
+    sim_advertise_check (now);
+    sim_measurement_check (now);
+
+    /* Flush everything that is due */
+    while ((sim_output_list != NULL) && (sim_output_list->time <= now))
+    {
+      sim_output_list_entry_t *output_list_entry = sim_output_list;
+      ble_message_t *message = &(output_list_entry->message);
+
+      sim_output_list = output_list_entry->next;
+
+      if ((write (master, message, ((sizeof (message->header)) + message->header.length))) > 0)
+      {
+        sim_output (output_list_entry, now);
+      }
+
+      free (output_list_entry);
+    }
+
+    if (sim_output_list != NULL)
+    {
+      timeout = (int32)(sim_output_list->time - now) + 1;
+    }
+
+    for (option = 0; option < sim_max_connections; option++)
+    {
+      sim_sensor_t *sensor = sim_connection[option].sensor;
+
+      if ((sensor != NULL) && (sensor->next_meas > 0))
+      {
+        int32 meas_timeout = (int32)(sensor->next_meas - now) + 1;
+
+        if ((timeout < 0) || (meas_timeout < timeout))
+        {
+          timeout = (meas_timeout > 0) ? meas_timeout : 0;
+        }
+      }
+    }
+
+    poll_fd.fd     = master;
+    poll_fd.events = POLLIN;
+
+    if ((poll (&poll_fd, 1, timeout)) > 0)
+    {
+      ssize_t bytes_read;
+
+      if (poll_fd.revents & POLLHUP)
+      {
+        /* Host side closed (e.g. after reset); wait for re-open */
+        usleep (10000);
+        continue;
+      }
+
+      bytes_read = read (master, &(input[input_length]), (sizeof (input) - input_length));
+      if (bytes_read > 0)
+      {
+        input_length += bytes_read;
+
+        while (input_length >= sizeof (ble_message_header_t))
+        {
+          ble_message_t *message = (ble_message_t *)input;
+          uint32 message_length  = (sizeof (message->header)) + message->header.length;
+
+          if (input_length < message_length)
+          {
+            break;
+          }
+
+          sim_command (message);
+          input_length -= message_length;
+          memmove (input, &(input[message_length]), input_length);
+        }
+      }
+    }
+  }
+
+  sim_report ();
+  close (master);
+
+  return 0;
+}
@@ -14,14 +14,14 @@
 
 #define BLE_SYNC_INTERVAL  (10 * 60 * 1000)
 
-LIST_HEAD_INIT (ble_sync_list_entry_t, sync_list);
+DLIST_HEAD_INIT (sync_list);
 
 static int32 previous_sync_time = (-BLE_SYNC_INTERVAL);
 
 
 static void ble_print_sync (void)
 {
-  ble_sync_list_entry_t *sync_list_entry = sync_list;
+  ble_sync_list_entry_t *sync_list_entry = (ble_sync_list_entry_t *)(sync_list.head);
   
   while (sync_list_entry != NULL)
   {
@@ -43,9 +43,11 @@ static void ble_print_sync (void)
     {
       ble_sync_temperature_data_t *sync_temperature_data
         = (ble_sync_temperature_data_t *)(sync_list_entry->data);
+      int8 *time = clock_format_time (sync_temperature_data->time);
       
       printf ("  type       : %s\n", "Temperature");
-      printf ("  time       : %s\n", sync_temperature_data->time);
+      printf ("  time       : %s\n", time);
+      free (time);
       if (sync_temperature_data->temperature != FLT_MAX)
       {
         printf ("  temperature: %.1f (C)\n", sync_temperature_data->temperature);
@@ -70,12 +72,12 @@ static void ble_print_sync (void)
 
 void ble_sync_push (ble_sync_list_entry_t *push_list_entry)
 {
-  list_add ((list_entry_t **)(&sync_list), (list_entry_t *)push_list_entry);
+  dlist_add (&sync_list, (dlist_entry_t *)push_list_entry);
 }
 
-void ble_sync_pull (ble_sync_list_entry_t **pull_list, uint8 data_type)
+void ble_sync_pull (dlist_head_t *pull_list, uint8 data_type)
 {
-  ble_sync_list_entry_t *sync_list_entry = sync_list;
+  ble_sync_list_entry_t *sync_list_entry = (ble_sync_list_entry_t *)(sync_list.head);
 
   while (sync_list_entry != NULL)
   {
@@ -91,8 +93,8 @@ void ble_sync_pull (ble_sync_list_entry_t **pull_list, uint8 data_type)
 
     if (pull_list_entry != NULL)
     {
-      list_remove ((list_entry_t **)(&sync_list), (list_entry_t *)pull_list_entry);
-      list_add ((list_entry_t **)pull_list, (list_entry_t *)pull_list_entry);
+      dlist_remove (&sync_list, (dlist_entry_t *)pull_list_entry);
+      dlist_add (pull_list, (dlist_entry_t *)pull_list_entry);
       pull_list_entry = NULL;
     }
   }
@@ -111,7 +113,7 @@ void * ble_sync (void *timeout)
     sleep ((int32)timeout);
     ble_print_sync ();
   
-    sync_list_entry = sync_list;
+    sync_list_entry = (ble_sync_list_entry_t *)(sync_list.head);
     while (sync_list_entry != NULL)
     {
       ble_sync_list_entry_t *sync_list_entry_del = sync_list_entry;
@@ -126,18 +128,11 @@ void * ble_sync (void *timeout)
         free (sync_device_data->service);
         free (sync_device_data->status);
       }
-      else if (sync_list_entry->data_type == BLE_SYNC_TEMPERATURE)
-      {
-        ble_sync_temperature_data_t *sync_temperature_data
-          = (ble_sync_temperature_data_t *)(sync_list_entry->data);
-        
-        free (sync_temperature_data->time);
-      }
-  
+
       free (sync_list_entry->data);
       
       sync_list_entry = sync_list_entry->next;
-      list_remove ((list_entry_t **)(&sync_list), (list_entry_t *)sync_list_entry_del);
+      dlist_remove (&sync_list, (dlist_entry_t *)sync_list_entry_del);
       free (sync_list_entry_del);
     }
   
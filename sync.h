@@ -2,6 +2,7 @@
 #define __SYNC_H__
 
 #include "types.h"
+#include "list.h"
 
 enum
 {
@@ -18,6 +19,7 @@ enum
 struct ble_sync_list_entry
 {
   struct ble_sync_list_entry *next;
+  struct ble_sync_list_entry *prev;
   uint8                       type;
   uint8                       data_type;
   void                       *data;
@@ -27,7 +29,7 @@ typedef struct ble_sync_list_entry ble_sync_list_entry_t;
 
 extern void ble_sync_push (ble_sync_list_entry_t *sync_list_entry);
 
-extern void ble_sync_pull (ble_sync_list_entry_t **sync_list_entry, uint8 data_type);
+extern void ble_sync_pull (dlist_head_t *pull_list, uint8 data_type);
 
 extern void * ble_sync (void *timeout);
 
@@ -47,9 +47,19 @@ typedef struct PACKED
   uint8           type;
 } ble_char_temperature_t;
 
+/* Temperature service data, the sequence number is optional */
+typedef struct PACKED
+{
+  float meas_value;
+  uint8 sequence;
+} ble_adv_temperature_t;
+
+#define BLE_ADV_TEMPERATURE_LENGTH  (sizeof (float))
+
 enum
 {
   DB_TEMPERATURE_TABLE_COLUMN_NO = 0,
+  DB_TEMPERATURE_TABLE_COLUMN_DEVICE,
   DB_TEMPERATURE_TABLE_COLUMN_TIME,
   DB_TEMPERATURE_TABLE_COLUMN_TEMPERATURE,
   DB_TEMPERATURE_TABLE_COLUMN_BAT_LEVEL,
@@ -60,25 +70,27 @@ static db_column_entry_t db_temperature_table_columns[DB_TEMPERATURE_TABLE_NUM_C
 {
   {"No.",               DB_TEMPERATURE_TABLE_COLUMN_NO,          DB_COLUMN_TYPE_INT,
     DB_COLUMN_FLAG_PRIMARY_KEY,                                   NULL},
-  {"Time",              DB_TEMPERATURE_TABLE_COLUMN_TIME,        DB_COLUMN_TYPE_TEXT,
-    (DB_COLUMN_FLAG_NOT_NULL | DB_COLUMN_FLAG_DEFAULT_NA),        NULL},
+  {"Device",            DB_TEMPERATURE_TABLE_COLUMN_DEVICE,      DB_COLUMN_TYPE_INT,
+    (DB_COLUMN_FLAG_NOT_NULL | DB_COLUMN_FLAG_INDEX_KEY),         NULL},
+  {"Time",              DB_TEMPERATURE_TABLE_COLUMN_TIME,        DB_COLUMN_TYPE_TIME,
+    (DB_COLUMN_FLAG_NOT_NULL | DB_COLUMN_FLAG_INDEX_KEY),         NULL},
   {"Temperature (C)",   DB_TEMPERATURE_TABLE_COLUMN_TEMPERATURE, DB_COLUMN_TYPE_FLOAT,
-    (DB_COLUMN_FLAG_NOT_NULL | DB_COLUMN_FLAG_DEFAULT_NA),        NULL},
+    0,                                                            NULL},
   {"Battery Level (%)", DB_TEMPERATURE_TABLE_COLUMN_BAT_LEVEL,   DB_COLUMN_TYPE_INT,
-    (DB_COLUMN_FLAG_NOT_NULL | DB_COLUMN_FLAG_DEFAULT_NA),        NULL},
+    0,                                                            NULL},
 };
 
-static db_info_t *db_info = NULL;
 
 
-void ble_update_temperature (ble_service_list_entry_t *service_list_entry,
-                             ble_device_list_entry_t *device_list_entry)
+static void ble_update_temperature (ble_service_list_entry_t *service_list_entry,
+                                    ble_device_list_entry_t *device_list_entry)
 {
   int32 update_failed;
   int32 current_time;
   db_table_list_entry_t *table_list_entry;
   ble_char_list_entry_t *update_list_entry;
-  db_column_value_t column_value;
+  db_column_value_t value[DB_TEMPERATURE_TABLE_NUM_COLUMNS];
+  uint32 null_mask;
   ble_sync_list_entry_t *sync_list_entry;
   ble_sync_temperature_data_t *sync_temperature_data;
 
@@ -93,13 +105,12 @@ void ble_update_temperature (ble_service_list_entry_t *service_list_entry,
   table_list_entry  = (db_table_list_entry_t *)(device_list_entry->data);
   update_list_entry = service_list_entry->update.char_list;
 
-  column_value.text = clock_get_time ();
-  db_write_column (table_list_entry, DB_WRITE_INSERT, DB_TEMPERATURE_TABLE_COLUMN_TIME, &column_value);
-  db_write_column (table_list_entry, DB_WRITE_INSERT, DB_TEMPERATURE_TABLE_COLUMN_BAT_LEVEL, NULL);
-  db_write_column (table_list_entry, DB_WRITE_INSERT, DB_TEMPERATURE_TABLE_COLUMN_BAT_LEVEL, NULL);
+  /* Temperature stays NULL unless read */
+  null_mask = (1 << DB_TEMPERATURE_TABLE_COLUMN_TEMPERATURE) | (1 << DB_TEMPERATURE_TABLE_COLUMN_BAT_LEVEL);
+  value[DB_TEMPERATURE_TABLE_COLUMN_DEVICE].integer = device_list_entry->id;
+  value[DB_TEMPERATURE_TABLE_COLUMN_TIME].time      = clock_get_epoch ();
 
-  sync_temperature_data->time = strdup (column_value.text);
-  free (column_value.text);
+  sync_temperature_data->time = value[DB_TEMPERATURE_TABLE_COLUMN_TIME].time;
   sync_temperature_data->temperature   = FLT_MAX;
   sync_temperature_data->battery_level = UINT_MAX;
 
@@ -140,8 +151,8 @@ void ble_update_temperature (ble_service_list_entry_t *service_list_entry,
                                                          temperature->meas_time.second);
         printf ("             offset: %d (ms)\n", service_list_entry->update.time_offset);
   
-        column_value.decimal = temperature->meas_value;
-        (void)db_write_column (table_list_entry, DB_WRITE_INSERT, DB_TEMPERATURE_TABLE_COLUMN_TEMPERATURE, &column_value);
+        value[DB_TEMPERATURE_TABLE_COLUMN_TEMPERATURE].decimal = temperature->meas_value;
+        null_mask &= ~(1 << DB_TEMPERATURE_TABLE_COLUMN_TEMPERATURE);
         sync_temperature_data->temperature = temperature->meas_value;
       }
       else
@@ -160,9 +171,7 @@ void ble_update_temperature (ble_service_list_entry_t *service_list_entry,
          (uuid == BLE_TEMPERATURE_TYPE_UUID)) &&
         (update_list_entry->value->data != NULL))
     {
-      free (update_list_entry->value->data);
-      update_list_entry->value->data        = NULL;
-      update_list_entry->value->data_length = 0;
+      ble_clear_attribute_data (update_list_entry->value);
     }
   
     update_list_entry = update_list_entry->next;
@@ -191,15 +200,17 @@ void ble_update_temperature (ble_service_list_entry_t *service_list_entry,
   
       if ((uuid_length == BLE_GATT_UUID_LENGTH) && (uuid == BLE_MEAS_INTERVAL_UUID))
       {
+        uint8 interval[BLE_MEAS_INTERVAL_LENGTH];
+
+        interval[0] = (service_list_entry->update.interval/1000) & 0xff;
+        interval[1] = ((service_list_entry->update.interval/1000) >> 8) & 0xff;            
+
         char_list_entry->value->type        = char_decl->type;
         char_list_entry->value->handle      = char_decl->handle;
         char_list_entry->value->uuid_length = uuid_length;
-        memcpy (char_list_entry->value->uuid, char_decl->uuid, uuid_length);
-        char_list_entry->value->data_length = BLE_MEAS_INTERVAL_LENGTH;
-        char_list_entry->value->data        = malloc (char_list_entry->value->data_length);
-
-        char_list_entry->value->data[0] = (service_list_entry->update.interval/1000) & 0xff;
-        char_list_entry->value->data[1] = ((service_list_entry->update.interval/1000) >> 8) & 0xff;            
+        char_list_entry->value->uuid        = ble_intern_uuid (char_decl->uuid, uuid_length);
+        ble_set_attribute_data (&(device_list_entry->arena), char_list_entry->value,
+                                interval, BLE_MEAS_INTERVAL_LENGTH);
 
         ble_update_char_type (char_list_entry, BLE_ATTR_TYPE_WRITE);
 
@@ -213,12 +224,12 @@ void ble_update_temperature (ble_service_list_entry_t *service_list_entry,
     }
   }
 
-  db_write_table (table_list_entry, DB_WRITE_INSERT);
+  db_write_row (table_list_entry, DB_WRITE_INSERT, value, null_mask);
   ble_sync_push (sync_list_entry);
 }
 
-int32 ble_init_temperature (ble_service_list_entry_t *service_list_entry,
-                            ble_device_list_entry_t *device_list_entry)
+static int32 ble_init_temperature (ble_service_list_entry_t *service_list_entry,
+                                   ble_device_list_entry_t *device_list_entry)
 {
   int32 found = 0;
   uint8 uuid_length;
@@ -240,14 +251,8 @@ int32 ble_init_temperature (ble_service_list_entry_t *service_list_entry,
          (uuid == BLE_TEMPERATURE_TYPE_UUID) ||
          (uuid == BLE_MEAS_INTERVAL_UUID)))
     {
-      char_list_entry->value = (ble_attribute_t *)malloc (sizeof (ble_attribute_t));
-        
-      char_list_entry->value->type        = char_decl->type;
-      char_list_entry->value->handle      = char_decl->handle;
-      char_list_entry->value->uuid_length = uuid_length;
-      memcpy (char_list_entry->value->uuid, char_decl->uuid, uuid_length);
-      char_list_entry->value->data_length = 0;
-      char_list_entry->value->data        = NULL;
+      char_list_entry->value = ble_new_attribute (&(device_list_entry->arena), char_decl->type,
+                                                  char_decl->handle, char_decl->uuid, uuid_length);
 
       if ((uuid == BLE_TEMPERATURE_MEAS_UUID) ||
           (uuid == BLE_TEMPERATURE_TYPE_UUID))
@@ -256,16 +261,18 @@ int32 ble_init_temperature (ble_service_list_entry_t *service_list_entry,
       }
       else
       {
-        char_list_entry->value->data_length = BLE_MEAS_INTERVAL_LENGTH;
-        char_list_entry->value->data        = malloc (char_list_entry->value->data_length);
+        uint8 interval[BLE_MEAS_INTERVAL_LENGTH];
         
         if ((service_list_entry->update.interval < BLE_MIN_TEMPERATURE_MEAS_INTERVAL) &&
             (service_list_entry->update.interval > BLE_MAX_TEMPERATURE_MEAS_INTERVAL))
         {
           service_list_entry->update.interval = BLE_TEMPERATURE_MEAS_INTERVAL;
         }
-        char_list_entry->value->data[0] = (service_list_entry->update.interval/1000) & 0xff;
-        char_list_entry->value->data[1] = ((service_list_entry->update.interval/1000) >> 8) & 0xff;
+        interval[0] = (service_list_entry->update.interval/1000) & 0xff;
+        interval[1] = ((service_list_entry->update.interval/1000) >> 8) & 0xff;
+
+        ble_set_attribute_data (&(device_list_entry->arena), char_list_entry->value,
+                                interval, BLE_MEAS_INTERVAL_LENGTH);
 
         ble_update_char_type (char_list_entry, BLE_ATTR_TYPE_WRITE);
       }
@@ -283,32 +290,78 @@ int32 ble_init_temperature (ble_service_list_entry_t *service_list_entry,
     }
   }
 
-  if (found > 0)
+  return found;
+}
+
+static int32 ble_advertise_temperature (ble_service_list_entry_t *service_list_entry,
+                                        ble_device_list_entry_t *device_list_entry,
+                                        uint8 *data, uint8 length)
+{
+  int32 sequence;
+  db_table_list_entry_t *table_list_entry;
+  db_column_value_t value[DB_TEMPERATURE_TABLE_NUM_COLUMNS];
+  ble_sync_list_entry_t *sync_list_entry;
+  ble_sync_temperature_data_t *sync_temperature_data;
+  ble_adv_temperature_t *temperature = (ble_adv_temperature_t *)data;
+
+  if (length < BLE_ADV_TEMPERATURE_LENGTH)
   {
-    if (db_info == NULL)
-    {
-      db_open ("gateway.db", &db_info);
-    }
-        
-    if (db_info != NULL)
-    {
-      db_table_list_entry_t *table_list_entry = (db_table_list_entry_t *)malloc (sizeof (*table_list_entry));
-      
-      table_list_entry->title       = strdup (device_list_entry->name);
-      table_list_entry->num_columns = DB_TEMPERATURE_TABLE_NUM_COLUMNS;
-      table_list_entry->column      = db_temperature_table_columns;
-      table_list_entry->insert      = NULL;
-      table_list_entry->update      = NULL;
-      table_list_entry->delete      = NULL;
-      table_list_entry->select      = NULL;
-
-      if ((db_create_table (db_info, table_list_entry)) > 0)
-      {
-        device_list_entry->data = table_list_entry;
-      }
-    }
+    printf ("  Temperature service data length %d invalid\n", length);
+    return -1;
   }
 
-  return found;
+  sequence = (length > BLE_ADV_TEMPERATURE_LENGTH) ? temperature->sequence : -1;
+  if ((ble_check_advertisement (service_list_entry, sequence)) <= 0)
+  {
+    return 1;
+  }
+
+  sync_list_entry            = (ble_sync_list_entry_t *)malloc (sizeof (*sync_list_entry));
+  sync_list_entry->type      = BLE_SYNC_PUSH;
+  sync_list_entry->data_type = BLE_SYNC_TEMPERATURE;
+  sync_list_entry->data      = malloc (sizeof (ble_sync_temperature_data_t));
+  sync_temperature_data      = (ble_sync_temperature_data_t *)(sync_list_entry->data);
+
+  table_list_entry = (db_table_list_entry_t *)(device_list_entry->data);
+
+  value[DB_TEMPERATURE_TABLE_COLUMN_DEVICE].integer      = device_list_entry->id;
+  value[DB_TEMPERATURE_TABLE_COLUMN_TIME].time          = clock_get_epoch ();
+  value[DB_TEMPERATURE_TABLE_COLUMN_TEMPERATURE].decimal = temperature->meas_value;
+
+  sync_temperature_data->time = value[DB_TEMPERATURE_TABLE_COLUMN_TIME].time;
+  sync_temperature_data->temperature   = temperature->meas_value;
+  sync_temperature_data->battery_level = UINT_MAX;
+
+  printf ("Device: %s\n", device_list_entry->name);
+  printf ("  Temperature value: %.1f (C), advertised, sequence %d\n", temperature->meas_value, sequence);
+
+  db_write_row (table_list_entry, DB_WRITE_INSERT, value,
+                (1 << DB_TEMPERATURE_TABLE_COLUMN_BAT_LEVEL));
+  ble_sync_push (sync_list_entry);
+
+  return 1;
 }
 
+/* Characteristics used by the temperature profile */
+static const uint16 ble_temperature_char_uuid[] =
+{
+  BLE_TEMPERATURE_MEAS_UUID,
+  BLE_TEMPERATURE_TYPE_UUID,
+  BLE_MEAS_INTERVAL_UUID
+};
+
+const ble_profile_t ble_temperature_profile =
+{
+  "Temperature",
+  BLE_GATT_UUID_LENGTH,
+  { ((BLE_TEMPERATURE_SERVICE_UUID >> 8) & 0xff), (BLE_TEMPERATURE_SERVICE_UUID & 0xff) },
+  ble_temperature_char_uuid,
+  (sizeof (ble_temperature_char_uuid)/sizeof (ble_temperature_char_uuid[0])),
+  db_temperature_table_columns,
+  DB_TEMPERATURE_TABLE_NUM_COLUMNS,
+  ble_init_temperature,
+  ble_update_temperature,
+  BLE_NO_COMPANY_ID,
+  ble_advertise_temperature
+};
+
@@ -7,7 +7,7 @@
 
 typedef struct
 {
-  int8   *time;
+  int64   time;
   float   temperature;
   uint32  battery_level;
 } ble_sync_temperature_data_t;
@@ -16,11 +16,7 @@ typedef struct
 
 extern void ble_sync_temperature (ble_sync_list_entry_t **sync_list);
 
-extern void ble_update_temperature (ble_service_list_entry_t *service_list_entry,
-                                    ble_device_list_entry_t *device_list_entry);
-
-extern int32 ble_init_temperature (ble_service_list_entry_t *service_list_entry,
-                                   ble_device_list_entry_t *device_list_entry);
+extern const ble_profile_t ble_temperature_profile;
 
 #endif
 
@@ -2,12 +2,63 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <semaphore.h>
 #include <sqlite3.h>
 
 #include "types.h"
 #include "list.h"
 #include "util.h"
 
+/* Row queued for the writer thread. Values are copies, text & blobs
+   go in data or are malloc'ed when they don't fit */
+typedef struct
+{
+  uint32             index;
+  uint8              null;
+  db_column_value_t  value;
+} db_row_value_t;
+
+enum
+{
+  DB_ROW_COMMIT = 0x80,
+  DB_ROW_STOP
+};
+
+typedef struct
+{
+  db_table_list_entry_t *table;
+  uint8                  type;
+  uint32                 num_values;
+  uint32                 alloc;
+  db_row_value_t         value[DB_ROW_COLUMNS];
+  uint32                 data_length;
+  uint8                  data[DB_ROW_DATA_SIZE];
+} db_row_t;
+
+/* Single producer (caller), single consumer (writer thread) ring.
+   head & tail only ever increase, each is written by one side only */
+struct db_queue
+{
+  db_row_t  row[DB_QUEUE_SIZE];
+  uint32    head;
+  uint32    tail;
+  uint8     staged;
+  sem_t     signal;
+  void     *thread;
+  uint32    queued;
+  uint32    dropped;
+  uint32    max_depth;
+  uint32    written;
+  uint32    failed;
+};
+
+static db_info_t *db_open_list = NULL;
+
+/* Connection served by the writer thread */
+static db_info_t *db_writer_info = NULL;
 
 int32 db_read_column (db_table_list_entry_t *table_list_entry,
                       uint32 index, db_column_value_t *column_value)
@@ -28,6 +79,10 @@ int32 db_read_column (db_table_list_entry_t *table_list_entry,
     column_value->decimal = sqlite3_column_double (statement, index);
 
   }
+  else if (table_list_entry->column[index].type == DB_COLUMN_TYPE_TIME)
+  {
+    column_value->time = sqlite3_column_int64 (statement, index);
+  }
   else
   {
     column_value->blob.data   = (uint8 *)sqlite3_column_blob (statement, index);
@@ -37,10 +92,66 @@ int32 db_read_column (db_table_list_entry_t *table_list_entry,
   return status;
 }
 
-int32 db_write_column (db_table_list_entry_t *table_list_entry, uint8 type,
-                       uint32 index, db_column_value_t *column_value)
+/* Open a transaction unless one is, the batch counts from here */
+static int32 db_begin_batch (db_info_t *db_info)
+{
+  int status;
+
+  if (!(sqlite3_get_autocommit ((sqlite3 *)(db_info->handle))))
+  {
+    return 1;
+  }
+
+  status = sqlite3_exec ((sqlite3 *)(db_info->handle), "BEGIN", NULL, NULL, NULL);
+
+  if (status == SQLITE_OK)
+  {
+    db_info->batch_length = 0;
+    db_info->batch_start  = clock_get_count ();
+    status = 1;
+  }
+  else
+  {
+    printf ("Can't begin database transaction\n");
+    status = -1;
+  }
+
+  return status;
+}
+
+/* Commit the open transaction if forced, unbatched, or the batch is
+   full or old enough */
+static int32 db_end_batch (db_info_t *db_info, int32 force)
 {
   int status;
+
+  if ((sqlite3_get_autocommit ((sqlite3 *)(db_info->handle))) ||
+      ((!force) && (db_info->batch_rows > 0) &&
+       (db_info->batch_length < db_info->batch_rows) &&
+       (((clock_get_count ()) - db_info->batch_start) < db_info->batch_timeout)))
+  {
+    return 1;
+  }
+
+  status = sqlite3_exec ((sqlite3 *)(db_info->handle), "COMMIT", NULL, NULL, NULL);
+
+  if (status == SQLITE_OK)
+  {
+    db_info->batch_length = 0;
+    status = 1;
+  }
+  else
+  {
+    printf ("Can't commit database transaction\n");
+    status = -1;
+  }
+
+  return status;
+}
+
+/* Statement of a write type */
+static sqlite3_stmt * db_write_statement (db_table_list_entry_t *table_list_entry, uint8 type)
+{
   sqlite3_stmt *statement;
 
   if (type == DB_WRITE_INSERT)
@@ -55,41 +166,66 @@ int32 db_write_column (db_table_list_entry_t *table_list_entry, uint8 type,
   {
     statement = (sqlite3_stmt *)(table_list_entry->delete);
   }
-  
-  if (column_value != NULL)
+
+  return statement;
+}
+
+/* Parameter of the column in the write type's statement, 0 if not used.
+   Resolved once in db_create_table () */
+static int32 db_bind_index (db_table_list_entry_t *table_list_entry, uint8 type, uint32 index)
+{
+  if (table_list_entry->bind != NULL)
   {
-    if (table_list_entry->column[index].type == DB_COLUMN_TYPE_TEXT)
-    {
-      status = sqlite3_bind_text (statement,
-                                  (sqlite3_bind_parameter_index (statement, table_list_entry->column[index].tag)),
-                                  column_value->text, -1, SQLITE_TRANSIENT);
-    }
-    else if (table_list_entry->column[index].type == DB_COLUMN_TYPE_INT)
-    {
-      status = sqlite3_bind_int (statement,
-                                 (sqlite3_bind_parameter_index (statement, table_list_entry->column[index].tag)),
-                                 column_value->integer);
-    }
-    else if (table_list_entry->column[index].type == DB_COLUMN_TYPE_FLOAT)
-    {
-      status = sqlite3_bind_double (statement,
-                                    (sqlite3_bind_parameter_index (statement, table_list_entry->column[index].tag)),
-                                    (double)(column_value->decimal));
-    }
-    else
-    {
-      status = sqlite3_bind_blob (statement,
-                                  (sqlite3_bind_parameter_index (statement, table_list_entry->column[index].tag)),
-                                  column_value->blob.data, column_value->blob.length, SQLITE_TRANSIENT);
-    }
+    return table_list_entry->bind[(type * table_list_entry->num_columns) + index];
+  }
+
+  return sqlite3_bind_parameter_index (db_write_statement (table_list_entry, type),
+                                       table_list_entry->column[index].tag);
+}
+
+static int db_bind_value (sqlite3_stmt *statement, int32 param, uint8 column_type,
+                          db_column_value_t *column_value)
+{
+  int status;
+
+  if (column_value == NULL)
+  {
+    status = sqlite3_bind_null (statement, param);
+  }
+  else if (column_type == DB_COLUMN_TYPE_TEXT)
+  {
+    status = sqlite3_bind_text (statement, param, column_value->text, -1, SQLITE_TRANSIENT);
+  }
+  else if (column_type == DB_COLUMN_TYPE_INT)
+  {
+    status = sqlite3_bind_int (statement, param, column_value->integer);
+  }
+  else if (column_type == DB_COLUMN_TYPE_FLOAT)
+  {
+    status = sqlite3_bind_double (statement, param, (double)(column_value->decimal));
+  }
+  else if (column_type == DB_COLUMN_TYPE_TIME)
+  {
+    status = sqlite3_bind_int64 (statement, param, column_value->time);
   }
   else
-  {   
-    status = sqlite3_bind_text (statement,
-                                (sqlite3_bind_parameter_index (statement, table_list_entry->column[index].tag)),
-                                "NA", -1, SQLITE_TRANSIENT);
+  {
+    status = sqlite3_bind_blob (statement, param, column_value->blob.data,
+                                column_value->blob.length, SQLITE_TRANSIENT);
   }
 
+  return status;
+}
+
+static int32 db_bind_column (db_table_list_entry_t *table_list_entry, uint8 type,
+                             uint32 index, db_column_value_t *column_value)
+{
+  int status;
+
+  status = db_bind_value (db_write_statement (table_list_entry, type),
+                          db_bind_index (table_list_entry, type, index),
+                          table_list_entry->column[index].type, column_value);
+
   if (status == SQLITE_OK)
   {
     status = 1;
@@ -127,38 +263,518 @@ int32 db_read_table (db_table_list_entry_t *table_list_entry)
   return status;
 }
 
-int32 db_write_table (db_table_list_entry_t *table_list_entry, uint8 type)
-{
-  int status;
-  sqlite3_stmt *statement;
+static int32 db_step_table (db_table_list_entry_t *table_list_entry, uint8 type)
+{
+  int status;
+  sqlite3_stmt *statement = db_write_statement (table_list_entry, type);
+  db_info_t *db_info;
+
+  db_info = table_list_entry->db_info;
+  if ((db_info != NULL) && (db_info->batch_rows > 0))
+  {
+    (void)db_begin_batch (db_info);
+  }
+    
+  status = sqlite3_step (statement);
+  if (status == SQLITE_DONE)
+  {
+    status = 1;
+  }
+  else
+  {
+    printf ("Can't write database table '%s'\n", table_list_entry->title);
+    status = -1;
+  }
+
+  sqlite3_reset (statement);
+
+  if ((db_info != NULL) && (db_info->batch_rows > 0))
+  {
+    db_info->batch_length++;
+    (void)db_end_batch (db_info, 0);
+  }
+
+  return status;
+}
+
+static void db_free_row (db_row_t *row)
+{
+  uint32 index;
+
+  for (index = 0; row->alloc != 0; index++)
+  {
+    if (row->alloc & (1 << index))
+    {
+      if (row->table->column[row->value[index].index].type == DB_COLUMN_TYPE_TEXT)
+      {
+        free (row->value[index].value.text);
+      }
+      else
+      {
+        free (row->value[index].value.blob.data);
+      }
+
+      row->alloc &= ~(1 << index);
+    }
+  }
+}
+
+/* Row being filled at the tail, NULL when the queue is full */
+static db_row_t * db_stage_row (struct db_queue *queue, db_table_list_entry_t *table_list_entry,
+                                uint8 type)
+{
+  db_row_t *row = &(queue->row[queue->tail & (DB_QUEUE_SIZE - 1)]);
+
+  if (queue->staged)
+  {
+    if ((row->table == table_list_entry) && (row->type == type))
+    {
+      return row;
+    }
+
+    /* Only one row is staged at a time, interleaving columns of another
+       table or write type drops the unfinished one */
+    db_free_row (row);
+    queue->staged = 0;
+    queue->dropped++;
+  }
+
+  if ((queue->tail - (__atomic_load_n (&(queue->head), __ATOMIC_ACQUIRE))) >= DB_QUEUE_SIZE)
+  {
+    return NULL;
+  }
+
+  row->table       = table_list_entry;
+  row->type        = type;
+  row->num_values  = 0;
+  row->alloc       = 0;
+  row->data_length = 0;
+  queue->staged    = 1;
+
+  return row;
+}
+
+/* Publish the staged row, or a marker when table is NULL. Full queue
+   drops rows so that a disk stall never holds up the caller */
+static int32 db_push_row (struct db_queue *queue, db_table_list_entry_t *table_list_entry,
+                          uint8 type)
+{
+  uint32 depth;
+  db_row_t *row = db_stage_row (queue, table_list_entry, type);
+
+  if (row == NULL)
+  {
+    if (table_list_entry != NULL)
+    {
+      queue->dropped++;
+    }
+
+    return -1;
+  }
+
+  queue->staged = 0;
+  __atomic_store_n (&(queue->tail), (queue->tail + 1), __ATOMIC_RELEASE);
+  sem_post (&(queue->signal));
+
+  depth = queue->tail - (__atomic_load_n (&(queue->head), __ATOMIC_ACQUIRE));
+  if (depth > queue->max_depth)
+  {
+    queue->max_depth = depth;
+  }
+
+  if (table_list_entry != NULL)
+  {
+    queue->queued++;
+  }
+
+  return 1;
+}
+
+/* Copy of the column value into the staged row */
+static int32 db_row_column (db_row_t *row, db_table_list_entry_t *table_list_entry,
+                            uint32 index, db_column_value_t *column_value)
+{
+  db_row_value_t *row_value;
+  uint32 slot;
+  uint32 length = 0;
+  uint8 *data = NULL;
+
+  /* Column written again replaces its value, as a bind would */
+  for (slot = 0; (slot < row->num_values) && (row->value[slot].index != index); slot++);
+
+  if (slot >= DB_ROW_COLUMNS)
+  {
+    printf ("Can't write database table '%s', column '%s'\n", table_list_entry->title,
+                                                              table_list_entry->column[index].title);
+    return -1;
+  }
+
+  if (row->alloc & (1 << slot))
+  {
+    if (table_list_entry->column[index].type == DB_COLUMN_TYPE_TEXT)
+    {
+      free (row->value[slot].value.text);
+    }
+    else
+    {
+      free (row->value[slot].value.blob.data);
+    }
+
+    row->alloc &= ~(1 << slot);
+  }
+
+  row_value        = &(row->value[slot]);
+  row_value->index = index;
+  row_value->null  = (column_value == NULL);
+
+  if (column_value != NULL)
+  {
+    row_value->value = *column_value;
+
+    if (table_list_entry->column[index].type == DB_COLUMN_TYPE_TEXT)
+    {
+      data   = (uint8 *)(column_value->text);
+      length = strlen (column_value->text) + 1;
+    }
+    else if (table_list_entry->column[index].type == DB_COLUMN_TYPE_BLOB)
+    {
+      data   = column_value->blob.data;
+      length = column_value->blob.length;
+    }
+  }
+
+  if (data != NULL)
+  {
+    uint8 *copy;
+
+    if ((row->data_length + length) <= DB_ROW_DATA_SIZE)
+    {
+      copy = &(row->data[row->data_length]);
+      row->data_length += length;
+    }
+    else
+    {
+      copy = (uint8 *)malloc (length);
+      row->alloc |= (1 << slot);
+    }
+
+    memcpy (copy, data, length);
+
+    if (table_list_entry->column[index].type == DB_COLUMN_TYPE_TEXT)
+    {
+      row_value->value.text = (int8 *)copy;
+    }
+    else
+    {
+      row_value->value.blob.data = copy;
+    }
+  }
+
+  if (slot == row->num_values)
+  {
+    row->num_values++;
+  }
+
+  return 1;
+}
+
+static int32 db_queue_column (struct db_queue *queue, db_table_list_entry_t *table_list_entry,
+                              uint8 type, uint32 index, db_column_value_t *column_value)
+{
+  db_row_t *row = db_stage_row (queue, table_list_entry, type);
+
+  if (row == NULL)
+  {
+    return -1;
+  }
+
+  return db_row_column (row, table_list_entry, index, column_value);
+}
+
+/* Storage thread, owns all writes & transactions of the connection */
+static void * db_writer (void *timeout)
+{
+  db_info_t *db_info = db_writer_info;
+  struct db_queue *queue = db_info->queue;
+  uint8 stop = 0;
+
+  printf ("DB writer start with timeout %d (ms)\n", (int32)(long)timeout);
+
+  while (!stop)
+  {
+    db_row_t *row;
+
+    if (queue->head == (__atomic_load_n (&(queue->tail), __ATOMIC_ACQUIRE)))
+    {
+      struct timespec wait_time;
+
+      /* Idle, commit the batch once it's old enough */
+      (void)db_end_batch (db_info, 0);
+
+      clock_gettime (CLOCK_REALTIME, &wait_time);
+      wait_time.tv_sec  += ((int32)(long)timeout / 1000);
+      wait_time.tv_nsec += (((int32)(long)timeout % 1000) * 1000000);
+      if (wait_time.tv_nsec >= 1000000000)
+      {
+        wait_time.tv_sec++;
+        wait_time.tv_nsec -= 1000000000;
+      }
+
+      (void)sem_timedwait (&(queue->signal), &wait_time);
+      continue;
+    }
+
+    row = &(queue->row[queue->head & (DB_QUEUE_SIZE - 1)]);
+
+    if (row->type == DB_ROW_STOP)
+    {
+      stop = 1;
+    }
+    else if (row->type == DB_ROW_COMMIT)
+    {
+      (void)db_end_batch (db_info, 1);
+    }
+    else
+    {
+      int32 status = 1;
+      uint32 index;
+
+      for (index = 0; index < row->num_values; index++)
+      {
+        if ((db_bind_column (row->table, row->type, row->value[index].index,
+                             ((row->value[index].null) ? NULL : &(row->value[index].value)))) < 0)
+        {
+          status = -1;
+        }
+      }
+
+      if (status > 0)
+      {
+        status = db_step_table (row->table, row->type);
+      }
+
+      if (status > 0)
+      {
+        queue->written++;
+      }
+      else
+      {
+        queue->failed++;
+      }
+
+      db_free_row (row);
+    }
+
+    __atomic_store_n (&(queue->head), (queue->head + 1), __ATOMIC_RELEASE);
+  }
+
+  (void)db_end_batch (db_info, 1);
+
+  printf ("DB writer end\n");
+
+  return NULL;
+}
+
+/* Wait till the writer has gone through everything queued */
+static void db_wait_queue (struct db_queue *queue)
+{
+  while ((__atomic_load_n (&(queue->head), __ATOMIC_ACQUIRE)) != queue->tail)
+  {
+    sem_post (&(queue->signal));
+    usleep (1000);
+  }
+}
+
+int32 db_write_column (db_table_list_entry_t *table_list_entry, uint8 type,
+                       uint32 index, db_column_value_t *column_value)
+{
+  if ((table_list_entry->db_info != NULL) && (table_list_entry->db_info->queue != NULL))
+  {
+    return db_queue_column (table_list_entry->db_info->queue, table_list_entry,
+                            type, index, column_value);
+  }
+
+  return db_bind_column (table_list_entry, type, index, column_value);
+}
+
+/* Whole row in one call, value is indexed by column & columns in
+   null_mask are NULL. Every parameter of the write type's statement is
+   bound, so nothing is left over from an earlier row. Statement & bind
+   indexes are looked up once per row, & a queued row is staged once */
+int32 db_write_row (db_table_list_entry_t *table_list_entry, uint8 type,
+                    db_column_value_t *value, uint32 null_mask)
+{
+  int32 status = 1;
+  uint32 index;
+  uint32 num_columns = table_list_entry->num_columns;
+  struct db_queue *queue = (table_list_entry->db_info != NULL) ? table_list_entry->db_info->queue : NULL;
+  sqlite3_stmt *statement = db_write_statement (table_list_entry, type);
+  int32 *bind = NULL;
+  db_row_t *row = NULL;
+
+  if (table_list_entry->bind == NULL)
+  {
+    printf ("Can't write database table '%s'\n", table_list_entry->title);
+    return -1;
+  }
+
+  bind = &(table_list_entry->bind[type * num_columns]);
+
+  if (queue != NULL)
+  {
+    row = db_stage_row (queue, table_list_entry, type);
+    if (row == NULL)
+    {
+      queue->dropped++;
+      return -1;
+    }
+  }
+
+  for (index = 0; (index < num_columns) && (status > 0); index++)
+  {
+    db_column_value_t *column_value = (null_mask & (1 << index)) ? NULL : &(value[index]);
+
+    if (bind[index] <= 0)
+    {
+      continue;
+    }
+
+    if (row != NULL)
+    {
+      status = db_row_column (row, table_list_entry, index, column_value);
+    }
+    else if ((db_bind_value (statement, bind[index], table_list_entry->column[index].type, column_value)) != SQLITE_OK)
+    {
+      printf ("Can't write database table '%s', column '%s'\n", table_list_entry->title,
+                                                                table_list_entry->column[index].title);
+      status = -1;
+    }
+  }
+
+  if (status > 0)
+  {
+    status = (row != NULL) ? db_push_row (queue, table_list_entry, type)
+                           : db_step_table (table_list_entry, type);
+  }
+
+  return status;
+}
+
+/* With the writer running the row is only queued, status is whether it
+   made it into the queue */
+int32 db_write_table (db_table_list_entry_t *table_list_entry, uint8 type)
+{
+  if ((table_list_entry->db_info != NULL) && (table_list_entry->db_info->queue != NULL))
+  {
+    return db_push_row (table_list_entry->db_info->queue, table_list_entry, type);
+  }
+
+  return db_step_table (table_list_entry, type);
+}
+
+/* Whether the table exists with other column types or constraints, i.e.
+   as created by an older schema */
+static int32 db_check_table (db_info_t *db_info, db_table_list_entry_t *table_list_entry)
+{
+  int32 changed = 0;
+  int32 found = 0;
+  char *sql;
+  sqlite3_stmt *statement;
+
+  sql = strdup ("PRAGMA table_info([");
+  STRING_CONCAT (sql, table_list_entry->title);
+  STRING_CONCAT (sql, "])");
+
+  if ((sqlite3_prepare_v2 ((sqlite3 *)(db_info->handle), sql, -1, &statement, NULL)) == SQLITE_OK)
+  {
+    while ((sqlite3_step (statement)) == SQLITE_ROW)
+    {
+      const char *title = (const char *)sqlite3_column_text (statement, 1);
+      const char *type  = (const char *)sqlite3_column_text (statement, 2);
+      int not_null      = sqlite3_column_int (statement, 3);
+      const char *column_type;
+      int index;
+
+      for (index = 0; (index < table_list_entry->num_columns) &&
+                      ((strcmp (table_list_entry->column[index].title, title)) != 0); index++);
+
+      if (index == table_list_entry->num_columns)
+      {
+        changed = 1;
+        break;
+      }
+
+      if (table_list_entry->column[index].type == DB_COLUMN_TYPE_TEXT)
+      {
+        column_type = "TEXT";
+      }
+      else if (table_list_entry->column[index].type == DB_COLUMN_TYPE_FLOAT)
+      {
+        column_type = "REAL";
+      }
+      else if (table_list_entry->column[index].type == DB_COLUMN_TYPE_BLOB)
+      {
+        column_type = "BLOB";
+      }
+      else
+      {
+        column_type = "INTEGER";
+      }
+
+      if (((strcasecmp (type, column_type)) != 0) ||
+          ((not_null != 0) != ((table_list_entry->column[index].flags & DB_COLUMN_FLAG_NOT_NULL) != 0)))
+      {
+        changed = 1;
+        break;
+      }
+
+      found++;
+    }
 
-  if (type == DB_WRITE_INSERT)
-  {
-    statement = (sqlite3_stmt *)(table_list_entry->insert);
-  }
-  else if (type == DB_WRITE_UPDATE)
-  {
-    statement = (sqlite3_stmt *)(table_list_entry->update);
-  }
-  else
-  {
-    statement = (sqlite3_stmt *)(table_list_entry->delete);
+    sqlite3_finalize (statement);
   }
-    
-  status = sqlite3_step (statement);
-  if (status == SQLITE_DONE)
-  {
-    status = 1;
-  }
-  else
+
+  free (sql);
+
+  /* Unique columns, each has an index of its own */
+  if ((!changed) && (found > 0))
   {
-    printf ("Can't write database table '%s'\n", table_list_entry->title);
-    status = -1;
-  }
+    int index;
+    int32 unique = 0;
 
-  sqlite3_reset (statement);
+    for (index = 0; index < table_list_entry->num_columns; index++)
+    {
+      if (table_list_entry->column[index].flags & DB_COLUMN_FLAG_UNIQUE)
+      {
+        unique++;
+      }
+    }
 
-  return status;
+    sql = strdup ("PRAGMA index_list([");
+    STRING_CONCAT (sql, table_list_entry->title);
+    STRING_CONCAT (sql, "])");
+
+    if ((sqlite3_prepare_v2 ((sqlite3 *)(db_info->handle), sql, -1, &statement, NULL)) == SQLITE_OK)
+    {
+      while ((sqlite3_step (statement)) == SQLITE_ROW)
+      {
+        const char *origin = (const char *)sqlite3_column_text (statement, 3);
+
+        if ((origin != NULL) && ((strcmp (origin, "u")) == 0))
+        {
+          unique--;
+        }
+      }
+
+      sqlite3_finalize (statement);
+    }
+
+    free (sql);
+
+    changed = (unique != 0);
+  }
+
+  return (changed || ((found > 0) && (found != table_list_entry->num_columns)));
 }
 
 int32 db_create_table (db_info_t *db_info, db_table_list_entry_t *table_list_entry)
@@ -166,6 +782,30 @@ int32 db_create_table (db_info_t *db_info, db_table_list_entry_t *table_list_ent
   int status;
   int index;
   char *sql;
+  char *old_title;
+
+  if ((db_info->queue != NULL) && (table_list_entry->num_columns > DB_ROW_COLUMNS))
+  {
+    printf ("Can't create database table '%s', more than %d columns with the writer running\n",
+            table_list_entry->title, DB_ROW_COLUMNS);
+    return -1;
+  }
+
+  /* Table of an older schema is set aside & its rows moved over once the
+     table is created again */
+  old_title = strdup (table_list_entry->title);
+  STRING_CONCAT (old_title, " Old");
+
+  if ((db_check_table (db_info, table_list_entry)) > 0)
+  {
+    sql = sqlite3_mprintf ("ALTER TABLE [%s] RENAME TO [%s]; DROP INDEX IF EXISTS [%s Index]",
+                           table_list_entry->title, old_title, table_list_entry->title);
+    if ((sqlite3_exec ((sqlite3 *)(db_info->handle), sql, NULL, NULL, NULL)) != SQLITE_OK)
+    {
+      printf ("Can't upgrade database table '%s'\n", table_list_entry->title);
+    }
+    sqlite3_free (sql);
+  }
 
   /* Prepare create statement */
   sql = strdup ("CREATE TABLE IF NOT EXISTS");
@@ -193,7 +833,8 @@ int32 db_create_table (db_info_t *db_info, db_table_list_entry_t *table_list_ent
     {
       STRING_CONCAT (sql, " TEXT COLLATE NOCASE");
     }
-    else if (table_list_entry->column[index].type == DB_COLUMN_TYPE_INT)
+    else if ((table_list_entry->column[index].type == DB_COLUMN_TYPE_INT) ||
+             (table_list_entry->column[index].type == DB_COLUMN_TYPE_TIME))
     {
       STRING_CONCAT (sql, " INTEGER");
     }
@@ -217,9 +858,20 @@ int32 db_create_table (db_info_t *db_info, db_table_list_entry_t *table_list_ent
       {
         STRING_CONCAT (sql, " NOT NULL");
       }
+      if (table_list_entry->column[index].flags & DB_COLUMN_FLAG_UNIQUE)
+      {
+        STRING_CONCAT (sql, " UNIQUE");
+      }
       if (table_list_entry->column[index].flags & DB_COLUMN_FLAG_DEFAULT_TIMESTAMP)
       {
-        STRING_CONCAT (sql, " DEFAULT (DATETIME('NOW','LOCALTIME'))");
+        if (table_list_entry->column[index].type == DB_COLUMN_TYPE_TIME)
+        {
+          STRING_CONCAT (sql, " DEFAULT (CAST((JULIANDAY('NOW') - 2440587.5) * 86400000 AS INTEGER))");
+        }
+        else
+        {
+          STRING_CONCAT (sql, " DEFAULT (DATETIME('NOW','LOCALTIME'))");
+        }
       }
       if (table_list_entry->column[index].flags & DB_COLUMN_FLAG_DEFAULT_NA)
       {
@@ -242,6 +894,60 @@ int32 db_create_table (db_info_t *db_info, db_table_list_entry_t *table_list_ent
   free (sql);
   sql = NULL;
 
+  if (status == SQLITE_OK)
+  {
+    /* Index on the index key column(s), covering the other columns */
+    for (index = 0; index < table_list_entry->num_columns; index++)
+    {
+      if (table_list_entry->column[index].flags & DB_COLUMN_FLAG_INDEX_KEY)
+      {
+        sql = strdup ("CREATE INDEX IF NOT EXISTS ");
+        STRING_CONCAT (sql, "[");
+        STRING_CONCAT (sql, table_list_entry->title);
+        STRING_CONCAT (sql, " Index] ON [");
+        STRING_CONCAT (sql, table_list_entry->title);
+        STRING_CONCAT (sql, "] ( [");
+        STRING_CONCAT (sql, table_list_entry->column[index].title);
+        STRING_CONCAT (sql, "]");
+        break;
+      }
+    }
+
+    for (index++; (sql != NULL) && (index < table_list_entry->num_columns); index++)
+    {
+      if (table_list_entry->column[index].flags & DB_COLUMN_FLAG_INDEX_KEY)
+      {
+        STRING_CONCAT (sql, ", [");
+        STRING_CONCAT (sql, table_list_entry->column[index].title);
+        STRING_CONCAT (sql, "]");
+      }
+    }
+
+    for (index = 0; (sql != NULL) && (index < table_list_entry->num_columns); index++)
+    {
+      if (!(table_list_entry->column[index].flags & (DB_COLUMN_FLAG_PRIMARY_KEY | DB_COLUMN_FLAG_INDEX_KEY)))
+      {
+        STRING_CONCAT (sql, ", [");
+        STRING_CONCAT (sql, table_list_entry->column[index].title);
+        STRING_CONCAT (sql, "]");
+      }
+    }
+
+    if (sql != NULL)
+    {
+      STRING_CONCAT (sql, " )");
+
+      status = sqlite3_exec ((sqlite3 *)(db_info->handle), sql, NULL, NULL, NULL);
+      if (status != SQLITE_OK)
+      {
+        printf ("Can't create database index '%s'\n", sql);
+      }
+
+      free (sql);
+      sql = NULL;
+    }
+  }
+
   if (status == SQLITE_OK)
   {
     /* Prepare insert statement */
@@ -451,6 +1157,7 @@ int32 db_create_table (db_info_t *db_info, db_table_list_entry_t *table_list_ent
     
     if (status == SQLITE_OK)
     {
+      table_list_entry->db_info = db_info;
       list_add ((list_entry_t **)(&(db_info->table_list)), (list_entry_t *)table_list_entry);
     }
     else
@@ -464,6 +1171,24 @@ int32 db_create_table (db_info_t *db_info, db_table_list_entry_t *table_list_ent
 
   if (status == SQLITE_OK)
   {
+    uint8 type;
+
+    /* Parameter of each column per write type, 0 when not used */
+    free (table_list_entry->bind);
+    table_list_entry->bind = (int32 *)malloc ((DB_WRITE_DELETE + 1) * table_list_entry->num_columns
+                                              * sizeof (int32));
+    for (type = DB_WRITE_INSERT; type <= DB_WRITE_DELETE; type++)
+    {
+      sqlite3_stmt *statement = db_write_statement (table_list_entry, type);
+
+      for (index = 0; index < table_list_entry->num_columns; index++)
+      {
+        table_list_entry->bind[(type * table_list_entry->num_columns) + index]
+          = (statement != NULL) ? sqlite3_bind_parameter_index (statement, table_list_entry->column[index].tag) : 0;
+      }
+    }
+
+    (void)db_merge_table (db_info, old_title, table_list_entry, -1, 0);
     status = 1;
   }
   else
@@ -495,6 +1220,8 @@ int32 db_create_table (db_info_t *db_info, db_table_list_entry_t *table_list_ent
     status = -1;
   }
 
+  free (old_title);
+
   return status;
 }
 
@@ -502,6 +1229,12 @@ int32 db_delete_table (db_info_t *db_info, db_table_list_entry_t *table_list_ent
 {
   int status;
   char *sql = NULL;
+
+  /* Queued rows may still use the table's statements */
+  if (db_info->queue != NULL)
+  {
+    db_wait_queue (db_info->queue);
+  }
   
   sql = strdup ("DROP TABLE IF EXISTS ");
   STRING_CONCAT (sql, "[");
@@ -537,6 +1270,9 @@ int32 db_delete_table (db_info_t *db_info, db_table_list_entry_t *table_list_ent
       table_list_entry->select = NULL;
     }
 
+    free (table_list_entry->bind);
+    table_list_entry->bind = NULL;
+
     list_remove ((list_entry_t **)(&(db_info->table_list)), (list_entry_t *)table_list_entry);
     status = 1;
   }
@@ -549,19 +1285,288 @@ int32 db_delete_table (db_info_t *db_info, db_table_list_entry_t *table_list_ent
   return status;
 }
 
+/* Column of an older table as the column type expects it. Text time is
+   local time & 'NA' stood for a missing value */
+static void db_select_column (char **sql, db_column_entry_t *column)
+{
+  if (column->type == DB_COLUMN_TYPE_TIME)
+  {
+    STRING_CONCAT (*sql, "CASE WHEN TYPEOF([");
+    STRING_CONCAT (*sql, column->title);
+    STRING_CONCAT (*sql, "]) = 'text' THEN CAST(STRFTIME('%s', [");
+    STRING_CONCAT (*sql, column->title);
+    STRING_CONCAT (*sql, "], 'utc') AS INTEGER) * 1000 ELSE [");
+    STRING_CONCAT (*sql, column->title);
+    STRING_CONCAT (*sql, "] END");
+  }
+  else if ((column->type == DB_COLUMN_TYPE_INT) || (column->type == DB_COLUMN_TYPE_FLOAT))
+  {
+    STRING_CONCAT (*sql, "NULLIF([");
+    STRING_CONCAT (*sql, column->title);
+    STRING_CONCAT (*sql, "], 'NA')");
+  }
+  else
+  {
+    STRING_CONCAT (*sql, "[");
+    STRING_CONCAT (*sql, column->title);
+    STRING_CONCAT (*sql, "]");
+  }
+}
+
+/* Move rows of the table named title, if there is one, into the table,
+   with column index (if >= 0) set to value. The other columns are copied
+   by title, a row clashing on a unique column with one moved before it is
+   left out. Rows & drop are one savepoint so that an interrupted move is
+   redone */
+int32 db_merge_table (db_info_t *db_info, int8 *title,
+                      db_table_list_entry_t *table_list_entry, int32 index, int32 value)
+{
+  int status;
+  int column;
+  char *sql;
+  char *columns = NULL;
+  char *select = NULL;
+  sqlite3_stmt *statement;
+  db_table_list_entry_t *known_list_entry;
+
+  /* Never a table of our own */
+  for (known_list_entry = db_info->table_list; known_list_entry != NULL;
+       known_list_entry = known_list_entry->next)
+  {
+    if ((strcmp (known_list_entry->title, title)) == 0)
+    {
+      return 0;
+    }
+  }
+
+  status = sqlite3_prepare_v2 ((sqlite3 *)(db_info->handle),
+                               "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?",
+                               -1, &statement, NULL);
+  if (status == SQLITE_OK)
+  {
+    sqlite3_bind_text (statement, 1, title, -1, SQLITE_STATIC);
+    status = sqlite3_step (statement);
+    sqlite3_finalize (statement);
+  }
+
+  if (status != SQLITE_ROW)
+  {
+    return (status == SQLITE_DONE) ? 0 : -1;
+  }
+
+  for (column = 0; column < table_list_entry->num_columns; column++)
+  {
+    if (!(table_list_entry->column[column].flags & DB_COLUMN_FLAG_PRIMARY_KEY))
+    {
+      if (columns == NULL)
+      {
+        columns = strdup ("[");
+        select  = strdup ("");
+      }
+      else
+      {
+        STRING_CONCAT (columns, ", [");
+        STRING_CONCAT (select, ", ");
+      }
+      STRING_CONCAT (columns, table_list_entry->column[column].title);
+      STRING_CONCAT (columns, "]");
+
+      if (column == index)
+      {
+        char key[16];
+
+        snprintf (key, sizeof (key), "%d", value);
+        STRING_CONCAT (select, key);
+      }
+      else
+      {
+        db_select_column (&select, &(table_list_entry->column[column]));
+      }
+    }
+  }
+
+  sql = sqlite3_mprintf ("SAVEPOINT merge; "
+                         "INSERT OR IGNORE INTO [%s] ( %s ) SELECT %s FROM [%s]; "
+                         "DROP TABLE [%s]; "
+                         "RELEASE merge",
+                         table_list_entry->title, columns, select, title, title);
+  free (columns);
+  free (select);
+
+  status = sqlite3_exec ((sqlite3 *)(db_info->handle), sql, NULL, NULL, NULL);
+  sqlite3_free (sql);
+
+  if (status == SQLITE_OK)
+  {
+    status = 1;
+  }
+  else
+  {
+    printf ("Can't merge database table '%s' into '%s'\n", title, table_list_entry->title);
+    (void)sqlite3_exec ((sqlite3 *)(db_info->handle), "ROLLBACK TO merge; RELEASE merge",
+                        NULL, NULL, NULL);
+    status = -1;
+  }
+
+  return status;
+}
+
+/* Writes till db_commit () go in one transaction, i.e. one journal sync.
+   With batching on, a transaction already open is joined & db_commit ()
+   only ends it once the batch is full or old enough. The writer thread,
+   if running, owns transactions & these only ask it to commit */
+int32 db_begin (db_info_t *db_info)
+{
+  if (db_info->queue != NULL)
+  {
+    return 1;
+  }
+
+  return db_begin_batch (db_info);
+}
+
+int32 db_commit (db_info_t *db_info)
+{
+  if (db_info->queue != NULL)
+  {
+    return 1;
+  }
+
+  return db_end_batch (db_info, 0);
+}
+
+/* Commit the open transaction, if any */
+int32 db_flush (db_info_t *db_info)
+{
+  if (db_info->queue != NULL)
+  {
+    return db_push_row (db_info->queue, NULL, DB_ROW_COMMIT);
+  }
+
+  return db_end_batch (db_info, 1);
+}
+
+/* Batch writes of the connection, rows = 0 turns batching off */
+void db_set_batch (db_info_t *db_info, uint32 rows, int32 millisec)
+{
+  db_info->batch_rows    = rows;
+  db_info->batch_timeout = millisec;
+
+  if (rows == 0)
+  {
+    (void)db_flush (db_info);
+  }
+}
+
+/* Hand the connection's writes to a storage thread, one per process */
+int32 db_start_writer (db_info_t *db_info)
+{
+  struct db_queue *queue;
+  db_table_list_entry_t *table_list_entry;
+
+  if (db_writer_info != NULL)
+  {
+    printf ("Can't start database writer, already running\n");
+    return -1;
+  }
+
+  /* A queued row holds up to DB_ROW_COLUMNS values, wider tables are
+     only written directly */
+  for (table_list_entry = db_info->table_list; table_list_entry != NULL;
+       table_list_entry = table_list_entry->next)
+  {
+    if (table_list_entry->num_columns > DB_ROW_COLUMNS)
+    {
+      printf ("Can't start database writer, table '%s' has more than %d columns\n",
+              table_list_entry->title, DB_ROW_COLUMNS);
+      return -1;
+    }
+  }
+
+  /* Writes so far are committed here, the thread starts on a clean
+     connection */
+  (void)db_end_batch (db_info, 1);
+
+  queue = (struct db_queue *)calloc (1, sizeof (*queue));
+  sem_init (&(queue->signal), 0, 0);
+
+  db_info->queue = queue;
+  db_writer_info = db_info;
+
+  if ((os_create_thread (db_writer, OS_THREAD_PRIORITY_MIN,
+                         ((db_info->batch_timeout > 0) ? db_info->batch_timeout : DB_BATCH_TIMEOUT),
+                         &(queue->thread))) < 0)
+  {
+    db_info->queue = NULL;
+    db_writer_info = NULL;
+    sem_destroy (&(queue->signal));
+    free (queue);
+    return -1;
+  }
+
+  return 1;
+}
+
+/* Flush barrier, returns once all queued rows are committed */
+int32 db_stop_writer (db_info_t *db_info)
+{
+  struct db_queue *queue = db_info->queue;
+
+  if (queue == NULL)
+  {
+    return 1;
+  }
+
+  while ((db_push_row (queue, NULL, DB_ROW_STOP)) < 0)
+  {
+    db_wait_queue (queue);
+  }
+
+  (void)os_destroy_thread (queue->thread);
+
+  printf ("DB writer queued %u, written %u, failed %u, dropped %u, max depth %u\n",
+          queue->queued, queue->written, queue->failed, queue->dropped, queue->max_depth);
+
+  db_info->queue = NULL;
+  db_writer_info = NULL;
+  sem_destroy (&(queue->signal));
+  free (queue);
+
+  return 1;
+}
+
 int32 db_open (int8 *file_name, db_info_t **db_info)
 {
   int status;
   sqlite3 *db;
 
+  /* Already open, share the connection */
+  for (*db_info = db_open_list; *db_info != NULL; *db_info = (*db_info)->next)
+  {
+    if ((strcmp ((*db_info)->file_name, file_name)) == 0)
+    {
+      (*db_info)->users++;
+      return 1;
+    }
+  }
+
   *db_info = (db_info_t *)malloc (sizeof (**db_info));
   status   = sqlite3_open_v2 (file_name, &db,
-                              (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE), NULL);
+                              (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX), NULL);
   
   if (status == SQLITE_OK)
   {
-    (*db_info)->handle     = db;
-    (*db_info)->table_list = NULL;
+    (*db_info)->file_name     = strdup (file_name);
+    (*db_info)->users         = 1;
+    (*db_info)->handle        = db;
+    (*db_info)->table_list    = NULL;
+    (*db_info)->batch_rows    = 0;
+    (*db_info)->batch_timeout = 0;
+    (*db_info)->batch_length  = 0;
+    (*db_info)->batch_start   = 0;
+    (*db_info)->queue         = NULL;
+    (*db_info)->next          = NULL;
+    list_add ((list_entry_t **)(&db_open_list), (list_entry_t *)(*db_info));
     status = 1;
   }
   else
@@ -580,6 +1585,16 @@ int32 db_open (int8 *file_name, db_info_t **db_info)
 int32 db_close (db_info_t *db_info)
 {
   sqlite3 *db = (sqlite3 *)(db_info->handle);
+
+  if ((--(db_info->users)) > 0)
+  {
+    return SQLITE_OK;
+  }
+
+  (void)db_stop_writer (db_info);
+  (void)db_flush (db_info);
+  list_remove ((list_entry_t **)(&db_open_list), (list_entry_t *)db_info);
+  free (db_info->file_name);
   free (db_info);
   return sqlite3_close (db);
 }
@@ -589,6 +1604,7 @@ int32 db_close (db_info_t *db_info)
 #define NUM_STATIC_TABLES              (1)
 #define DEVICE_TABLE_NUM_COLUMNS       (6)
 #define TEMPERATURE_TABLE_NUM_COLUMNS  (4)
+#define TEST_BENCH_ROWS                (100000)
 
 static db_column_entry_t device_table_columns[DEVICE_TABLE_NUM_COLUMNS] = 
 {
@@ -604,14 +1620,14 @@ static db_column_entry_t device_table_columns[DEVICE_TABLE_NUM_COLUMNS] =
 static db_column_entry_t temperature_table_columns[TEMPERATURE_TABLE_NUM_COLUMNS] =
 {
   {"No.",               0, DB_COLUMN_TYPE_INT,   DB_COLUMN_FLAG_PRIMARY_KEY,                                   NULL},
-  {"Time",              1, DB_COLUMN_TYPE_TEXT,  (DB_COLUMN_FLAG_NOT_NULL | DB_COLUMN_FLAG_DEFAULT_TIMESTAMP), NULL},
-  {"Temperature (C)",   2, DB_COLUMN_TYPE_FLOAT, (DB_COLUMN_FLAG_NOT_NULL | DB_COLUMN_FLAG_DEFAULT_NA),        NULL},
-  {"Battery Level (%)", 3, DB_COLUMN_TYPE_INT,   (DB_COLUMN_FLAG_NOT_NULL | DB_COLUMN_FLAG_DEFAULT_NA),        NULL},
+  {"Time",              1, DB_COLUMN_TYPE_TIME,  (DB_COLUMN_FLAG_NOT_NULL | DB_COLUMN_FLAG_DEFAULT_TIMESTAMP), NULL},
+  {"Temperature (C)",   2, DB_COLUMN_TYPE_FLOAT, 0,                                                            NULL},
+  {"Battery Level (%)", 3, DB_COLUMN_TYPE_INT,   0,                                                            NULL},
 };
 
 static db_table_list_entry_t static_tables[NUM_STATIC_TABLES] =
 {
-  {NULL, "Device List", DEVICE_TABLE_NUM_COLUMNS, device_table_columns, NULL, NULL, NULL, NULL}
+  {NULL, "Device List", DEVICE_TABLE_NUM_COLUMNS, device_table_columns, NULL, NULL, NULL, NULL, NULL}
 };
 
 
@@ -749,15 +1765,11 @@ int main (int argc, char *argv[])
           db_delete_table (db_info, &(static_tables[0]));
         }
 
-        table_list_entry = (db_table_list_entry_t *)malloc (sizeof (*table_list_entry));
+        table_list_entry = (db_table_list_entry_t *)calloc (1, sizeof (*table_list_entry));
         
         table_list_entry->title       = strdup ("Temperature Sensor");
         table_list_entry->num_columns = TEMPERATURE_TABLE_NUM_COLUMNS;
         table_list_entry->column      = temperature_table_columns;
-        table_list_entry->insert      = NULL;
-        table_list_entry->update      = NULL;
-        table_list_entry->delete      = NULL;
-        table_list_entry->select      = NULL;
 
         if ((db_create_table (db_info, table_list_entry)) > 0)
         {
@@ -770,19 +1782,74 @@ int main (int argc, char *argv[])
           printf ("Write table\n");
           while ((db_read_table (table_list_entry)) > 0)
           {
+            int8 *time;
+
             db_read_column (table_list_entry, 0, &column_value);
             printf ("%3d", column_value.integer);
             db_read_column (table_list_entry, 1, &column_value);
-            printf ("%22s", column_value.text);
+            time = clock_format_time (column_value.time);
+            printf ("%22s", time);
+            free (time);
             db_read_column (table_list_entry, 2, &column_value);
             printf ("%8.1f", column_value.decimal);
-            db_read_column (table_list_entry, 3, &column_value);
-            printf ("%7d\n", column_value.integer);
+
+            /* Battery level was never written */
+            if ((sqlite3_column_type ((sqlite3_stmt *)(table_list_entry->select), 3)) == SQLITE_NULL)
+            {
+              printf ("%7s\n", "NULL");
+            }
+            else
+            {
+              db_read_column (table_list_entry, 3, &column_value);
+              printf ("%7d\n", column_value.integer);
+            }
           }
 
           db_delete_table (db_info, table_list_entry);
         }
 
+        /* Insert cost per row on a fresh table, column writes with &
+           without the cached bind indexes against a whole row write */
+        {
+          db_column_value_t value[TEMPERATURE_TABLE_NUM_COLUMNS];
+          int pass;
+
+          for (pass = 0; (pass < 3) && ((db_create_table (db_info, table_list_entry)) > 0); pass++)
+          {
+            int32 *bind = table_list_entry->bind;
+            int32 start = clock_get_count ();
+            int32 row;
+
+            table_list_entry->bind = (pass == 0) ? NULL : bind;
+            db_begin (db_info);
+            for (row = 0; row < TEST_BENCH_ROWS; row++)
+            {
+              value[2].decimal = 20.0 + (row % 100)/10.0;
+              value[3].integer = row % 100;
+
+              if (pass < 2)
+              {
+                db_write_column (table_list_entry, DB_WRITE_INSERT, 2, &(value[2]));
+                db_write_column (table_list_entry, DB_WRITE_INSERT, 3, &(value[3]));
+                db_write_table (table_list_entry, DB_WRITE_INSERT);
+              }
+              else
+              {
+                db_write_row (table_list_entry, DB_WRITE_INSERT, value, 0);
+              }
+            }
+            db_commit (db_info);
+            table_list_entry->bind = bind;
+
+            printf ("%-20s %d rows, %d ms\n", (pass == 0) ? "Column, no cache" :
+                                               ((pass == 1) ? "Column, cache" : "Row"),
+                                               TEST_BENCH_ROWS, clock_get_count () - start);
+
+            db_delete_table (db_info, table_list_entry);
+          }
+        }
+
+        free (table_list_entry->title);
         free (table_list_entry);
 
         repeat--;
@@ -0,0 +1,162 @@
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "types.h"
+#include "util.h"
+
+/* Maximum number of event sources, including wakeup */
+#define EVENT_MAX_SOURCES  (16)
+
+typedef struct
+{
+  int32   file_desc;
+  void  (*callback)(void *);
+  void   *data;
+} event_source_t;
+
+/* File scope global variables */
+static int32 event_poll_fd = -1;
+static int32 event_wakeup_fd = -1;
+static event_source_t event_source[EVENT_MAX_SOURCES];
+
+
+static void event_wakeup (void *data)
+{
+  uint64_t count;
+
+  /* Drain, wakeups are level triggered */
+  (void)read (event_wakeup_fd, &count, sizeof (count));
+}
+
+int32 event_init (void)
+{
+  int32 status = -1;
+  int32 index;
+
+  for (index = 0; index < EVENT_MAX_SOURCES; index++)
+  {
+    event_source[index].file_desc = -1;
+  }
+
+  event_poll_fd = epoll_create1 (EPOLL_CLOEXEC);
+  if (event_poll_fd >= 0)
+  {
+    event_wakeup_fd = eventfd (0, (EFD_NONBLOCK | EFD_CLOEXEC));
+    if (event_wakeup_fd >= 0)
+    {
+      status = event_add (event_wakeup_fd, event_wakeup, NULL);
+    }
+    else
+    {
+      printf ("Unable to create wakeup event\n");
+    }
+  }
+  else
+  {
+    printf ("Unable to create event poll\n");
+  }
+
+  return status;
+}
+
+void event_deinit (void)
+{
+  close (event_wakeup_fd);
+  event_wakeup_fd = -1;
+  close (event_poll_fd);
+  event_poll_fd = -1;
+}
+
+int32 event_add (int32 file_desc, void (*callback)(void *), void *data)
+{
+  int32 status = -1;
+  int32 index;
+
+  for (index = 0; index < EVENT_MAX_SOURCES; index++)
+  {
+    if (event_source[index].file_desc < 0)
+    {
+      struct epoll_event poll_event;
+
+      event_source[index].file_desc = file_desc;
+      event_source[index].callback  = callback;
+      event_source[index].data      = data;
+
+      poll_event.events   = EPOLLIN;
+      poll_event.data.ptr = &(event_source[index]);
+
+      if ((epoll_ctl (event_poll_fd, EPOLL_CTL_ADD, file_desc, &poll_event)) == 0)
+      {
+        status = 1;
+      }
+      else
+      {
+        printf ("Unable to add event source %d\n", file_desc);
+        event_source[index].file_desc = -1;
+      }
+
+      break;
+    }
+  }
+
+  return status;
+}
+
+int32 event_remove (int32 file_desc)
+{
+  int32 status = -1;
+  int32 index;
+
+  for (index = 0; ((file_desc >= 0) && (index < EVENT_MAX_SOURCES)); index++)
+  {
+    if (event_source[index].file_desc == file_desc)
+    {
+      (void)epoll_ctl (event_poll_fd, EPOLL_CTL_DEL, file_desc, NULL);
+      event_source[index].file_desc = -1;
+      status = 1;
+
+      break;
+    }
+  }
+
+  return status;
+}
+
+void event_notify (void)
+{
+  uint64_t count = 1;
+
+  /* Async signal safe */
+  (void)write (event_wakeup_fd, &count, sizeof (count));
+}
+
+int32 event_wait (int32 millisec)
+{
+  struct epoll_event poll_event[EVENT_MAX_SOURCES];
+  int32 count;
+  int32 index;
+
+  count = epoll_wait (event_poll_fd, poll_event, EVENT_MAX_SOURCES, millisec);
+
+  for (index = 0; index < count; index++)
+  {
+    event_source_t *source = (event_source_t *)(poll_event[index].data.ptr);
+
+    if ((source->file_desc >= 0) && (source->callback != NULL))
+    {
+      source->callback (source->data);
+    }
+  }
+
+  if ((count < 0) && (errno == EINTR))
+  {
+    count = 0;
+  }
+
+  return count;
+}
@@ -91,4 +91,116 @@ static inline void list_remove (list_entry_t **head, list_entry_t *del_entry)
   }
 }
 
+/* Doubly linked list element, next comes first so the list can still be
+   walked like a singly linked one */
+struct dlist_entry
+{
+  struct dlist_entry *next;
+  struct dlist_entry *prev;
+};
+
+typedef struct dlist_entry dlist_entry_t;
+
+/* Doubly linked list head with tail & cached length, O(1) add, remove,
+   pop & concat */
+typedef struct
+{
+  dlist_entry_t *head;
+  dlist_entry_t *tail;
+  int            length;
+} dlist_head_t;
+
+
+#define DLIST_HEAD_INIT(name)  \
+  static dlist_head_t name = {NULL, NULL, 0}
+
+
+static inline void dlist_init (dlist_head_t *list)
+{
+  list->head   = NULL;
+  list->tail   = NULL;
+  list->length = 0;
+}
+
+static inline int dlist_length (dlist_head_t *list)
+{
+  return list->length;
+}
+
+static inline void dlist_add (dlist_head_t *list, dlist_entry_t *new_entry)
+{
+  new_entry->next = NULL;
+  new_entry->prev = list->tail;
+
+  if (list->tail != NULL)
+  {
+    list->tail->next = new_entry;
+  }
+  else
+  {
+    list->head = new_entry;
+  }
+
+  list->tail = new_entry;
+  list->length++;
+}
+
+static inline void dlist_remove (dlist_head_t *list, dlist_entry_t *del_entry)
+{
+  if (del_entry->prev != NULL)
+  {
+    del_entry->prev->next = del_entry->next;
+  }
+  else
+  {
+    list->head = del_entry->next;
+  }
+
+  if (del_entry->next != NULL)
+  {
+    del_entry->next->prev = del_entry->prev;
+  }
+  else
+  {
+    list->tail = del_entry->prev;
+  }
+
+  del_entry->next = NULL;
+  del_entry->prev = NULL;
+  list->length--;
+}
+
+static inline dlist_entry_t * dlist_pop (dlist_head_t *list)
+{
+  dlist_entry_t *entry = list->head;
+
+  if (entry != NULL)
+  {
+    dlist_remove (list, entry);
+  }
+
+  return entry;
+}
+
+/* Move all of new_list to the end of list */
+static inline void dlist_concat (dlist_head_t *list, dlist_head_t *new_list)
+{
+  if (new_list->head != NULL)
+  {
+    if (list->tail != NULL)
+    {
+      list->tail->next     = new_list->head;
+      new_list->head->prev = list->tail;
+    }
+    else
+    {
+      list->head = new_list->head;
+    }
+
+    list->tail    = new_list->tail;
+    list->length += new_list->length;
+    dlist_init (new_list);
+  }
+}
+
 #endif
@@ -9,6 +9,7 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <errno.h>
+#include <poll.h>
 
 /* Local/project headers */
 #include "types.h"
@@ -20,6 +21,7 @@ typedef struct
 {
   char       *vendor_id;
   char       *product_id;
+  char       *node;
   int         file_desc;
   usb_info_t  usb_info;
 } serial_device_t;
@@ -31,55 +33,100 @@ typedef struct
 #define SERIAL_TIMEOUT  (100)
 
 /* File scope global variables */
-static serial_device_t serial_device =
+static serial_device_t serial_device[SERIAL_MAX_DEVICES] =
 {
-  .vendor_id   = "2458",
-  .product_id  = "0001",
-  .file_desc   = -1,
-  .usb_info =
+  [0 ... (SERIAL_MAX_DEVICES - 1)] =
+  {
+    .vendor_id   = "2458",
+    .product_id  = "0001",
+    .node        = NULL,
+    .file_desc   = -1,
+    .usb_info =
+      {
+        .dev_node           = NULL,
+        .dev_sys_path       = NULL,
+        .dev_subsystem_node = NULL,
+        .bus_num            = 255,
+        .dev_num            = 255,
+        .next               = NULL
+      }
+  }
+}; 
+
+
+static int32 serial_in_use (int32 device, char *dev_sys_path)
+{
+  int32 index;
+
+  for (index = 0; index < SERIAL_MAX_DEVICES; index++)
+  {
+    if ((index != device) && (serial_device[index].usb_info.dev_sys_path != NULL) &&
+        ((strcmp (serial_device[index].usb_info.dev_sys_path, dev_sys_path)) == 0))
     {
-      .dev_node           = NULL,
-      .dev_sys_path       = NULL,
-      .dev_subsystem_node = NULL,
-      .bus_num            = 255,
-      .dev_num            = 255,
-      .next               = NULL
+      return 1;
     }
-}; 
+  }
 
+  return 0;
+}
+
+void serial_free (int32 device)
+{
+  free (serial_device[device].usb_info.dev_node);
+  serial_device[device].usb_info.dev_node = NULL;
+  free (serial_device[device].usb_info.dev_subsystem_node);
+  serial_device[device].usb_info.dev_subsystem_node = NULL;
+  serial_device[device].usb_info.bus_num = 255;
+  serial_device[device].usb_info.dev_num = 255;
+}
 
-void serial_free (void)
+void serial_set_node (int32 device, char *node)
 {
-  free (serial_device.usb_info.dev_node);
-  serial_device.usb_info.dev_node = NULL;
-  free (serial_device.usb_info.dev_subsystem_node);
-  serial_device.usb_info.dev_subsystem_node = NULL;
-  serial_device.usb_info.bus_num = 255;
-  serial_device.usb_info.dev_num = 255;
+  serial_device[device].node = node;
 }
 
-int32 serial_init (void)
+int32 serial_init (int32 device)
 {
   usb_info_t *usb_list = NULL;
   int status = -1;
 
-  if ((usb_find (serial_device.vendor_id, serial_device.product_id,
-                 "tty", &usb_list)) > 0)
+  if ((device < 0) || (device >= SERIAL_MAX_DEVICES))
+  {
+    /* No such device slot */
+  }
+  else if (serial_device[device].node != NULL)
+  {
+    /* Fixed device node (e.g. simulator pty), skip USB discovery */
+    if ((asprintf (&(serial_device[device].usb_info.dev_subsystem_node), "%s", serial_device[device].node)) > 0)
+    {
+      printf ("Trying to use %s\n", serial_device[device].usb_info.dev_subsystem_node);
+      if ((serial_open (device)) > 0)
+      {
+        status = 1;
+      }
+      else
+      {
+        serial_free (device);
+      }
+    }
+  }
+  else if ((usb_find (serial_device[device].vendor_id, serial_device[device].product_id,
+                      "tty", &usb_list)) > 0)
   {
     usb_info_t *usb_list_entry = NULL;
 
-    if (serial_device.usb_info.dev_sys_path != NULL)
+    if (serial_device[device].usb_info.dev_sys_path != NULL)
     {
       usb_list_entry = usb_list;
       while (usb_list_entry != NULL)
       {
-        if ((strcmp (serial_device.usb_info.dev_sys_path, usb_list_entry->dev_sys_path)) == 0)
+        if ((strcmp (serial_device[device].usb_info.dev_sys_path, usb_list_entry->dev_sys_path)) == 0)
         {
-          if (((asprintf (&(serial_device.usb_info.dev_node), "%s", usb_list_entry->dev_node)) > 0) &&
-              ((asprintf (&(serial_device.usb_info.dev_subsystem_node), "%s", usb_list_entry->dev_subsystem_node)) > 0))
+          if (((asprintf (&(serial_device[device].usb_info.dev_node), "%s", usb_list_entry->dev_node)) > 0) &&
+              ((asprintf (&(serial_device[device].usb_info.dev_subsystem_node), "%s", usb_list_entry->dev_subsystem_node)) > 0))
           {
-            serial_device.usb_info.bus_num = usb_list_entry->bus_num;
-            serial_device.usb_info.dev_num = usb_list_entry->dev_num;
+            serial_device[device].usb_info.bus_num = usb_list_entry->bus_num;
+            serial_device[device].usb_info.dev_num = usb_list_entry->dev_num;
           }
 
           break;
@@ -88,16 +135,16 @@ int32 serial_init (void)
         usb_list_entry = usb_list_entry->next;
       }
 
-      if (serial_device.usb_info.dev_subsystem_node != NULL)
+      if (serial_device[device].usb_info.dev_subsystem_node != NULL)
       {
-        printf ("Trying to use %s\n", serial_device.usb_info.dev_subsystem_node);
-        if ((serial_open ()) >  0)
+        printf ("Trying to use %s\n", serial_device[device].usb_info.dev_subsystem_node);
+        if ((serial_open (device)) >  0)
         {
           status = 1;
         }
         else
         {
-          serial_free ();
+          serial_free (device);
         }
       }
     }
@@ -106,25 +153,32 @@ int32 serial_init (void)
       usb_list_entry = usb_list;
       while (usb_list_entry != NULL)
       {
-        serial_device.usb_info = *usb_list_entry;
-        printf ("Trying to use %s\n", serial_device.usb_info.dev_subsystem_node);
-        if ((serial_open ()) >  0)
+        /* Adapter already taken by another device index */
+        if ((serial_in_use (device, usb_list_entry->dev_sys_path)) > 0)
+        {
+          usb_list_entry = usb_list_entry->next;
+          continue;
+        }
+
+        serial_device[device].usb_info = *usb_list_entry;
+        printf ("Trying to use %s\n", serial_device[device].usb_info.dev_subsystem_node);
+        if ((serial_open (device)) >  0)
         {
           status = 1;
 
-          if (((asprintf (&(serial_device.usb_info.dev_node), "%s", usb_list_entry->dev_node)) > 0) &&
-              ((asprintf (&(serial_device.usb_info.dev_sys_path), "%s", usb_list_entry->dev_sys_path)) > 0) &&
-              ((asprintf (&(serial_device.usb_info.dev_subsystem_node), "%s", usb_list_entry->dev_subsystem_node)) > 0))
+          if (((asprintf (&(serial_device[device].usb_info.dev_node), "%s", usb_list_entry->dev_node)) > 0) &&
+              ((asprintf (&(serial_device[device].usb_info.dev_sys_path), "%s", usb_list_entry->dev_sys_path)) > 0) &&
+              ((asprintf (&(serial_device[device].usb_info.dev_subsystem_node), "%s", usb_list_entry->dev_subsystem_node)) > 0))
           {
-            serial_device.usb_info.bus_num = usb_list_entry->bus_num;
-            serial_device.usb_info.dev_num = usb_list_entry->dev_num;
+            serial_device[device].usb_info.bus_num = usb_list_entry->bus_num;
+            serial_device[device].usb_info.dev_num = usb_list_entry->dev_num;
           }
 
           break;
         }
         else
         {
-          serial_device.usb_info.dev_sys_path = NULL;
+          serial_device[device].usb_info.dev_sys_path = NULL;
         }
 
         usb_list_entry = usb_list_entry->next;
@@ -145,25 +199,25 @@ int32 serial_init (void)
   return status;
 }
 
-void serial_deinit (void)
+void serial_deinit (int32 device)
 {
-  serial_close ();
-  serial_free ();
+  serial_close (device);
+  serial_free (device);
 }
 
-int32 serial_open (void)
+int32 serial_open (int32 device)
 {
-  serial_device.file_desc = open (serial_device.usb_info.dev_subsystem_node,
-                                  (O_RDWR | O_NOCTTY /*| O_NDELAY*/));
-  if (serial_device.file_desc > 0)
+  serial_device[device].file_desc = open (serial_device[device].usb_info.dev_subsystem_node,
+                                          (O_RDWR | O_NOCTTY | O_NONBLOCK));
+  if (serial_device[device].file_desc > 0)
   {
-    if ((lockf (serial_device.file_desc, F_TLOCK, 0)) == 0)
+    if ((lockf (serial_device[device].file_desc, F_TLOCK, 0)) == 0)
     {
       struct termios options;
       int tiocm;
 
       /* Get current serial port options */
-      tcgetattr (serial_device.file_desc, &options);
+      tcgetattr (serial_device[device].file_desc, &options);
 
       /* Set read/write baud rate */
       cfsetispeed (&options, B115200);
@@ -181,35 +235,53 @@ int32 serial_open (void)
       options.c_cc[VMIN]  = 0;
 
       /* Flush buffers and apply options */
-      tcsetattr (serial_device.file_desc, TCSAFLUSH, &options);
+      tcsetattr (serial_device[device].file_desc, TCSAFLUSH, &options);
 
       /* Set DTR/RTS */
-      ioctl (serial_device.file_desc, TIOCMGET, &tiocm);
+      ioctl (serial_device[device].file_desc, TIOCMGET, &tiocm);
       tiocm = TIOCM_DTR | TIOCM_RTS;
-      ioctl (serial_device.file_desc, TIOCMSET, &tiocm);
+      ioctl (serial_device[device].file_desc, TIOCMSET, &tiocm);
     }
     else
     {
-      printf ("Can't lock %s\n", serial_device.usb_info.dev_subsystem_node);
-      close (serial_device.file_desc);
-      serial_device.file_desc = -1;
+      printf ("Can't lock %s\n", serial_device[device].usb_info.dev_subsystem_node);
+      close (serial_device[device].file_desc);
+      serial_device[device].file_desc = -1;
     }
   }
   else
   {
-    printf("Can't open %s\n", serial_device.usb_info.dev_subsystem_node);
+    printf("Can't open %s\n", serial_device[device].usb_info.dev_subsystem_node);
   }
 
-  return serial_device.file_desc;
+  return serial_device[device].file_desc;
+}
+
+void serial_close (int32 device)
+{
+  tcdrain (serial_device[device].file_desc);
+  close (serial_device[device].file_desc);
+  serial_device[device].file_desc = -1;
 }
 
-void serial_close (void)
+static int32 serial_wait (int32 device, int16 events, int32 millisec)
 {
-  tcdrain (serial_device.file_desc);
-  close (serial_device.file_desc);
+  struct pollfd poll_fd;
+  int status;
+
+  poll_fd.fd      = serial_device[device].file_desc;
+  poll_fd.events  = events;
+  poll_fd.revents = 0;
+
+  do
+  {
+    status = poll (&poll_fd, 1, millisec);
+  } while ((status < 0) && (errno == EINTR));
+
+  return status;
 }
 
-int32 serial_tx (uint32 bytes, uint8 *buffer)
+int32 serial_tx (int32 device, uint32 bytes, uint8 *buffer)
 {
   ssize_t bytes_written = 0;
   
@@ -219,7 +291,7 @@ int32 serial_tx (uint32 bytes, uint8 *buffer)
     ssize_t i;
 #endif
   
-    bytes_written = write (serial_device.file_desc, buffer, bytes);
+    bytes_written = write (serial_device[device].file_desc, buffer, bytes);
 
     if (bytes_written > 0)
     {
@@ -235,6 +307,15 @@ int32 serial_tx (uint32 bytes, uint8 *buffer)
       bytes  -= bytes_written;
       buffer += bytes_written;
     }
+    else if ((bytes_written < 0) && (errno == EAGAIN))
+    {
+      /* Output queue full, wait for it to drain */
+      if ((serial_wait (device, POLLOUT, SERIAL_TIMEOUT)) <= 0)
+      {
+        bytes_written = 0;
+        break;
+      }
+    }
     else if ((bytes_written == 0) ||
              ((bytes_written < 0) && (errno != EINTR)))
     {
@@ -245,39 +326,43 @@ int32 serial_tx (uint32 bytes, uint8 *buffer)
   return bytes_written;
 }
 
-int32 serial_rx (uint32 bytes, uint8 *buffer)
+int32 serial_rx (int32 device, uint32 bytes, uint8 *buffer)
 {
-  ssize_t bytes_read = 0;
+  ssize_t bytes_read;
 
-  while (bytes > 0)
+  /* Single non-blocking read of whatever is available, up to bytes */
+  do
   {
-#ifdef DEBUG_VERBOSE
-    ssize_t i;
-#endif
-
-    bytes_read = read (serial_device.file_desc, buffer, bytes);
+    bytes_read = read (serial_device[device].file_desc, buffer, bytes);
+  } while ((bytes_read < 0) && (errno == EINTR));
 
-    if (bytes_read > 0)
-    {
+  if (bytes_read > 0)
+  {
 #ifdef DEBUG_VERBOSE
-      printf("UART RX (%d): ", bytes_read);
-      for (i = 0; i < bytes_read; i++)
-      {
-        printf("%02x", buffer[i]);
-      }
-      printf("\n");
-#endif
+    ssize_t i;
 
-      bytes  -= bytes_read;
-      buffer += bytes_read;
-    }
-    else if ((bytes_read == 0) ||
-             ((bytes_read < 0) && (errno != EINTR)))
+    printf("UART RX (%d): ", bytes_read);
+    for (i = 0; i < bytes_read; i++)
     {
-      break;
+      printf("%02x", buffer[i]);
     }
+    printf("\n");
+#endif
+  }
+  else if ((bytes_read < 0) && (errno == EAGAIN))
+  {
+    bytes_read = 0;
   }
 
   return bytes_read;
 }
 
+int32 serial_poll (int32 device, int32 millisec)
+{
+  return serial_wait (device, POLLIN, millisec);
+}
+
+int32 serial_get_handle (int32 device)
+{
+  return serial_device[device].file_desc;
+}
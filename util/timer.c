@@ -1,107 +1,331 @@
-
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
 #include <time.h>
+#include <sys/timerfd.h>
 
 #include "types.h"
 #include "util.h"
 
+/* Hashed timer wheel, one slot per tick, driven by a single timerfd.
+   Expiry callbacks run on the thread calling event_wait () */
+#define TIMER_TICK         (10)
+#define TIMER_WHEEL_BITS   (8)
+#define TIMER_WHEEL_SLOTS  (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK   (TIMER_WHEEL_SLOTS - 1)
+
+/* Timer pool, timer id carries the pool index & a generation count
+   so ids of expired or stopped timers never match a live one */
+#define TIMER_MAX_TIMERS   (128)
+#define TIMER_INDEX_BITS   (7)
+#define TIMER_INDEX_MASK   ((1 << TIMER_INDEX_BITS) - 1)
 
-static void timer_event (int event_id, siginfo_t *event_info, void *unused)
+struct timer_wheel_entry
 {
-  timer_info_t *timer_info = event_info->si_value.sival_ptr;
-  timer_info->callback (timer_info);
-  timer_delete ((timer_t)(timer_info->handle));
-  free (timer_info);
+  struct timer_wheel_entry *next;
+  struct timer_wheel_entry *prev;
+  uint32                    expire;
+  uint32                    generation;
+  timer_info_t              info;
+};
+
+typedef struct timer_wheel_entry timer_wheel_entry_t;
+
+/* File scope global variables */
+static int32 timer_file_desc = -1;
+static uint32 timer_tick = 0;
+static int32 timer_count = 0;
+static timer_wheel_entry_t *timer_wheel[TIMER_WHEEL_SLOTS];
+static timer_wheel_entry_t timer_pool[TIMER_MAX_TIMERS];
+static timer_wheel_entry_t *timer_free_list = NULL;
+static int32 timer_armed = 0;
+static uint32 timer_armed_tick = 0;
+
+
+static uint32 timer_get_tick (void)
+{
+  struct timespec current_time;
+
+  clock_gettime (CLOCK_MONOTONIC, &current_time);
+
+  return (((uint32)(current_time.tv_sec)) * (1000/TIMER_TICK)) +
+         ((uint32)(current_time.tv_nsec / (TIMER_TICK * 1000000)));
 }
 
-int32 timer_start (int32 millisec, int32 event,
-                   void (*callback)(void *), timer_info_t **timer_info)
+static timer_wheel_entry_t * timer_find (int32 timer_id)
 {
-  struct sigaction timer_action;
-  struct sigevent signal_event;
-  timer_t timer_id;
-  int status;
+  timer_wheel_entry_t *timer_entry;
 
-  *timer_info = (timer_info_t *)malloc (sizeof (**timer_info));
+  if ((timer_id < 0) || (timer_file_desc < 0))
+  {
+    return NULL;
+  }
 
-  /* Fill timer info */
-  (*timer_info)->millisec = millisec;
-  (*timer_info)->event    = event;
-  (*timer_info)->callback = callback;
-
-  /* Establish handler for timer signal */
-  timer_action.sa_flags     = SA_SIGINFO;
-  timer_action.sa_sigaction = timer_event;
-  sigemptyset (&timer_action.sa_mask);
-  status = sigaction (SIGRTMIN, &timer_action, NULL);
-  if (status == 0)
-  {
-    /* Create the timer */
-    signal_event.sigev_notify = SIGEV_SIGNAL;
-    signal_event.sigev_signo  = SIGRTMIN;
-    signal_event.sigev_value.sival_ptr = *timer_info;
-    status = timer_create (CLOCK_MONOTONIC, &signal_event, &timer_id);
-    if (status == 0)
+  timer_entry = &(timer_pool[timer_id & TIMER_INDEX_MASK]);
+
+  return (timer_entry->info.id == timer_id) ? timer_entry : NULL;
+}
+
+static void timer_unlink (timer_wheel_entry_t *timer_entry)
+{
+  if (timer_entry->prev != NULL)
+  {
+    timer_entry->prev->next = timer_entry->next;
+  }
+  else
+  {
+    timer_wheel[timer_entry->expire & TIMER_WHEEL_MASK] = timer_entry->next;
+  }
+
+  if (timer_entry->next != NULL)
+  {
+    timer_entry->next->prev = timer_entry->prev;
+  }
+
+  timer_count--;
+
+  /* Retire the id, back to pool */
+  timer_entry->info.id = -1;
+  timer_entry->generation++;
+  timer_entry->next    = timer_free_list;
+  timer_free_list      = timer_entry;
+}
+
+/* Arm timerfd to fire at the given tick */
+static void timer_arm_tick (uint32 tick)
+{
+  struct itimerspec timer_spec;
+  uint32 current_tick = timer_get_tick ();
+  uint32 ticks;
+
+  memset (&timer_spec, 0, sizeof (timer_spec));
+
+  if (((int32)(tick - current_tick)) > 0)
+  {
+    ticks = tick - current_tick;
+    timer_spec.it_value.tv_sec  = (ticks * TIMER_TICK) / 1000;
+    timer_spec.it_value.tv_nsec = ((ticks * TIMER_TICK) % 1000) * 1000000;
+  }
+  else
+  {
+    /* Already due */
+    timer_spec.it_value.tv_nsec = 1;
+  }
+
+  timer_armed      = 1;
+  timer_armed_tick = tick;
+  (void)timerfd_settime (timer_file_desc, 0, &timer_spec, NULL);
+}
+
+/* Arm timerfd for the nearest expiry within one wheel turn, else for a
+   full turn. Disarmed when the wheel is empty */
+static void timer_arm (void)
+{
+  struct itimerspec timer_spec;
+  uint32 ticks = 0;
+  int32 pending = 0;
+  uint32 count;
+
+  for (count = 1; ((count <= TIMER_WHEEL_SLOTS) && (ticks == 0)); count++)
+  {
+    timer_wheel_entry_t *timer_entry = timer_wheel[(timer_tick + count) & TIMER_WHEEL_MASK];
+
+    while (timer_entry != NULL)
     {
-      struct itimerspec timer_spec;
-
-      (*timer_info)->handle = (void *)timer_id;
-      timer_spec.it_value.tv_sec  = millisec / 1000;
-      timer_spec.it_value.tv_nsec = (millisec % 1000) * 1000000;
-      /* One-shot timer */
-      timer_spec.it_interval.tv_sec  = 0;
-      timer_spec.it_interval.tv_nsec = 0;
-  
-      /* Start timer */
-      status = timer_settime (timer_id, 0, &timer_spec, NULL);
-      if (status != 0)
+      pending = 1;
+      if (((int32)(timer_entry->expire - (timer_tick + count))) <= 0)
       {
-        timer_delete (timer_id);
-        printf ("Unable to start timer\n");
+        ticks = count;
+        break;
       }
+
+      timer_entry = timer_entry->next;
     }
-    else
+  }
+
+  if (pending)
+  {
+    if (ticks == 0)
     {
-      printf ("Unable to create timer\n");
+      ticks = TIMER_WHEEL_SLOTS;
     }
+
+    timer_arm_tick (timer_tick + ticks);
   }
   else
   {
-    printf ("Unable to set timer expiry handler\n");
+    memset (&timer_spec, 0, sizeof (timer_spec));
+    timer_armed = 0;
+    (void)timerfd_settime (timer_file_desc, 0, &timer_spec, NULL);
+  }
+}
+
+static void timer_expire (void *data)
+{
+  uint64_t count;
+  uint32 current_tick;
+  uint32 slots;
+
+  (void)read (timer_file_desc, &count, sizeof (count));
+
+  /* Catch up tick by tick, a whole turn covers every slot */
+  current_tick = timer_get_tick ();
+  slots        = current_tick - timer_tick;
+  if (slots > TIMER_WHEEL_SLOTS)
+  {
+    slots = TIMER_WHEEL_SLOTS;
+  }
+
+  while (slots > 0)
+  {
+    uint32 slot = (current_tick - (slots - 1)) & TIMER_WHEEL_MASK;
+    timer_wheel_entry_t *timer_entry = timer_wheel[slot];
+
+    while (timer_entry != NULL)
+    {
+      if (((int32)(timer_entry->expire - current_tick)) <= 0)
+      {
+        timer_info_t timer_info = timer_entry->info;
+
+        /* Callback may start or stop timers, rescan the slot after */
+        timer_unlink (timer_entry);
+        timer_info.callback (&timer_info);
+        timer_entry = timer_wheel[slot];
+      }
+      else
+      {
+        timer_entry = timer_entry->next;
+      }
+    }
+
+    slots--;
+  }
+
+  timer_tick = current_tick;
+  timer_arm ();
+}
+
+int32 timer_init (void)
+{
+  int32 status = -1;
+  int32 index;
+
+  memset (timer_wheel, 0, sizeof (timer_wheel));
+
+  timer_free_list = NULL;
+  timer_count     = 0;
+  timer_armed     = 0;
+  for (index = (TIMER_MAX_TIMERS - 1); index >= 0; index--)
+  {
+    timer_pool[index].info.id = -1;
+    timer_pool[index].next    = timer_free_list;
+    timer_free_list           = &(timer_pool[index]);
   }
 
-  if (status != 0)
+  timer_file_desc = timerfd_create (CLOCK_MONOTONIC, (TFD_NONBLOCK | TFD_CLOEXEC));
+  if (timer_file_desc >= 0)
+  {
+    timer_tick = timer_get_tick ();
+    status     = event_add (timer_file_desc, timer_expire, NULL);
+  }
+  else
   {
-    free (*timer_info);
+    printf ("Unable to create timer\n");
   }
 
   return status;
 }
 
-int32 timer_status (timer_info_t *timer_info)
+void timer_deinit (void)
 {
-  int current_count = -1;
+  (void)event_remove (timer_file_desc);
+  close (timer_file_desc);
+  timer_file_desc = -1;
+}
 
-  struct itimerspec timer_spec;
-  
-  if ((timer_gettime ((timer_t)(timer_info->handle), &timer_spec)) == 0)
+int32 timer_start (int32 millisec, int32 event, void (*callback)(void *))
+{
+  timer_wheel_entry_t *timer_entry = timer_free_list;
+  timer_wheel_entry_t **slot;
+  uint32 ticks;
+
+  if ((timer_entry == NULL) || (timer_file_desc < 0))
+  {
+    printf ("Unable to start timer\n");
+    return -1;
+  }
+
+  timer_free_list = timer_entry->next;
+
+  /* Wheel was idle, skip the catch up */
+  if (timer_count++ == 0)
+  {
+    timer_tick = timer_get_tick ();
+  }
+
+  ticks = (millisec + TIMER_TICK - 1) / TIMER_TICK;
+  if (ticks == 0)
+  {
+    ticks = 1;
+  }
+
+  /* Fill timer info */
+  timer_entry->info.id       = ((timer_entry->generation << TIMER_INDEX_BITS) |
+                                (timer_entry - timer_pool)) & 0x7fffffff;
+  timer_entry->info.millisec = millisec;
+  timer_entry->info.event    = event;
+  timer_entry->info.callback = callback;
+  timer_entry->expire        = timer_get_tick () + ticks;
+
+  /* Link at slot head */
+  slot = &(timer_wheel[timer_entry->expire & TIMER_WHEEL_MASK]);
+  timer_entry->prev = NULL;
+  timer_entry->next = *slot;
+  if (*slot != NULL)
+  {
+    (*slot)->prev = timer_entry;
+  }
+  *slot = timer_entry;
+
+  /* Re-arm only for an earlier expiry, a stopped timer leaves the fd
+     armed & timer_expire () rescans the wheel when it fires */
+  if ((!timer_armed) || (((int32)(timer_entry->expire - timer_armed_tick)) < 0))
+  {
+    timer_arm_tick (timer_entry->expire);
+  }
+
+  return timer_entry->info.id;
+}
+
+int32 timer_status (int32 timer_id)
+{
+  int32 current_count = -1;
+  timer_wheel_entry_t *timer_entry = timer_find (timer_id);
+
+  if (timer_entry != NULL)
   {
-    current_count = timer_info->millisec
-                     - ((timer_spec.it_value.tv_sec * 1000)
-                         + (timer_spec.it_value.tv_nsec / 1000000));
+    current_count = timer_entry->info.millisec
+                     - (((int32)(timer_entry->expire - (timer_get_tick ()))) * TIMER_TICK);
   }
 
   return current_count;
 }
 
-int32 timer_stop (timer_info_t *timer_info)
+int32 timer_stop (int32 timer_id)
 {
-  timer_t timer_id = (timer_t)(timer_info->handle);
-  free (timer_info);
-  return timer_delete (timer_id);
+  int32 status = -1;
+  timer_wheel_entry_t *timer_entry = timer_find (timer_id);
+
+  /* Stale ids (expired or stopped) are ignored */
+  if (timer_entry != NULL)
+  {
+    timer_unlink (timer_entry);
+    status = 1;
+  }
+
+  return status;
 }
 
 int32 clock_get_count (void)
@@ -131,26 +355,70 @@ int8 * clock_get_time (void)
   return strdup (current_time);
 }
 
+/* Wall clock in millisec since the epoch */
+int64 clock_get_epoch (void)
+{
+  int64 millisec = -1;
+  struct timespec current_time;
+
+  if ((clock_gettime (CLOCK_REALTIME, &current_time)) == 0)
+  {
+    millisec = ((int64)(current_time.tv_sec) * 1000)
+               + (current_time.tv_nsec / 1000000);
+  }
+
+  return millisec;
+}
+
+/* Local time of an epoch millisec value, as clock_get_time () */
+int8 * clock_format_time (int64 millisec)
+{
+  char current_time[50];
+  time_t utc;
+  struct tm *utc_tm;
+  
+  utc = (time_t)(millisec / 1000);
+  utc_tm = localtime (&utc);
+  strftime(current_time, 50, "%F %T", utc_tm);
+
+  return strdup (current_time);
+}
+
 #ifdef UTIL_TIMER_TEST
 
 void callback (void *timer_info)
 {
-  printf ("Timer %d expired\n", ((timer_info_t *)timer_info)->handle);
+  printf ("Timer %d expired\n", ((timer_info_t *)timer_info)->id);
 }
 
 int main (void)
 {
-  timer_info_t *timer_info = NULL;
-  int status;
+  int32 timer_id;
+  int32 start_time;
 
-  status = timer_start (3000, 0, callback, &timer_info);
-  sleep (4);
-  status = timer_start (3000, 0, callback, &timer_info);
-  sleep (2);
-  status = timer_stop (timer_info);
+  if (((event_init ()) > 0) && ((timer_init ()) > 0))
+  {
+    timer_id = timer_start (3000, 0, callback);
+    (void)timer_start (1000, 1, callback);
+    start_time = clock_get_count ();
+    while (((clock_get_count ()) - start_time) < 4000)
+    {
+      (void)event_wait (100);
+    }
+
+    /* Stale id, no effect */
+    printf ("Stop expired timer %d, status %d\n", timer_id, timer_stop (timer_id));
+
+    timer_id = timer_start (3000, 2, callback);
+    (void)event_wait (2000);
+    printf ("Stop timer %d, status %d\n", timer_id, timer_stop (timer_id));
+
+    timer_deinit ();
+  }
+
+  event_deinit ();
 
   return 0;
 }
 
 #endif
-
@@ -19,45 +19,74 @@ extern int32 os_create_thread (void * (*start_function)(void *), uint8 priority,
 extern int32 os_destroy_thread (void *handle);
 
 /* Serial API */
-extern int32 serial_init (void);
+#define SERIAL_MAX_DEVICES  (4)
 
-extern void serial_deinit (void);
+extern void serial_set_node (int32 device, char *node);
 
-extern int32 serial_open (void);
+extern int32 serial_init (int32 device);
 
-extern void serial_close (void);
+extern void serial_deinit (int32 device);
 
-extern int32 serial_tx (uint32 bytes, uint8 *buffer);
+extern int32 serial_open (int32 device);
 
-extern int32 serial_rx (uint32 bytes, uint8 *buffer);
+extern void serial_close (int32 device);
+
+extern int32 serial_tx (int32 device, uint32 bytes, uint8 *buffer);
+
+extern int32 serial_rx (int32 device, uint32 bytes, uint8 *buffer);
+
+extern int32 serial_poll (int32 device, int32 millisec);
+
+extern int32 serial_get_handle (int32 device);
+
+/* Event API */
+extern int32 event_init (void);
+
+extern void event_deinit (void);
+
+extern int32 event_add (int32 file_desc, void (*callback)(void *), void *data);
+
+extern int32 event_remove (int32 file_desc);
+
+extern void event_notify (void);
+
+extern int32 event_wait (int32 millisec);
 
 /* Timer API */
 typedef struct
 {
-  void    *handle;
+  int32    id;
   int32    millisec;
   int32    event;
   void   (*callback)(void *);
 } timer_info_t;
 
-extern int32 timer_start (int32 millisec, int32 event,
-                          void (*callback)(void *), timer_info_t **timer_info);
+extern int32 timer_init (void);
+
+extern void timer_deinit (void);
+
+extern int32 timer_start (int32 millisec, int32 event, void (*callback)(void *));
 
-extern int32 timer_status (timer_info_t *timer_info);
+extern int32 timer_status (int32 timer_id);
 
-extern int32 timer_stop (timer_info_t *timer_info);
+extern int32 timer_stop (int32 timer_id);
 
 extern int32 clock_get_count (void);
 
 extern int8 * clock_get_time (void);
 
+extern int64 clock_get_epoch (void);
+
+extern int8 * clock_format_time (int64 millisec);
+
 /* Database API */
 enum
 {
   DB_COLUMN_TYPE_TEXT = 0,
   DB_COLUMN_TYPE_INT,
   DB_COLUMN_TYPE_FLOAT,
-  DB_COLUMN_TYPE_BLOB
+  DB_COLUMN_TYPE_BLOB,
+  DB_COLUMN_TYPE_TIME
 };
 
 enum
@@ -67,7 +96,9 @@ enum
   DB_COLUMN_FLAG_DEFAULT_TIMESTAMP = 0x00000004,
   DB_COLUMN_FLAG_DEFAULT_NA        = 0x00000008,
   DB_COLUMN_FLAG_UPDATE_KEY        = 0x00000010,
-  DB_COLUMN_FLAG_UPDATE_VALUE      = 0x00000020
+  DB_COLUMN_FLAG_UPDATE_VALUE      = 0x00000020,
+  DB_COLUMN_FLAG_INDEX_KEY         = 0x00000040,
+  DB_COLUMN_FLAG_UNIQUE            = 0x00000080
 };
 
 enum
@@ -80,6 +111,7 @@ enum
 typedef union
 {
   int32  integer;
+  int64  time;
   float  decimal;
   int8  *text;
   struct
@@ -98,6 +130,8 @@ typedef struct
   int8                        *tag;
 } db_column_entry_t;
 
+struct db_info;
+
 struct db_table_list_entry
 {
   struct db_table_list_entry *next;
@@ -108,15 +142,41 @@ struct db_table_list_entry
   void                       *update;
   void                       *delete;
   void                       *select;
+  struct db_info             *db_info;
+  int32                      *bind;
 };
 
 typedef struct db_table_list_entry db_table_list_entry_t;
 
-typedef struct
+/* Writes are grouped in one transaction till either limit is hit */
+#define DB_BATCH_ROWS     (512)
+#define DB_BATCH_TIMEOUT  (2000)
+
+/* Writer thread queue, rows per queue (power of 2), values per row
+   & bytes of text/blob data kept in the row */
+#define DB_QUEUE_SIZE     (256)
+#define DB_ROW_COLUMNS    (8)
+#define DB_ROW_DATA_SIZE  (96)
+
+struct db_queue;
+
+/* One connection per file, shared by all its users so that their
+   batched writes don't lock each other out */
+struct db_info
 {
+  struct db_info        *next;
+  int8                  *file_name;
+  uint32                 users;
   void                  *handle;
   db_table_list_entry_t *table_list;
-} db_info_t;
+  uint32                 batch_rows;
+  int32                  batch_timeout;
+  uint32                 batch_length;
+  int32                  batch_start;
+  struct db_queue       *queue;
+};
+
+typedef struct db_info db_info_t;
 
 extern int32 db_read_column (db_table_list_entry_t *table_list_entry,
                              uint32 index, db_column_value_t *column_value);
@@ -128,10 +188,28 @@ extern int32 db_read_table (db_table_list_entry_t *table_list_entry);
 
 extern int32 db_write_table (db_table_list_entry_t *table_list_entry, uint8 type);
 
+extern int32 db_write_row (db_table_list_entry_t *table_list_entry, uint8 type,
+                           db_column_value_t *value, uint32 null_mask);
+
 extern int32 db_create_table (db_info_t *db_info, db_table_list_entry_t *table_list_entry);
 
 extern int32 db_delete_table (db_info_t *db_info, db_table_list_entry_t *table_list_entry);
 
+extern int32 db_merge_table (db_info_t *db_info, int8 *title,
+                             db_table_list_entry_t *table_list_entry, int32 index, int32 value);
+
+extern int32 db_begin (db_info_t *db_info);
+
+extern int32 db_commit (db_info_t *db_info);
+
+extern int32 db_flush (db_info_t *db_info);
+
+extern void db_set_batch (db_info_t *db_info, uint32 rows, int32 millisec);
+
+extern int32 db_start_writer (db_info_t *db_info);
+
+extern int32 db_stop_writer (db_info_t *db_info);
+
 extern int32 db_open (int8 *file_name, db_info_t **db_info);
 
 extern int32 db_close (db_info_t *db_info);